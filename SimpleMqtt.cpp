@@ -10,28 +10,293 @@
 #endif
 
 #include "base64_util.h"
+#include "binframe_util.h"
+#include "lzframe_util.h"
+#include "numfmt_util.h"
+#include "trace_util.h"
 
-// for mqtt message id's cache
-struct mqtt_msgid_item mqtt_mids[MQTT_MSG_ID_LIST_SIZE];
-uint16_t mqtt_mids_idx = 0;
+#include <new>
 
-// raw message cache
-struct mc_item mc_db[MAX_MC_ITEMS];
-uint16_t mc_used_bytes = 0;
-uint16_t mc_used_slots = 0;
-telemetry_t_st telemetry_t;
+#ifdef ESP32
+#define MC_LOCK() portENTER_CRITICAL(&mc_mux)
+#define MC_UNLOCK() portEXIT_CRITICAL(&mc_mux)
+#else
+#define MC_LOCK()
+#define MC_UNLOCK()
+#endif
+
+#ifdef MQTT_TRACE
+#define TRACE(type, id, arg) trace_record(type, trace_inst, id, arg)
+#else
+#define TRACE(type, id, arg)
+#endif
+
+// node_tx() events
+enum {
+  NODE_TX_SENT,
+  NODE_TX_ACKED,
+  NODE_TX_ACKED_RESENT,  // no RTT sample (Karn)
+  NODE_TX_RESENT,
+  NODE_TX_LOST
+};
+
+// instances the received frames go to, see mqtt_recv_cb()
+static SimpleMQTT *mqtt_instances[MQTT_MAX_INSTANCES];
+// instance waiting in send() for the reply of a synchronous send
+static SimpleMQTT *mqtt_sync_sender = NULL;
+
+// Cached frames live in three pools of fixed size blocks, one block per
+// frame. Free blocks form an intrusive LIFO list (the next index is kept
+// in the first two bytes of the block), blocks never handed out yet are
+// taken from `bump`.
+static_assert(MC_SMALL_BLOCK_SIZE >= 2 && MC_LARGE_BLOCK_SIZE <= 250 &&
+                  MC_SMALL_BLOCK_SIZE <= MC_MEDIUM_BLOCK_SIZE &&
+                  MC_MEDIUM_BLOCK_SIZE <= MC_LARGE_BLOCK_SIZE,
+              "cache block sizes must be within 2..250 bytes, ascending");
+
+static uint8_t *mc_slab_alloc(struct mc_slab *s) {
+  uint16_t b;
+  if (s->free_head != 0) {
+    b = s->free_head - 1;
+    memcpy(&s->free_head, s->blocks + (uint32_t)b * s->block_size,
+           sizeof(s->free_head));
+  } else if (s->bump < s->count) {
+    b = s->bump++;
+  } else {
+    return NULL;
+  }
+  if (++s->used > s->used_max) s->used_max = s->used;
+  return s->blocks + (uint32_t)b * s->block_size;
+}
+
+static void mc_slab_free(struct mc_slab *s, uint8_t *p) {
+  uint16_t b = (p - s->blocks) / s->block_size;
+  memcpy(p, &s->free_head, sizeof(s->free_head));
+  s->free_head = b + 1;
+  s->used--;
+}
+
+// a block for a frame of `size` bytes, of the smallest size it fits in
+uint8_t *SimpleMQTT::mc_block_alloc(int size) {
+  uint8_t *p = NULL;
+  if (size <= MC_SMALL_BLOCK_SIZE) p = mc_slab_alloc(&mc_small_slab);
+  if (p == NULL && size <= MC_MEDIUM_BLOCK_SIZE)
+    p = mc_slab_alloc(&mc_medium_slab);
+  if (p == NULL && size <= MC_LARGE_BLOCK_SIZE)
+    p = mc_slab_alloc(&mc_large_slab);
+  return p;
+}
+
+mc_slab *SimpleMQTT::mc_block_slab(const uint8_t *p) {
+  if (p >= &mc_small_blocks[0][0] &&
+      p < &mc_small_blocks[0][0] + sizeof(mc_small_blocks))
+    return &mc_small_slab;
+  if (p >= &mc_medium_blocks[0][0] &&
+      p < &mc_medium_blocks[0][0] + sizeof(mc_medium_blocks))
+    return &mc_medium_slab;
+  return &mc_large_slab;
+}
+
+void SimpleMQTT::mc_block_free(uint8_t *p) {
+  mc_slab_free(mc_block_slab(p), p);
+}
+
+uint16_t SimpleMQTT::mc_block_size(const uint8_t *p) {
+  return mc_block_slab(p)->block_size;
+}
+
+static inline uint32_t mc_index_home(uint32_t reply_id) {
+  reply_id ^= reply_id >> 16;
+  reply_id *= 0x45D9F3B;
+  reply_id ^= reply_id >> 16;
+  return reply_id & (MC_INDEX_SIZE - 1);
+}
+
+void SimpleMQTT::mc_index_put(uint32_t reply_id, uint16_t idx) {
+  if (reply_id <= 1) return;
+  uint32_t pos = mc_index_home(reply_id);
+  while (mc_index[pos].reply_id != 0) pos = (pos + 1) & (MC_INDEX_SIZE - 1);
+  mc_index[pos].reply_id = reply_id;
+  mc_index[pos].idx = idx;
+}
+
+int16_t SimpleMQTT::mc_index_get(uint32_t reply_id) {
+  if (reply_id <= 1) return -1;
+  for (uint32_t pos = mc_index_home(reply_id); mc_index[pos].reply_id != 0;
+       pos = (pos + 1) & (MC_INDEX_SIZE - 1)) {
+    if (mc_index[pos].reply_id == reply_id) return mc_index[pos].idx;
+  }
+  return -1;
+}
+
+void SimpleMQTT::mc_index_del(uint32_t reply_id, uint16_t idx) {
+  if (reply_id <= 1) return;
+  const uint32_t mask = MC_INDEX_SIZE - 1;
+  uint32_t hole = mc_index_home(reply_id);
+  for (;; hole = (hole + 1) & mask) {
+    if (mc_index[hole].reply_id == 0) return;  // not indexed
+    if (mc_index[hole].reply_id == reply_id && mc_index[hole].idx == idx)
+      break;
+  }
+  // backward shift deletion, keeps probe chains intact without tombstones
+  for (uint32_t j = (hole + 1) & mask; mc_index[j].reply_id != 0;
+       j = (j + 1) & mask) {
+    uint32_t home = mc_index_home(mc_index[j].reply_id);
+    if (((j - home) & mask) < ((j - hole) & mask)) continue;
+    mc_index[hole] = mc_index[j];
+    hole = j;
+  }
+  mc_index[hole].reply_id = 0;
+}
+
+// millis() wraps every ~49 days, compare timestamps by their distance
+static inline bool ts_before(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) < 0;
+}
+
+// retransmission schedule: binary min-heap of mc_db indexes ordered by
+// expire_ts, so resend_loop only looks at entries that are due
+
+void SimpleMQTT::mc_sched_swap(uint16_t a, uint16_t b) {
+  uint16_t t = mc_sched[a];
+  mc_sched[a] = mc_sched[b];
+  mc_sched[b] = t;
+  mc_sched_pos[mc_sched[a]] = a + 1;
+  mc_sched_pos[mc_sched[b]] = b + 1;
+}
+
+void SimpleMQTT::mc_sched_up(uint16_t pos) {
+  while (pos > 0) {
+    uint16_t parent = (pos - 1) / 2;
+    if (!ts_before(mc_db[mc_sched[pos]].expire_ts,
+                   mc_db[mc_sched[parent]].expire_ts))
+      break;
+    mc_sched_swap(pos, parent);
+    pos = parent;
+  }
+}
+
+void SimpleMQTT::mc_sched_down(uint16_t pos) {
+  for (;;) {
+    uint16_t l = 2 * pos + 1;
+    uint16_t m = pos;
+    if (l < mc_sched_len &&
+        ts_before(mc_db[mc_sched[l]].expire_ts, mc_db[mc_sched[m]].expire_ts))
+      m = l;
+    if (l + 1 < mc_sched_len && ts_before(mc_db[mc_sched[l + 1]].expire_ts,
+                                          mc_db[mc_sched[m]].expire_ts))
+      m = l + 1;
+    if (m == pos) break;
+    mc_sched_swap(pos, m);
+    pos = m;
+  }
+}
+
+// (re)schedule mc_db[i] after its expire_ts has been set
+void SimpleMQTT::mc_sched_set(uint16_t i) {
+  uint16_t pos;
+  if (mc_sched_pos[i] == 0) {
+    pos = mc_sched_len++;
+    mc_sched[pos] = i;
+    mc_sched_pos[i] = pos + 1;
+  } else {
+    pos = mc_sched_pos[i] - 1;
+    mc_sched_down(pos);
+  }
+  mc_sched_up(pos);
+}
+
+void SimpleMQTT::mc_sched_remove(uint16_t i) {
+  if (mc_sched_pos[i] == 0) return;
+  uint16_t pos = mc_sched_pos[i] - 1;
+  uint16_t last = --mc_sched_len;
+  mc_sched_pos[i] = 0;
+  if (pos == last) return;
+  mc_sched[pos] = mc_sched[last];
+  mc_sched_pos[mc_sched[pos]] = pos + 1;
+  mc_sched_down(pos);
+  mc_sched_up(pos);
+}
+
+// The text or binary frame inside a compressed one (decompressed into
+// buf), the frame itself when it isn't compressed, NULL if malformed.
+static const uint8_t *frame_plain(const uint8_t *data, int *size,
+                                  uint8_t *buf, int buf_size) {
+  if (!lzframe_is(data, *size)) return data;
+  *size = lzframe_decompress(buf, buf_size, data, *size);
+  return *size > 0 ? buf : NULL;
+}
+
+// the mesh has a single receive callback, every instance sees every frame
+static void mqtt_recv_cb(const uint8_t *data, int len, uint32_t replyPrt) {
+  if (len <= 0) return;
+  for (uint8_t i = 0; i < MQTT_MAX_INSTANCES; i++)
+    if (mqtt_instances[i] != NULL)
+      mqtt_instances[i]->receive(data, len, replyPrt);
+}
+
+static_assert((MQTT_RX_QUEUE_LEN & (MQTT_RX_QUEUE_LEN - 1)) == 0,
+              "MQTT_RX_QUEUE_LEN must be a power of two");
+static_assert((MQTT_ACK_QUEUE_LEN & (MQTT_ACK_QUEUE_LEN - 1)) == 0,
+              "MQTT_ACK_QUEUE_LEN must be a power of two");
 
 SimpleMQTT::SimpleMQTT(int ttl, const char *deviceName, uint16_t tryCount,
                        int timeoutMs, uint16_t backoffMs) {
   buffer[0] = 0;
+  memset(mc_db, 0, sizeof(mc_db));
+  mc_used_slots = 0;
+  mc_free_top = 0;
+  mc_slot_bump = 0;
+  mc_small_slab = {&mc_small_blocks[0][0], MC_SMALL_BLOCK_SIZE,
+                   MC_SMALL_BLOCKS, 0, 0, 0, 0};
+  mc_medium_slab = {&mc_medium_blocks[0][0], MC_MEDIUM_BLOCK_SIZE,
+                    MC_MEDIUM_BLOCKS, 0, 0, 0, 0};
+  mc_large_slab = {&mc_large_blocks[0][0], MC_LARGE_BLOCK_SIZE,
+                   MC_LARGE_BLOCKS, 0, 0, 0, 0};
+  memset(mc_sched_pos, 0, sizeof(mc_sched_pos));
+  mc_sched_len = 0;
+  mc_acked_head = 0;
+  mc_acked_tail = 0;
+  memset(mc_index, 0, sizeof(mc_index));
+  mc_waiting_head = 0;
+  mc_waiting_len = 0;
+  cwnd = MQTT_CWND_INIT;
+  cwnd_acks = 0;
+  cwnd_cut_ts = millis() - MQTT_RTO_MAX_MS;
+  memset(&cc_stats, 0, sizeof(cc_stats));
+  lost_buf[0] = 0;
+  rx_head = 0;
+  rx_tail = 0;
+  ack_head = 0;
+  ack_tail = 0;
+  memset(&rx_stats, 0, sizeof(rx_stats));
+  mqtt_dedup_use(mqtt_dedup_node, mqtt_dedup_node_index, MQTT_DEDUP_NODE_SIZE,
+                 MQTT_DEDUP_NODE_INDEX_SIZE);
+  memset(mqtt_qos2, 0, sizeof(mqtt_qos2));
+  qos2_hold = -1;
+  mqtt_dedup_ttl_ms = MQTT_DEDUP_TTL_MS;
+  mqtt_alias_tx_cnt = 0;
+  mqtt_alias_tx_base = 0;
+  _decompress_prev[0] = 0;
   this->ttl = ttl;
   this->tryCount = tryCount;
   this->timeoutMs = timeoutMs;
   this->backoffMs = backoffMs;
+  rto_reset();
   memset(&telemetry_t, 0, sizeof(telemetry_t));
   telemetry_t.rtt_min = 0xFFFF;
+  memset(&stats, 0, sizeof(stats));
   this->op_mode = MODE_NODE_STD;
   this->rawCallBack = NULL;
+  this->publishCallBack = NULL;
+  this->viewCallBack = NULL;
+  this->_topic = NULL;
+  this->_value = NULL;
+  this->_prev_topic = NULL;
+  this->_prev_topic_len = 0;
+  this->handlers_cnt = 0;
+  this->precisions_cnt = 0;
+  memset(handler_index, 0, sizeof(handler_index));
   char ssid[13];
   #ifdef ESP8266
     sniprintf(ssid, 13, "%X", ESP.getChipId());
@@ -42,114 +307,244 @@ SimpleMQTT::SimpleMQTT(int ttl, const char *deviceName, uint16_t tryCount,
   #endif
   myDeviceName = ssid;
   // myDeviceName = deviceName;
-  mc_used_bytes = 0;
-  mc_used_slots = 0;
-  static SimpleMQTT *myself = this;
+#ifdef ESP32
+  // the receive callback runs in the WiFi task
+  set_deferred_receive(true);
+#endif
 
-  espNowFloodingMesh_RecvCB(
-      [](const uint8_t *data, int len, uint32_t replyPrt) {
-        if (len > 0) {
-          myself->parse(data, len, replyPrt);  // Parse simple Mqtt protocol
-                                               // messages
-        }
-      });
+  uint8_t i = 0;
+  for (; i < MQTT_MAX_INSTANCES && mqtt_instances[i] != NULL; i++)
+    ;
+  trace_inst = i;
+  if (i < MQTT_MAX_INSTANCES) {
+    mqtt_instances[i] = this;
+  } else {
+#ifdef DEBUG_PRINTS
+    Serial.println("E: more than MQTT_MAX_INSTANCES SimpleMQTT objects");
+#endif
+  }
+  espNowFloodingMesh_RecvCB(mqtt_recv_cb);
 }
 
-SimpleMQTT::~SimpleMQTT() {}
+SimpleMQTT::~SimpleMQTT() {
+  for (uint8_t i = 0; i < MQTT_MAX_INSTANCES; i++)
+    if (mqtt_instances[i] == this) mqtt_instances[i] = NULL;
+  if (mqtt_sync_sender == this) mqtt_sync_sender = NULL;
+  delete gw;
+  delete tx;
+  delete[] rx_queue;
+}
 
 void SimpleMQTT::setTimeouts(uint16_t tryCount, int timeoutMs,
                              uint16_t backoffMs) {
   this->tryCount = tryCount;
   this->timeoutMs = timeoutMs;
   this->backoffMs = backoffMs;
+  rto_reset();
+}
+
+void SimpleMQTT::set_adaptive_rto(bool enable) {
+  rto_adaptive = enable;
+  rto_reset();
+}
+
+uint16_t SimpleMQTT::get_rto(void) { return rto_adaptive ? rto : timeoutMs; }
+
+static uint16_t rto_clamp(int32_t ms) {
+  if (ms < MQTT_RTO_MIN_MS) return MQTT_RTO_MIN_MS;
+  if (ms > MQTT_RTO_MAX_MS) return MQTT_RTO_MAX_MS;
+  return ms;
+}
+
+void SimpleMQTT::rto_reset(void) {
+  rto_srtt_x8 = 0;
+  rto_rttvar_x4 = 0;
+  rto = rto_clamp(timeoutMs);
+}
+
+// RFC 6298 2.2/2.3: SRTT += (R - SRTT) / 8, RTTVAR += (|R - SRTT| - RTTVAR)
+// / 4, RTO = SRTT + 4 * RTTVAR. Only frames ACKed on their first
+// transmission are sampled (Karn), so a valid sample also ends a backoff.
+void SimpleMQTT::rto_sample(uint32_t rtt) {
+  int32_t r = rtt > MQTT_RTO_MAX_MS ? MQTT_RTO_MAX_MS : (int32_t)rtt;
+  if (rto_srtt_x8 == 0) {
+    rto_srtt_x8 = (r << 3) | 1;  // never 0 again
+    rto_rttvar_x4 = r << 1;
+  } else {
+    int32_t err = r - (rto_srtt_x8 >> 3);
+    rto_srtt_x8 += err;
+    if (err < 0) err = -err;
+    rto_rttvar_x4 += err - (rto_rttvar_x4 >> 2);
+  }
+  // MQTT_RTO_MIN_MS in place of the clock granularity G: steady round
+  // trips make RTTVAR ~0, mesh jitter would then cause resends
+  int32_t var =
+      rto_rttvar_x4 > MQTT_RTO_MIN_MS ? rto_rttvar_x4 : MQTT_RTO_MIN_MS;
+  rto = rto_clamp((rto_srtt_x8 >> 3) + var);
+}
+
+// RFC 6298 5.5: the timeout of the resent frame doubles. The shared RTO
+// isn't raised: frames resent on a lossy link would hold back every other
+// frame (and node) for the rest of a burst.
+uint16_t SimpleMQTT::rto_backoff(uint16_t timeout) {
+  return rto_clamp((int32_t)timeout * 2);
 }
 
 
 const char *SimpleMQTT::resend_loop(void) {
-  static char buf[32] = "";
+  char *buf = lost_buf;
 
-  // check message cache for timeouts
-  for (uint16_t i = 0; i < MAX_MC_ITEMS; i++) {
-    if (mc_db[i].msg_ptr == NULL) continue;
+  if (rx_deferred) process_incoming();
 
-    if (mc_db[i].reply_id == 0) {
-      // found confirmed (ACK received) message, delete from cache
-      int16_t ret = mc_del_msg_idx(i);
-#ifdef DEBUG_PRINTS
-      Serial.printf(
-          "\n(- FREE idx: %d ret: %d Used Fmc_db bytes: %u, Fused_slots: %u, "
-          "Fcount_slots: %u)\n",
-          i, ret, mc_used_bytes, mc_used_slots, mc_count_used_slots());
-#endif
+  // a receiver asked for full topics (ARST)
+  if (alias_rst_pending) {
+    alias_rst_pending = false;
+    alias_reset();
+  }
+
+  ack_flush();
+
+  // coalesced commands waiting too long
+  if (coalesce_len > 0 && millis() - coalesce_ts >= coalesce_ms && !flush()) {
+    coalesce_ts = millis();  // try again a window later
+    MC_LOCK();
+    stats.flush_failed++;
+    MC_UNLOCK();
+  }
+
+  // free messages confirmed (ACK received) since the last call
+  uint16_t acked_tail = mc_acked_tail;
+  while (acked_tail != __atomic_load_n(&mc_acked_head, __ATOMIC_ACQUIRE)) {
+    uint16_t i = mc_acked[acked_tail];
+    acked_tail = (acked_tail + 1) % (MAX_MC_ITEMS + 1);
+    __atomic_store_n(&mc_acked_tail, acked_tail, __ATOMIC_RELEASE);
+    if (mc_db[i].msg_ptr == NULL || mc_db[i].reply_id != 0) continue;
+    if (mc_db[i].qos == MC_QOS_REL) {
+      mc_del_msg_idx(i);
       continue;
     }
+    if (mc_db[i].qos == 2) mc_release(i);
+    MC_LOCK();
+    hist_add(&stats.retries, mc_db[i].resends);
+    stats.delivered++;
+    MC_UNLOCK();
+    int16_t ret = mc_del_msg_idx(i);
+    cc_on_ack();
+#ifdef DEBUG_PRINTS
+    Serial.printf(
+        "\n(- FREE idx: %d ret: %d Fused_blocks: %u/%u/%u, Fused_slots: %u, "
+        "Fcount_slots: %u)\n",
+        i, ret, mc_small_slab.used, mc_medium_slab.used, mc_large_slab.used,
+        mc_used_slots, mc_count_used_slots());
+#endif
+  }
 
-    if (mc_db[i].expire_ts > millis()) continue;
+  // the window may have opened
+  cc_send_waiting();
 
-    if (mc_db[i].try_cnt-- > 0) {
-      // is it delayed ACK ?
-      if (strcmp((char *)mc_db[i].msg_ptr, "ACK") == 0) {
-        espNowFloodingMesh_sendReply(mc_db[i].msg_ptr, mc_db[i].size,
-                                     mc_db[i].ttl, mc_db[i].reply_id);
+  // handle due messages in deadline order
+  uint32_t now = millis();
+  while (mc_sched_len > 0) {
+    uint16_t i = mc_sched[0];
+
+    if (mc_db[i].reply_id == 0) {
+      // confirmed, but not handed over (mc_acked overflow)
+      if (mc_db[i].qos == MC_QOS_REL) {
         mc_del_msg_idx(i);
-#ifdef DEBUG_PRINTS
-        Serial.print("Send Delayed ACK: ");
-        Serial.println(mc_db[i].reply_id);
-#endif
         continue;
       }
-      // resend the message again
-#ifdef ESP32
-      // Begin of critical section.
-      // Critical sections are used as a valid protection method
-      // against simultaneous access in vanilla FreeRTOS.
-      // Disable the scheduler and call portDISABLE_INTERRUPTS. This prevents
-      // context switches and servicing of ISRs during a critical section.
-      portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
-      portENTER_CRITICAL(&mux);
-#endif
-      if (mc_db[i].reply_id != 0 && mc_db[i].msg_ptr != NULL) {
+      if (mc_db[i].qos == 2) mc_release(i);
+      MC_LOCK();
+      hist_add(&stats.retries, mc_db[i].resends);
+      stats.delivered++;
+      MC_UNLOCK();
+      mc_del_msg_idx(i);
+      cc_on_ack();
+      continue;
+    }
+
+    if (ts_before(now, mc_db[i].expire_ts)) break;
+
+    if (mc_db[i].try_cnt-- > 0) {
+      // resend the message again, an ACK may arrive meanwhile
+      MC_LOCK();
+      bool acked = mc_db[i].reply_id == 0;
+      if (!acked) {
+        // keep answering ACKs of the previous transmission
+        mc_index_del(mc_db[i].reply_id_prev, i);
         mc_db[i].reply_id_prev = mc_db[i].reply_id;
         mc_db[i].reply_id = 1;
-      } else {
-#ifdef ESP32
-        portEXIT_CRITICAL(&mux);
-#endif
-        continue;
       }
-#ifdef ESP32
-      portEXIT_CRITICAL(&mux);
-#endif
-      mc_db[i].reply_id = espNowFloodingMesh_sendAndHandleReply(
+      MC_UNLOCK();
+      if (acked) continue;  // freed on the next pass
+      uint32_t reply_id = espNowFloodingMesh_sendAndHandleReply(
           mc_db[i].msg_ptr, mc_db[i].size, mc_db[i].ttl, NULL);
-      mc_db[i].timeout = mc_db[i].timeout + SECURERANDOM(mc_db[i].timeout / 8,
-                                                         mc_db[i].timeout / 4);
+      MC_LOCK();
+      if (mc_db[i].reply_id == 1) {
+        mc_db[i].reply_id = reply_id;
+        mc_index_put(reply_id, i);
+      }
+      MC_UNLOCK();
+      mc_db[i].resends++;
+      cc_on_resend();
+      if (mc_db[i].dest) {
+        MC_LOCK();
+        node_tx(mc_db[i].dest, NODE_TX_RESENT, 0);
+        MC_UNLOCK();
+      }
+      if (rto_adaptive)
+        mc_db[i].timeout = rto_backoff(mc_db[i].timeout);
+      else
+        mc_db[i].timeout = mc_db[i].timeout +
+                           SECURERANDOM(mc_db[i].timeout / 8,
+                                        mc_db[i].timeout / 4);
       mc_db[i].expire_ts = millis() + mc_db[i].timeout;
+      mc_sched_set(i);
       telemetry_t.resend_pkt++;
+      TRACE(TRACE_RESEND, reply_id, mc_db[i].try_cnt);
 #ifdef DEBUG_PRINTS
       Serial.print("Resending: ");
       Serial.print(mc_db[i].reply_id);
       Serial.print(" timeout:");
       Serial.println(mc_db[i].timeout);
-      // Serial.print("Used mc_db bytes: ");
-      // Serial.print(mc_used_bytes);
+      // Serial.print("Used mc_db blocks: ");
+      // Serial.print(mc_small_slab.used + mc_medium_slab.used +
+      //              mc_large_slab.used);
       // Serial.print(" used_slots: ");
       // Serial.print(mc_used_slots);
       // Serial.print(" count_slots: ");
       // Serial.println(mc_count_used_slots());
       // Serial.printf(" CORE #%d\n",  xPortGetCoreID());
 #endif
+    } else if (mc_db[i].qos == MC_QOS_REL) {
+      // not a message: receivers drop held ids after MQTT_QOS2_HOLD_MS
+      mc_del_msg_idx(i);
     } else {
       // communicate about message timeout (will happen actually when node
       // is offline or message has been lost)
-      if (mc_db[i].msg_ptr == NULL) continue;
-      uint16_t j = 0;
-      for (;
-           j < mc_db[i].size && j < sizeof(buf) && mc_db[i].msg_ptr[j] != '\n';
-           j++)
-        ;  // find optional '\n'
-      strncpy(buf, (const char *)mc_db[i].msg_ptr, j);
+      uint8_t plain[256];
+      int size = mc_db[i].size;
+      const uint8_t *frame =
+          frame_plain(mc_db[i].msg_ptr, &size, plain, sizeof(plain));
+      if (frame == NULL) {
+        buf[0] = 0;
+      } else if (binframe_is(frame, size)) {
+        if (binframe_header_text(buf, sizeof(lost_buf), frame, size) < 0)
+          buf[0] = 0;
+      } else {
+        uint16_t j = 0;
+        for (; j < size && j < sizeof(lost_buf) - 1 && frame[j] != '\n'; j++)
+          ;  // find optional '\n'
+        memcpy(buf, (const char *)frame, j);
+        buf[j] = 0;
+      }
+      TRACE(TRACE_LOST, mc_db[i].reply_id, 0);
+      uint32_t dest = mc_db[i].dest;
       uint16_t ret = mc_del_msg_idx(i);
+      MC_LOCK();
+      stats.lost++;
+      if (dest) node_tx(dest, NODE_TX_LOST, 0);
+      MC_UNLOCK();
 #ifdef DEBUG_PRINTS
       Serial.printf("I: Lost message idx: %d, ret: %d\n", i, ret);
 #endif
@@ -159,7 +554,223 @@ const char *SimpleMQTT::resend_loop(void) {
   return NULL;
 }
 
-void SimpleMQTT::set_op_mode(OP_MODE mode) { this->op_mode = mode; }
+// a QoS 2 frame got ACKed: its receivers may forget the message id. The
+// release is cached and resent like a frame until a receiver ACKs it.
+void SimpleMQTT::mc_release(uint16_t i) {
+  uint8_t plain[256];
+  int size = mc_db[i].size;
+  const uint8_t *frame =
+      frame_plain(mc_db[i].msg_ptr, &size, plain, sizeof(plain));
+  if (frame == NULL) return;
+  char msgid[5] = "";
+  if (binframe_is(frame, size)) {
+    binframe_reader r;
+    char src[20];
+    uint8_t flags;
+    if (!binframe_header(&r, frame, size, src, sizeof(src), msgid, &flags))
+      return;
+  } else {
+    const uint8_t *slash = (const uint8_t *)memchr(frame, '/', size);
+    if (slash == NULL || frame + size - slash < 5) return;
+    memcpy(msgid, slash + 1, 4);
+  }
+  char rel[40];
+  int n = snprintf(rel, sizeof(rel), "REL %s/%s", myDeviceName.c_str(), msgid);
+  if (n <= 0 || n >= (int)sizeof(rel)) return;
+  uint32_t reply_id =
+      espNowFloodingMesh_sendAndHandleReply((uint8_t *)rel, n + 1, ttl, NULL);
+  // without a free slot it's sent once, receivers drop held ids after
+  // MQTT_QOS2_HOLD_MS
+  int16_t j =
+      mc_add_msg((uint8_t *)rel, n + 1, ttl, reply_id, get_rto(), tryCount);
+  if (j >= 0) mc_db[j].qos = MC_QOS_REL;
+}
+
+uint32_t SimpleMQTT::resend_next_ms(void) {
+  if (__atomic_load_n(&mc_acked_head, __ATOMIC_ACQUIRE) != mc_acked_tail ||
+      alias_rst_pending ||
+      __atomic_load_n(&ack_head, __ATOMIC_ACQUIRE) != ack_tail ||
+      __atomic_load_n(&rx_head, __ATOMIC_ACQUIRE) != rx_tail ||
+      (mc_waiting_len > 0 && cc_window_open()))
+    return 0;
+  uint32_t now = millis();
+  uint32_t next = MC_NO_DEADLINE;
+  if (coalesce_len > 0) {
+    int32_t d = (int32_t)(coalesce_ts + coalesce_ms - now);
+    next = d > 0 ? (uint32_t)d : 0;
+  }
+  if (mc_sched_len > 0) {
+    int32_t d = (int32_t)(mc_db[mc_sched[0]].expire_ts - now);
+    if (d < 0) d = 0;
+    if ((uint32_t)d < next) next = d;
+  }
+  return next;
+}
+
+void SimpleMQTT::set_op_mode(OP_MODE mode) {
+  if (mode != MODE_NODE_STD && gw == NULL) {
+    gw = new (std::nothrow) gw_tables;
+    if (gw != NULL) {
+      memset(gw, 0, sizeof(*gw));
+      reset_nodes();
+    }
+#ifdef DEBUG_PRINTS
+    if (gw == NULL) Serial.println("E: no memory for the gateway tables");
+#endif
+  }
+  // the duplicate filter of the mode, empty
+  if (mode != MODE_NODE_STD && gw != NULL) {
+    if (mqtt_dedup != gw->dedup)
+      mqtt_dedup_use(gw->dedup, gw->dedup_index, MQTT_DEDUP_SIZE,
+                     MQTT_DEDUP_INDEX_SIZE);
+  } else if (mqtt_dedup != mqtt_dedup_node) {
+    mqtt_dedup_use(mqtt_dedup_node, mqtt_dedup_node_index,
+                   MQTT_DEDUP_NODE_SIZE, MQTT_DEDUP_NODE_INDEX_SIZE);
+  }
+  this->op_mode = mode;
+}
+
+void SimpleMQTT::set_wire_format(WIRE_FORMAT format) {
+  if (format != WIRE_TEXT && !tx_alloc()) return;
+  this->wire_format = format;
+}
+
+// buffers of the opt-in send features, false (the feature stays off) if
+// there's no memory for them
+bool SimpleMQTT::tx_alloc(void) {
+  if (tx == NULL) {
+    tx = new (std::nothrow) tx_tables;
+#ifdef DEBUG_PRINTS
+    if (tx == NULL) Serial.println("E: no memory for the send buffers");
+#endif
+  }
+  return tx != NULL;
+}
+
+void SimpleMQTT::set_deferred_receive(bool enable) {
+  if (!enable) process_incoming();
+  // kept once allocated, the receive callback may still be copying
+  if (enable && rx_queue == NULL && MQTT_RX_QUEUE_LEN > 0)
+    rx_queue = new (std::nothrow) rx_item[MQTT_RX_QUEUE_LEN];
+  if (enable && rx_queue == NULL) {
+#ifdef DEBUG_PRINTS
+    Serial.println("E: no memory for the receive queue");
+#endif
+    return;
+  }
+  __atomic_store_n(&rx_deferred, enable, __ATOMIC_RELEASE);
+}
+
+// Runs in the mesh (WiFi) task: copy the frame and publish it with a
+// release store, process_incoming() reads the position with acquire.
+void SimpleMQTT::receive(const uint8_t *data, int len, uint32_t replyId) {
+  if (!__atomic_load_n(&rx_deferred, __ATOMIC_ACQUIRE)) {
+    parse_timed(data, len, replyId);  // Parse simple Mqtt protocol messages
+    return;
+  }
+  if (len > MQTT_RX_FRAME_SIZE) {
+    rx_stats.oversize++;
+    return;
+  }
+  uint16_t head = rx_head;
+  uint16_t depth = head - __atomic_load_n(&rx_tail, __ATOMIC_ACQUIRE);
+  if (depth == MQTT_RX_QUEUE_LEN) {
+    rx_stats.dropped++;
+    return;
+  }
+  rx_item *e = &rx_queue[head & (MQTT_RX_QUEUE_LEN - 1)];
+  memcpy(e->data, data, len);
+  e->size = len;
+  e->reply_id = replyId;
+  __atomic_store_n(&rx_head, (uint16_t)(head + 1), __ATOMIC_RELEASE);
+  rx_stats.received++;
+  if (depth + 1 > rx_stats.depth_max) rx_stats.depth_max = depth + 1;
+}
+
+uint16_t SimpleMQTT::process_incoming(void) {
+  uint16_t n = 0;
+  uint16_t tail = rx_tail;
+  while (tail != __atomic_load_n(&rx_head, __ATOMIC_ACQUIRE)) {
+    rx_item *e = &rx_queue[tail & (MQTT_RX_QUEUE_LEN - 1)];
+    parse_timed(e->data, e->size, e->reply_id);
+    __atomic_store_n(&rx_tail, ++tail, __ATOMIC_RELEASE);
+    n++;
+  }
+  return n;
+}
+
+void SimpleMQTT::parse_timed(const unsigned char *data, int size,
+                             uint32_t replyId) {
+  uint32_t t0 = micros();
+  parse(data, size, replyId);
+  uint32_t us = micros() - t0;
+  MC_LOCK();
+  hist_add(&stats.parse_us, us);
+  MC_UNLOCK();
+}
+
+void SimpleMQTT::get_stats(mqtt_stats_st *out) {
+  MC_LOCK();
+  *out = stats;
+  MC_UNLOCK();
+}
+
+void SimpleMQTT::reset_stats(void) {
+  MC_LOCK();
+  uint32_t bytes = stats.cache_bytes;
+  memset(&stats, 0, sizeof(stats));
+  stats.cache_bytes = bytes;
+  MC_UNLOCK();
+}
+
+void SimpleMQTT::get_rx_stats(mqtt_rx_stats_st *stats) {
+  *stats = rx_stats;
+  stats->depth = __atomic_load_n(&rx_head, __ATOMIC_ACQUIRE) - rx_tail;
+}
+
+// Frames flood the mesh and may come in again with the same replyId, the
+// pending ACKs are few: a scan is enough to send one per replyId.
+void SimpleMQTT::ack_put(uint32_t replyId) {
+  uint16_t head = ack_head;
+  uint16_t tail = __atomic_load_n(&ack_tail, __ATOMIC_ACQUIRE);
+  for (uint16_t p = tail; p != head; p++)
+    if (ack_queue[p & (MQTT_ACK_QUEUE_LEN - 1)] == replyId) return;
+  if ((uint16_t)(head - tail) == MQTT_ACK_QUEUE_LEN) {
+    send("ACK", 4, replyId);
+    telemetry_t.ack_pkt++;
+    TRACE(TRACE_ACK_SENT, replyId, 0);
+    return;
+  }
+  ack_queue[head & (MQTT_ACK_QUEUE_LEN - 1)] = replyId;
+  __atomic_store_n(&ack_head, (uint16_t)(head + 1), __ATOMIC_RELEASE);
+}
+
+void SimpleMQTT::ack_flush(void) {
+  uint16_t tail = ack_tail;
+  while (tail != __atomic_load_n(&ack_head, __ATOMIC_ACQUIRE)) {
+    uint32_t id = ack_queue[tail & (MQTT_ACK_QUEUE_LEN - 1)];
+    send("ACK", 4, id);
+    telemetry_t.ack_pkt++;
+    TRACE(TRACE_ACK_SENT, id, 0);
+    __atomic_store_n(&ack_tail, ++tail, __ATOMIC_RELEASE);
+  }
+}
+
+void SimpleMQTT::set_compression(bool enable) {
+  if (enable && !tx_alloc()) return;
+  this->compression = enable;
+}
+
+void SimpleMQTT::set_topic_aliases(bool enable) {
+  if (enable && !tx_alloc()) return;
+  this->topic_aliases = enable;
+}
+
+void SimpleMQTT::set_coalescing(uint16_t window_ms) {
+  if (window_ms == 0) flush();
+  if (window_ms > 0 && !tx_alloc()) return;
+  this->coalesce_ms = window_ms;
+}
 
 // random alphanumeric string
 void SimpleMQTT::gen_random_str(char *s, const int len) {
@@ -176,55 +787,70 @@ void SimpleMQTT::gen_random_str(char *s, const int len) {
 // get the unique mqtt message id
 // comes with device name as "MQTT DeviceName/RNDS"
 char *SimpleMQTT::get_msg_uuid(void) {
-  static char uuid[] = "XXXX";
   gen_random_str(uuid, 4);
   return uuid;
 }
 
 // add message to the mqtt msg cache
-// the function should be reenrable on ESP32 since second core might call it
-// too.
 int16_t SimpleMQTT::mc_add_msg(uint8_t *binary, int size, int ttl,
                                uint32_t reply_id, uint16_t timeout,
                                uint8_t try_cnt) {
+  int16_t i = mc_store(binary, size, ttl, timeout, try_cnt);
+  if (i == -1) return -1;
+  mc_sched_set(i);
+  // visible to the ACK handling from here on
+  MC_LOCK();
+  mc_db[i].reply_id = reply_id;
+  mc_db[i].reply_id_prev = 0;
+  mc_index_put(reply_id, i);
+  MC_UNLOCK();
+  return i;  // stored in the cache, index returned
+}
+
+// copy of the frame in a free slot, neither scheduled nor indexed yet
+int16_t SimpleMQTT::mc_store(uint8_t *binary, int size, int ttl,
+                             uint16_t timeout, uint8_t try_cnt) {
   int16_t i;
-  if ((size + mc_used_bytes) > MAX_MC_MEM) {
-#ifdef DEBUG_PRINTS
-    Serial.println("E: !!! Out of memory for cache !!! Leak ?");
-#endif
-    return -1;  // out of memory
-  }
-// find first available slot in message cache db
-#ifdef ESP32
-  // Begin of critical section.
-  // Critical sections are used as a valid protection method
-  // against simultaneous access in vanilla FreeRTOS.
-  // Disable the scheduler and call portDISABLE_INTERRUPTS. This prevents
-  // context switches and servicing of ISRs during a critical section.
-  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
-  portENTER_CRITICAL(&mux);
-#endif
-  for (i = 0; i < MAX_MC_ITEMS; i++) {
-    if (mc_db[i].msg_ptr == NULL && mc_db[i].reply_id == 0) {
-      mc_db[i].reply_id = reply_id;
-      mc_db[i].reply_id_prev = 0;
-      break;
-    }
+  if (size <= 0 || size > MC_LARGE_BLOCK_SIZE) return -1;
+  // take a free slot in message cache db
+  MC_LOCK();
+  if (mc_free_top > 0) {
+    i = mc_free_slots[--mc_free_top];
+  } else if (mc_slot_bump < MAX_MC_ITEMS) {
+    i = mc_slot_bump++;
+  } else {
+    i = -1;
   }
-#ifdef ESP32
-  // End of critical section.
-  portEXIT_CRITICAL(&mux);
-#endif
-  if (i == MAX_MC_ITEMS) {
+  MC_UNLOCK();
+  if (i == -1) {
     // no free slots found
+    MC_LOCK();
+    stats.cache_full++;
+    MC_UNLOCK();
+    TRACE(TRACE_CACHE_FULL, 0, size);
     return -1;
   }
-  uint8_t *p = (uint8_t *)malloc(size);
+  uint8_t *p = mc_block_alloc(size);
   if (p == NULL) {
-    return -1;  // no memory left (malloc)
+#ifdef DEBUG_PRINTS
+    Serial.println("E: !!! Out of memory for cache !!! Leak ?");
+#endif
+    MC_LOCK();
+    mc_free_slots[mc_free_top++] = i;  // give the slot back
+    stats.cache_full++;
+    MC_UNLOCK();
+    TRACE(TRACE_CACHE_FULL, 0, size);
+    return -1;  // out of blocks
   }
-  mc_used_bytes += size;
   mc_used_slots++;
+  MC_LOCK();
+  hist_add(&stats.cache_slots, mc_used_slots);
+  if (mc_used_slots > stats.cache_slots_max)
+    stats.cache_slots_max = mc_used_slots;
+  stats.cache_bytes += mc_block_size(p);
+  if (stats.cache_bytes > stats.cache_bytes_max)
+    stats.cache_bytes_max = stats.cache_bytes;
+  MC_UNLOCK();
   uint32_t expire_ts = millis() + timeout;
   mc_db[i].expire_ts = expire_ts;
   // mc_db[i].reply_id = reply_id;
@@ -234,45 +860,46 @@ int16_t SimpleMQTT::mc_add_msg(uint8_t *binary, int size, int ttl,
   mc_db[i].ttl = ttl;
   mc_db[i].timeout = timeout;
   mc_db[i].try_cnt = try_cnt;
-  return i;  // stored in the cache, index returned
+  mc_db[i].resends = 0;
+  mc_db[i].waiting = 0;
+  mc_db[i].qos = 1;
+  mc_db[i].dest = 0;
+  return i;
 }
 
 int16_t SimpleMQTT::mc_find_msg(uint32_t reply_id) {
-  int16_t i;
-  for (i = 0; i < MAX_MC_ITEMS; i++) {
-    if (mc_db[i].msg_ptr != NULL &&
-        (mc_db[i].reply_id == reply_id || mc_db[i].reply_id_prev == reply_id)) {
-      return i;
-    }
-  }
-  return -1;
+  MC_LOCK();
+  int16_t i = mc_index_get(reply_id);
+  if (i != -1 &&
+      (mc_db[i].msg_ptr == NULL || (mc_db[i].reply_id != reply_id &&
+                                    mc_db[i].reply_id_prev != reply_id)))
+    i = -1;
+  MC_UNLOCK();
+  return i;
 }
 
 int16_t SimpleMQTT::mc_del_msg(uint32_t reply_id) {
-  int16_t i;
-  for (i = 0; i < MAX_MC_ITEMS; i++) {
-    if (mc_db[i].msg_ptr != NULL &&
-        (mc_db[i].reply_id == reply_id || mc_db[i].reply_id_prev == reply_id)) {
-      free(mc_db[i].msg_ptr);
-      mc_used_bytes -= mc_db[i].size;
-      mc_used_slots--;
-      mc_db[i].reply_id = 0;
-      mc_db[i].reply_id_prev = 0;
-      mc_db[i].msg_ptr = NULL;
-      return i;
-    }
-  }
-  return -1;
+  int16_t i = mc_find_msg(reply_id);
+  if (i != -1) mc_del_msg_idx(i);
+  return i;
 }
 
 int8_t SimpleMQTT::mc_del_msg_idx(uint16_t i) {
   if (mc_db[i].msg_ptr != NULL) {
-    free(mc_db[i].msg_ptr);
-    mc_used_bytes -= mc_db[i].size;
+    if (mc_db[i].waiting) mc_waiting_remove(i);
+    mc_sched_remove(i);
+    uint16_t bytes = mc_block_size(mc_db[i].msg_ptr);
+    mc_block_free(mc_db[i].msg_ptr);
     mc_used_slots--;
+    MC_LOCK();
+    stats.cache_bytes -= bytes;
+    mc_index_del(mc_db[i].reply_id, i);
+    mc_index_del(mc_db[i].reply_id_prev, i);
     mc_db[i].reply_id = 0;
     mc_db[i].reply_id_prev = 0;
     mc_db[i].msg_ptr = NULL;
+    mc_free_slots[mc_free_top++] = i;
+    MC_UNLOCK();
     return 0;
   }
   return -1;
@@ -280,13 +907,94 @@ int8_t SimpleMQTT::mc_del_msg_idx(uint16_t i) {
 
 uint16_t SimpleMQTT::mc_get_used_slots() { return mc_used_slots; }
 
-uint16_t SimpleMQTT::mc_count_used_slots() {
-  int16_t i;
-  int16_t used_slots = 0;
-  for (i = 0; i < MAX_MC_ITEMS; i++) {
-    if (mc_db[i].msg_ptr != NULL) used_slots++;
+// only when a queued frame is deleted by the application
+void SimpleMQTT::mc_waiting_remove(uint16_t i) {
+  uint16_t n = 0;
+  for (uint16_t k = 0; k < mc_waiting_len; k++) {
+    uint16_t v = mc_waiting[(mc_waiting_head + k) % MAX_MC_ITEMS];
+    if (v != i) mc_waiting[(mc_waiting_head + n++) % MAX_MC_ITEMS] = v;
+  }
+  mc_waiting_len = n;
+  mc_db[i].waiting = 0;
+}
+
+// ----------------------------------------------------------------------------
+// congestion control
+//
+// AIMD like TCP's congestion avoidance: the window grows by one frame
+// when a window's worth of frames got ACKed and halves when a frame times
+// out, once per RTO as the frames of one burst time out together. Every
+// cached frame not in the send queue counts as in flight.
+
+void SimpleMQTT::set_congestion_control(bool enable) {
+  cc_enabled = enable;
+  cc_send_waiting();
+}
+
+void SimpleMQTT::get_cc_stats(mqtt_cc_stats_st *stats) {
+  *stats = cc_stats;
+  stats->cwnd = cwnd;
+  stats->in_flight = mc_used_slots - mc_waiting_len;
+  stats->queued = mc_waiting_len;
+}
+
+void SimpleMQTT::cc_on_ack(void) {
+  if (++cwnd_acks < cwnd) return;
+  cwnd_acks = 0;
+  if (cwnd < MQTT_CWND_MAX) cwnd++;
+}
+
+void SimpleMQTT::cc_on_resend(void) {
+  uint32_t now = millis();
+  if (now - cwnd_cut_ts < get_rto()) return;
+  cwnd_cut_ts = now;
+  cwnd = cwnd > 2 ? cwnd / 2 : 1;
+  cwnd_acks = 0;
+  cc_stats.cuts++;
+}
+
+bool SimpleMQTT::cc_window_open(void) {
+  return !cc_enabled || mc_used_slots - mc_waiting_len < cwnd;
+}
+
+void SimpleMQTT::cc_send_waiting(void) {
+  while (mc_waiting_len > 0 && cc_window_open()) {
+    uint16_t i = mc_waiting[mc_waiting_head];
+    mc_waiting_head = (mc_waiting_head + 1) % MAX_MC_ITEMS;
+    mc_waiting_len--;
+    mc_db[i].waiting = 0;
+    uint32_t reply_id = espNowFloodingMesh_sendAndHandleReply(
+        mc_db[i].msg_ptr, mc_db[i].size, mc_db[i].ttl, NULL);
+    TRACE(TRACE_SEND, reply_id, mc_db[i].size);
+    // the timeout runs from now, the RTT is measured from here
+    mc_db[i].expire_ts = millis() + mc_db[i].timeout;
+    mc_sched_set(i);
+    MC_LOCK();
+    mc_db[i].reply_id = reply_id;
+    mc_db[i].reply_id_prev = 0;
+    mc_index_put(reply_id, i);
+    MC_UNLOCK();
   }
-  return used_slots;
+}
+
+void SimpleMQTT::mc_get_pool_stats(mc_pool_stats_st *stats) {
+  stats->small_block_size = MC_SMALL_BLOCK_SIZE;
+  stats->small_free = MC_SMALL_BLOCKS - mc_small_slab.used;
+  stats->small_used_max = mc_small_slab.used_max;
+  stats->medium_block_size = MC_MEDIUM_BLOCK_SIZE;
+  stats->medium_free = MC_MEDIUM_BLOCKS - mc_medium_slab.used;
+  stats->medium_used_max = mc_medium_slab.used_max;
+  stats->large_block_size = MC_LARGE_BLOCK_SIZE;
+  stats->large_free = MC_LARGE_BLOCKS - mc_large_slab.used;
+  stats->large_used_max = mc_large_slab.used_max;
+  stats->free_bytes = (uint32_t)stats->small_free * MC_SMALL_BLOCK_SIZE +
+                      (uint32_t)stats->medium_free * MC_MEDIUM_BLOCK_SIZE +
+                      (uint32_t)stats->large_free * MC_LARGE_BLOCK_SIZE;
+}
+
+// counted from the free slot stack, a cross check of mc_used_slots
+uint16_t SimpleMQTT::mc_count_used_slots() {
+  return mc_slot_bump - mc_free_top;
 }
 
 telemetry_t_st *SimpleMQTT::get_telemetry_t_ptr(void) { return &telemetry_t; }
@@ -302,11 +1010,16 @@ bool SimpleMQTT::compareTopic(const char *topic, const char *deviceName,
 
 bool SimpleMQTT::publish(const char *deviceName, const char *parameterName,
                          const char *value) {
+  return publish(deviceName, parameterName, value, MQTT_QOS_AUTO);
+}
+
+bool SimpleMQTT::publish(const char *deviceName, const char *parameterName,
+                         const char *value, uint8_t qos) {
   char *p = buffer;
   p += snprintf(p, sizeof(buffer) - (p - buffer), "MQTT %s/%s\nP:%s%s %s\n",
                 myDeviceName.c_str(), get_msg_uuid(), deviceName, parameterName,
                 value);
-  return send_async(buffer, (int)(p - buffer) + 1, 0);
+  return send_async(buffer, (int)(p - buffer) + 1, 0, qos);
 }
 
 bool SimpleMQTT::publish_sync(const char *deviceName, const char *parameterName,
@@ -355,79 +1068,149 @@ bool SimpleMQTT::unsubscribeTopic(const char *devName, const char *valName) {
   return ret;
 }
 
-bool SimpleMQTT::_raw(Mqtt_cmd cmd, const char *type,
-                      const std::list<const char *> &names, const char *value) {
-  char *p = buffer;
-  const char *dest = mesh_gw_name;  // was myDeviceName.c_str()
+// Applies a topic of a frame to the previous one: N leading dots keep N
+// levels of it (as decompressTopic() does), a full topic replaces it.
+static bool topic_apply(char *prev, uint16_t *prev_len, uint16_t prev_size,
+                        const char *topic, uint16_t len) {
+  uint16_t c = 0;
+  for (; c < len && topic[c] == '.'; c++)
+    ;
+  uint16_t index = 0;
+  if (c > 0) {
+    uint16_t level = 0;
+    for (; index < *prev_len; index++)
+      if (prev[index] == '/' && ++level == c) break;
+    if (level != c) return false;
+  }
+  if (index + len - c > prev_size) return false;
+  memmove(prev + index, topic + c, len - c);
+  *prev_len = index + len - c;
+  return true;
+}
+
+// Shortest form of topic after prev: k dots keep the k levels they share.
+// Writes it to out (len bytes at most), returns its length.
+static uint16_t topic_relative(const char *prev, uint16_t prev_len,
+                               const char *topic, uint16_t len, char *out) {
+  uint16_t k = 0, split = 0;
+  for (uint16_t i = 0; i < len && i < prev_len && prev[i] == topic[i]; i++) {
+    // the binary format carries up to 7 dots
+    if (topic[i] == '/' && k < 7) {
+      k++;
+      split = i;
+    }
+  }
+  if (k == 0 || k + len - split >= len) {
+    memcpy(out, topic, len);
+    return len;
+  }
+  memset(out, '.', k);
+  memcpy(out + k, topic + split, len - split);
+  return k + len - split;
+}
+
+// Appends a command to the frame in buffer, sending the frame first when
+// the command doesn't fit.
+bool SimpleMQTT::frame_add(char cmd, const char *topic, uint16_t topic_len,
+                           const char *value) {
+  bool ret = true;
+  if (topic_len > sizeof(frame_prev)) return false;
+  int value_len = value != NULL ? strlen(value) + 1 : 0;
+  char rel[sizeof(frame_prev)];
+  uint16_t rel_len = 0;
+  bool qos2 = topic_qos(topic, topic_len) == 2;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (frame_len == 0) {
+      frame_len = snprintf(buffer, sizeof(buffer), "MQTT %s/%s\n",
+                           myDeviceName.c_str(), get_msg_uuid());
+      frame_prev_len = 0;
+      frame_qos2 = false;
+    }
+    rel_len =
+        topic_relative(frame_prev, frame_prev_len, topic, topic_len, rel);
+    // "C:" topic [' ' value] '\n' and the '\0' of the frame, and the " 2"
+    // send_frame() adds to a QoS 2 header
+    int budget = MQTT_FRAME_BUDGET - (qos2 || frame_qos2 ? 2 : 0);
+    if (frame_len + 2 + rel_len + value_len + 2 <= budget) break;
+    if (frame_prev_len == 0) {
+      frame_len = 0;
+      return false;  // doesn't fit in a frame alone
+    }
+    ret = frame_flush();
+  }
+  char *p = buffer + frame_len;
+  *p++ = cmd;
+  *p++ = ':';
+  memcpy(p, rel, rel_len);
+  p += rel_len;
+  if (value != NULL) {
+    *p++ = ' ';
+    memcpy(p, value, value_len - 1);
+    p += value_len - 1;
+  }
+  *p++ = '\n';
+  frame_len = p - buffer;
+  memcpy(frame_prev, topic, topic_len);
+  frame_prev_len = topic_len;
+  frame_qos2 |= qos2;
+  return ret;
+}
 
-  const char *name = names.front();
+bool SimpleMQTT::frame_flush(void) {
+  if (frame_len == 0) return true;
+  buffer[frame_len] = 0;
+  int len = frame_len + 1;
+  frame_len = 0;
+  return send_async(buffer, len, 0);
+}
 
+bool SimpleMQTT::send_commands(mqtt_command *cmds, uint16_t n) {
+  // stable insertion sort, lists are short
+  for (uint16_t i = 1; i < n; i++) {
+    mqtt_command c = cmds[i];
+    uint16_t j = i;
+    for (; j > 0 && strcmp(cmds[j - 1].topic, c.topic) > 0; j--)
+      cmds[j] = cmds[j - 1];
+    cmds[j] = c;
+  }
   bool ret = true;
+  for (uint16_t i = 0; i < n; i++) {
+    if (!frame_add(cmds[i].cmd, cmds[i].topic, strlen(cmds[i].topic),
+                   cmds[i].value))
+      ret = false;
+  }
+  if (!frame_flush()) ret = false;
+  return ret;
+}
 
-  int c = 0;
-  bool first = true;
-  p = buffer;
-  p += snprintf(p, sizeof(buffer), "MQTT %s/%s\n", myDeviceName.c_str(),
-                get_msg_uuid());
+bool SimpleMQTT::_raw(Mqtt_cmd cmd, const char *type,
+                      const std::list<const char *> &names, const char *value) {
+  const char *dest = mesh_gw_name;  // was myDeviceName.c_str()
+  char topic[100];
+  bool ret = true;
+  if (cmd != SUBSCRIBE && cmd != UNSUBSCRIBE && cmd != GET && cmd != PUBLISH)
+    return false;
 
   for (auto const &name : names) {
-    if (c > 2) {
-      if (!send_async(buffer, (int)(p - buffer) + 1, 0)) {
-        ret = false;
-      }
-      p = buffer;
-      p += snprintf(p, sizeof(buffer) - (p - buffer), "MQTT %s/%s\n",
-                    myDeviceName.c_str(), get_msg_uuid());
-      c = 0;
-      first = true;
+    int len = snprintf(topic, sizeof(topic), "%s/%s/%s/", dest, type, name);
+    if (len >= (int)sizeof(topic) - 6) {
+      ret = false;
+      continue;
     }
-
+    char *suffix = topic + len;
     if (cmd == SUBSCRIBE) {
-      if (first) {
-        p += snprintf(p, sizeof(buffer) - (p - buffer), "S:%s/%s/%s/set\n",
-                      dest, type, name);
-        p += snprintf(p, sizeof(buffer) - (p - buffer), "G:.../value\n");
-        first = false;
-      } else {
-        p += snprintf(p, sizeof(buffer) - (p - buffer), "S:../%s/set\n", name);
-        p += snprintf(p, sizeof(buffer) - (p - buffer), "G:.../value\n");
-      }
+      ret &= frame_add('S', topic, len + sprintf(suffix, "set"), NULL);
+      ret &= frame_add('G', topic, len + sprintf(suffix, "value"), NULL);
     } else if (cmd == UNSUBSCRIBE) {
-      if (first) {
-        p += snprintf(p, sizeof(buffer) - (p - buffer), "U:%s/%s/%s/set\n",
-                      dest, type, name);
-        first = false;
-      } else {
-        p += snprintf(p, sizeof(buffer) - (p - buffer), "U:../%s/set\n", name);
-      }
+      ret &= frame_add('U', topic, len + sprintf(suffix, "set"), NULL);
     } else if (cmd == GET) {
-      if (first) {
-        p += snprintf(p, sizeof(buffer) - (p - buffer), "G:%s/%s/%s/value\n",
-                      dest, type, name);
-        p += snprintf(p, sizeof(buffer) - (p - buffer), "G:.../set\n");
-        first = false;
-      } else {
-        p +=
-            snprintf(p, sizeof(buffer) - (p - buffer), "G:../%s/value\n", name);
-        p += snprintf(p, sizeof(buffer) - (p - buffer), "G:.../set\n");
-      }
+      ret &= frame_add('G', topic, len + sprintf(suffix, "value"), NULL);
+      ret &= frame_add('G', topic, len + sprintf(suffix, "set"), NULL);
     } else if (cmd == PUBLISH) {
-      if (first) {
-        p += snprintf(p, sizeof(buffer) - (p - buffer), "P:%s/%s/%s/value %s\n",
-                      dest, type, name, value);
-        first = false;
-      } else {
-        p += snprintf(p, sizeof(buffer) - (p - buffer), "P:../%s/value %s\n",
-                      name, value);
-      }
-    } else {
-      return false;
+      ret &= frame_add('P', topic, len + sprintf(suffix, "value"), value);
     }
-    c++;
-  }
-  if (!send_async(buffer, (int)(p - buffer) + 1, 0)) {
-    ret = false;
   }
+  if (!frame_flush()) ret = false;
   return ret;
 }
 
@@ -437,22 +1220,22 @@ bool SimpleMQTT::_switch(Mqtt_cmd cmd, const std::list<const char *> &names,
 }
 bool SimpleMQTT::_temp(Mqtt_cmd cmd, const std::list<const char *> &names,
                        float value) {
-  char v[20];
-  snprintf(v, sizeof(v), "%f", value);
+  char v[24];
+  numfmt_float(v, sizeof(v), value, precision("temp", names));
   return _raw(cmd, "temp", names, v);
 }
 
 bool SimpleMQTT::_humidity(Mqtt_cmd cmd, const std::list<const char *> &names,
                            float value) {
-  char v[20];
-  snprintf(v, sizeof(v), "%f", value);
+  char v[24];
+  numfmt_float(v, sizeof(v), value, precision("humidity", names));
   return _raw(cmd, "humidity", names, v);
 }
 
 bool SimpleMQTT::_pressure(Mqtt_cmd cmd, const std::list<const char *> &names,
                            float value) {
-  char v[20];
-  snprintf(v, sizeof(v), "%f", value);
+  char v[24];
+  numfmt_float(v, sizeof(v), value, precision("pressure", names));
   return _raw(cmd, "pressure", names, v);
 }
 
@@ -466,8 +1249,8 @@ bool SimpleMQTT::_contact(Mqtt_cmd cmd, const std::list<const char *> &names,
 }
 bool SimpleMQTT::_dimmer(Mqtt_cmd cmd, const std::list<const char *> &names,
                          uint8_t value) {
-  char v[20];
-  snprintf(v, sizeof(v), "%d", value);
+  char v[12];
+  numfmt_i32(v, sizeof(v), value);
   return _raw(cmd, "dimmer", names, v);
 }
 bool SimpleMQTT::_string(Mqtt_cmd cmd, const std::list<const char *> &names,
@@ -476,20 +1259,25 @@ bool SimpleMQTT::_string(Mqtt_cmd cmd, const std::list<const char *> &names,
 }
 bool SimpleMQTT::_number(Mqtt_cmd cmd, const std::list<const char *> &names,
                          int min, int max, int step) {
-  char v[50];
-  snprintf(v, sizeof(v), "%d,%d,%d", min, max, step);
+  char v[36];
+  char *p = v;
+  p += numfmt_i32(p, 12, min);
+  *p++ = ',';
+  p += numfmt_i32(p, 12, max);
+  *p++ = ',';
+  numfmt_i32(p, 12, step);
   return _raw(cmd, "number", names, v);
 }
 bool SimpleMQTT::_float(Mqtt_cmd cmd, const std::list<const char *> &names,
                         float value) {
-  char v[20];
-  snprintf(v, sizeof(v), "%f", value);
+  char v[24];
+  numfmt_float(v, sizeof(v), value, precision("float", names));
   return _raw(cmd, "float", names, v);
 }
 bool SimpleMQTT::_int(Mqtt_cmd cmd, const std::list<const char *> &names,
                       int value) {
-  char v[20];
-  snprintf(v, sizeof(v), "%d", value);
+  char v[12];
+  numfmt_i32(v, sizeof(v), value);
   return _raw(cmd, "int", names, v);
 }
 bool SimpleMQTT::_shutter(Mqtt_cmd cmd, const std::list<const char *> &names,
@@ -508,24 +1296,64 @@ bool SimpleMQTT::_shutter(Mqtt_cmd cmd, const std::list<const char *> &names,
 bool SimpleMQTT::_bin(Mqtt_cmd cmd, const std::list<const char *> &names,
                       const uint8_t *data, int len) {
   if (data != NULL) {
-    char b[250];
-    int encoded_len = Base64encode_len(len);
-    if (encoded_len >= (int)sizeof(b) - 1) {
-      // Serial.println("Base64encode_len data too long.");
-      return false;
-    }
-    int actual_len = Base64encode(b, (const char *)data, len);
-    b[actual_len] = '\0';
+    // receivers keep MQTT_VALUE_BUF_SIZE bytes of a value
+    char b[MQTT_VALUE_BUF_SIZE];
+    if (base64_encode(b, sizeof(b), data, len) < 0) return false;
     return _raw(cmd, "bin", names, b);
   }
   return _raw(cmd, "bin", names, NULL);
 }
 bool SimpleMQTT::_counter(Mqtt_cmd cmd, const std::list<const char *> &names,
                           int value) {
-  char v[20];
-  snprintf(v, sizeof(v), "%d", value);
+  char v[12];
+  numfmt_i32(v, sizeof(v), value);
   return _raw(cmd, "counter", names, v);
 }
+
+bool SimpleMQTT::_fixed(Mqtt_cmd cmd, const char *type, const char *name,
+                        int32_t value, uint8_t decimals) {
+  char v[24];
+  numfmt_fixed(v, sizeof(v), value, decimals);
+  std::list<const char *> t = {name};
+  return _raw(cmd, type, t, v);
+}
+
+static uint32_t precision_hash(const char *type, const char *name) {
+  uint32_t h = 0x811C9DC5;
+  for (const char *p = type; *p; p++) h = (h ^ (uint8_t)*p) * 0x01000193;
+  if (name != NULL) {
+    h = (h ^ '/') * 0x01000193;
+    for (const char *p = name; *p; p++) h = (h ^ (uint8_t)*p) * 0x01000193;
+  }
+  return h;
+}
+
+bool SimpleMQTT::set_precision(const char *type, uint8_t decimals,
+                               const char *name) {
+  uint32_t h = precision_hash(type, name);
+  uint8_t i = 0;
+  for (; i < precisions_cnt && precisions[i].hash != h; i++)
+    ;
+  if (i == MQTT_MAX_PRECISIONS) return false;
+  if (i == precisions_cnt) precisions_cnt++;
+  precisions[i].hash = h;
+  precisions[i].decimals = decimals;
+  return true;
+}
+
+// decimals for a value sent to names (the first one decides)
+uint8_t SimpleMQTT::precision(const char *type,
+                              const std::list<const char *> &names) {
+  if (precisions_cnt == 0) return MQTT_FLOAT_PRECISION;
+  uint32_t h = precision_hash(type, names.empty() ? NULL : names.front());
+  uint32_t ht = precision_hash(type, NULL);
+  int8_t found = -1;
+  for (uint8_t i = 0; i < precisions_cnt; i++) {
+    if (precisions[i].hash == h) return precisions[i].decimals;
+    if (precisions[i].hash == ht) found = i;
+  }
+  return found >= 0 ? precisions[found].decimals : MQTT_FLOAT_PRECISION;
+}
 /********************************************************************************************************/
 
 bool SimpleMQTT::_switch(Mqtt_cmd cmd, const char *name, MQTT_switch value) {
@@ -590,19 +1418,136 @@ bool SimpleMQTT::_counter(Mqtt_cmd cmd, const char *name, int value) {
 /********************************************************************************************************/
 
 float toFloat(const char *v) {
-  float ret;
-  sscanf(v, "%f", &ret);
+  float ret = 0;
+  numparse_float(v, strlen(v), &ret);
   return ret;
 }
 
 int toInt(const char *v) {
-  int ret;
-  sscanf(v, "%d", &ret);
+  int32_t ret = 0;
+  numparse_i32(v, strlen(v), &ret);
   return ret;
 }
 
-// buffer cannot be used here since there might be a messages in flight
-/*
+// '\0' terminated copy of a short value view (numbers)
+static const char *value_str(char *buf, size_t size, const char *v,
+                             uint16_t len) {
+  if (len >= size) len = size - 1;
+  memcpy(buf, v, len);
+  buf[len] = 0;
+  return buf;
+}
+
+static bool value_eq(const char *v, uint16_t len, const char *s) {
+  return strlen(s) == len && memcmp(v, s, len) == 0;
+}
+
+// Value decoders shared by the _ifXxx helpers and the handler dispatch
+// table. They get the value as a view and call the typed callback `cb`.
+// `scratch` (MQTT_VALUE_BUF_SIZE bytes) is used when a callback needs a
+// '\0' terminated string or decoded binary data.
+
+static bool invoke_switch(mqtt_cb_t cb, const char *v, uint16_t len,
+                          char *scratch, uint8_t arg) {
+  ((void (*)(MQTT_switch))cb)(value_eq(v, len, "on") ? SWITCH_ON : SWITCH_OFF);
+  return true;
+}
+
+static bool invoke_float(mqtt_cb_t cb, const char *v, uint16_t len,
+                         char *scratch, uint8_t arg) {
+  float f = 0;
+  numparse_float(v, len, &f);
+  ((void (*)(float))cb)(f);
+  return true;
+}
+
+static bool invoke_trigger(mqtt_cb_t cb, const char *v, uint16_t len,
+                           char *scratch, uint8_t arg) {
+  ((void (*)(MQTT_trigger))cb)(TRIGGERED);
+  return true;
+}
+
+static bool invoke_contact(mqtt_cb_t cb, const char *v, uint16_t len,
+                           char *scratch, uint8_t arg) {
+  if (value_eq(v, len, "open"))
+    ((void (*)(MQTT_contact))cb)(CONTACT_OPEN);
+  else if (value_eq(v, len, "closed"))
+    ((void (*)(MQTT_contact))cb)(CONTACT_CLOSED);
+  else
+    return false;
+  return true;
+}
+
+static bool invoke_dimmer(mqtt_cb_t cb, const char *v, uint16_t len,
+                          char *scratch, uint8_t arg) {
+  int32_t i = 0;
+  numparse_i32(v, len, &i);
+  ((void (*)(uint8_t))cb)(i);
+  return true;
+}
+
+static bool invoke_string(mqtt_cb_t cb, const char *v, uint16_t len,
+                          char *scratch, uint8_t arg) {
+  // values are views into the frame, not terminated
+  ((void (*)(const char *))cb)(
+      value_str(scratch, MQTT_VALUE_BUF_SIZE, v, len));
+  return true;
+}
+
+static bool invoke_number(mqtt_cb_t cb, const char *v, uint16_t len,
+                          char *scratch, uint8_t arg) {
+  // "min,max,step"
+  int32_t n[3] = {0, 0, 0};
+  const char *end = v + len;
+  for (int k = 0; k < 3 && v < end; k++) {
+    numparse_i32(v, end - v, &n[k]);
+    const char *c = (const char *)memchr(v, ',', end - v);
+    v = c != NULL ? c + 1 : end;
+  }
+  ((void (*)(int, int, int))cb)(n[0], n[1], n[2]);
+  return true;
+}
+
+static bool invoke_int(mqtt_cb_t cb, const char *v, uint16_t len,
+                       char *scratch, uint8_t arg) {
+  int32_t i = 0;
+  numparse_i32(v, len, &i);
+  ((void (*)(int))cb)(i);
+  return true;
+}
+
+static bool invoke_fixed(mqtt_cb_t cb, const char *v, uint16_t len,
+                         char *scratch, uint8_t arg) {
+  int32_t i = 0;
+  numparse_fixed(v, len, arg, &i);
+  ((void (*)(int32_t))cb)(i);
+  return true;
+}
+
+static bool invoke_shutter(mqtt_cb_t cb, const char *v, uint16_t len,
+                           char *scratch, uint8_t arg) {
+  if (value_eq(v, len, "open"))
+    ((void (*)(MQTT_shutter))cb)(SHUTTER_OPEN);
+  else if (value_eq(v, len, "close"))
+    ((void (*)(MQTT_shutter))cb)(SHUTTER_CLOSE);
+  else if (value_eq(v, len, "stop"))
+    ((void (*)(MQTT_shutter))cb)(SHUTTER_STOP);
+  else
+    return false;
+  return true;
+}
+
+static bool invoke_bin(mqtt_cb_t cb, const char *v, uint16_t len,
+                       char *scratch, uint8_t arg) {
+  // in place when the value is already a copy in scratch
+  int n = base64_decode((uint8_t *)scratch, MQTT_VALUE_BUF_SIZE, v, len);
+  if (n < 0) return false;
+  ((void (*)(const uint8_t *, int))cb)((const uint8_t *)scratch, n);
+  return true;
+}
+
+// buffer cannot be used here since there might be a messages in flight
+/*
 bool SimpleMQTT::compare(MQTT_IF ifType, const char *type, const char *name)
 {
   if (ifType == SET)
@@ -642,6 +1587,7 @@ bool SimpleMQTT::compare(MQTT_IF ifType, const char *type, const char *name) {
 }
 
 bool SimpleMQTT::_rawIf(MQTT_IF ifType, const char *type, const char *name) {
+  if (_topic == NULL) return false;  // not inside a handleEvents() callback
   if (ifType == SET || ifType == VALUE) {
     return compare(ifType, type, name);
   } else {
@@ -649,115 +1595,222 @@ bool SimpleMQTT::_rawIf(MQTT_IF ifType, const char *type, const char *name) {
   }
 }
 
+bool SimpleMQTT::_rawIf(MQTT_IF ifType, const char *type, const char *name,
+                        mqtt_invoke_t invoke, mqtt_cb_t cb, uint8_t arg) {
+  if (!_rawIf(ifType, type, name)) return false;
+  return invoke(cb, _value, strlen(_value), _value_buf, arg);
+}
+
 bool SimpleMQTT::_ifSwitch(MQTT_IF ifType, const char *name,
                            void (*cb)(MQTT_switch /*value*/)) {
-  if (!_rawIf(ifType, "switch", name)) return false;
-  if (strcmp(_value, "on") == 0)
-    cb(SWITCH_ON);
-  else
-    cb(SWITCH_OFF);
-  return false;
+  return _rawIf(ifType, "switch", name, invoke_switch, (mqtt_cb_t)cb);
 }
 
 bool SimpleMQTT::_ifTemp(MQTT_IF ifType, const char *name,
                          void (*cb)(float /*value*/)) {
-  if (!_rawIf(ifType, "temp", name)) return false;
-  return toFloat(_value);
+  return _rawIf(ifType, "temp", name, invoke_float, (mqtt_cb_t)cb);
 }
 
 bool SimpleMQTT::_ifHumidity(MQTT_IF ifType, const char *name,
                              void (*cb)(float /*value*/)) {
-  if (!_rawIf(ifType, "humidity", name)) return false;
-  return toFloat(_value);
+  return _rawIf(ifType, "humidity", name, invoke_float, (mqtt_cb_t)cb);
 }
 
 bool SimpleMQTT::_ifTrigger(MQTT_IF ifType, const char *name,
                             void (*cb)(MQTT_trigger /*value*/)) {
-  if (!_rawIf(ifType, "trigger", name)) return false;
-  cb(TRIGGERED);
-  return true;
+  return _rawIf(ifType, "trigger", name, invoke_trigger, (mqtt_cb_t)cb);
 }
 
 bool SimpleMQTT::_ifContact(MQTT_IF ifType, const char *name,
                             void (*cb)(MQTT_contact /*value*/)) {
-  if (!_rawIf(ifType, "contact", name)) return false;
-  if (strcmp(_value, "open") == 0)
-    cb(CONTACT_OPEN);
-  else if (strcmp(_value, "closed") == 0)
-    cb(CONTACT_CLOSED);
-  else
-    return false;
-  return true;
+  return _rawIf(ifType, "contact", name, invoke_contact, (mqtt_cb_t)cb);
 }
 
 bool SimpleMQTT::_ifDimmer(MQTT_IF ifType, const char *name,
                            void (*cb)(uint8_t /*value*/)) {
-  if (!_rawIf(ifType, "dimmer", name)) return false;
-  cb(toInt(_value));
-  return true;
+  return _rawIf(ifType, "dimmer", name, invoke_dimmer, (mqtt_cb_t)cb);
 }
 
 bool SimpleMQTT::_ifString(MQTT_IF ifType, const char *name,
                            void (*cb)(const char * /*value*/)) {
-  if (!_rawIf(ifType, "string", name)) return false;
-  cb(_value);
-  return true;
+  return _rawIf(ifType, "string", name, invoke_string, (mqtt_cb_t)cb);
 }
 
 bool SimpleMQTT::_ifNumber(MQTT_IF ifType, const char *name,
                            void (*cb)(int /*min*/, int /*max*/, int /*step*/)) {
-  if (!_rawIf(ifType, "number", name)) return false;
-  int min, max, step;
-  sscanf(_value, "%d,%d,%d", &min, &max, &step);
-  cb(min, max, step);
-  return true;
+  return _rawIf(ifType, "number", name, invoke_number, (mqtt_cb_t)cb);
 }
 
 bool SimpleMQTT::_ifFloat(MQTT_IF ifType, const char *name,
                           void (*cb)(float /*value*/)) {
-  if (!_rawIf(ifType, "float", name)) return false;
-  cb(toFloat(_value));
-  return true;
+  return _rawIf(ifType, "float", name, invoke_float, (mqtt_cb_t)cb);
 }
 
 bool SimpleMQTT::_ifInt(MQTT_IF ifType, const char *name,
                         void (*cb)(int /*value*/)) {
-  if (!_rawIf(ifType, "int", name)) return false;
-  cb(toInt(_value));
-  return true;
+  return _rawIf(ifType, "int", name, invoke_int, (mqtt_cb_t)cb);
 }
 
 bool SimpleMQTT::_ifShutter(MQTT_IF ifType, const char *name,
                             void (*cb)(MQTT_shutter /*value*/)) {
-  if (!_rawIf(ifType, "shutter", name)) return false;
-  if (strcmp(_value, "open") == 0)
-    cb(SHUTTER_OPEN);
-  else if (strcmp(_value, "close") == 0)
-    cb(SHUTTER_OPEN);
-  else if (strcmp(_value, "stop") == 0)
-    cb(SHUTTER_OPEN);
-  else
-    return false;
-  return true;
+  return _rawIf(ifType, "shutter", name, invoke_shutter, (mqtt_cb_t)cb);
 }
 
 bool SimpleMQTT::_ifCounter(MQTT_IF ifType, const char *name,
                             void (*cb)(int /*value*/)) {
-  if (!_rawIf(ifType, "counter", name)) return false;
-  cb(toInt(_value));
-  return true;
+  return _rawIf(ifType, "counter", name, invoke_int, (mqtt_cb_t)cb);
+}
+
+bool SimpleMQTT::_ifFixed(MQTT_IF ifType, const char *type, const char *name,
+                          uint8_t decimals, void (*cb)(int32_t /*value*/)) {
+  return _rawIf(ifType, type, name, invoke_fixed, (mqtt_cb_t)cb, decimals);
 }
 
 bool SimpleMQTT::_ifBin(MQTT_IF ifType, const char *name,
                         void (*cb)(const uint8_t * /*bin*/, int /*length*/)) {
-  if (!_rawIf(ifType, "bin", name))
+  return _rawIf(ifType, "bin", name, invoke_bin, (mqtt_cb_t)cb);
+}
+
+/********************************************************************************************************/
+// Handler dispatch table: handlers registered with _onXxx are found with
+// one hash lookup on "type/name/set" or "type/name/value" (the topic after
+// "<myDeviceName>/"), no matter how many are registered.
+
+static uint32_t fnv1a32(uint32_t h, const char *p, uint16_t len) {
+  for (uint16_t i = 0; i < len; i++) {
+    h ^= (uint8_t)p[i];
+    h *= 0x01000193;
+  }
+  return h;
+}
+
+static const uint32_t fnv1a32_init = 0x811C9DC5;
+
+static uint32_t handler_hash(const char *type, const char *name,
+                             const char *suffix) {
+  uint32_t h = fnv1a32(fnv1a32_init, type, strlen(type));
+  h = fnv1a32(h, "/", 1);
+  h = fnv1a32(h, name, strlen(name));
+  return fnv1a32(h, suffix, strlen(suffix));
+}
+
+bool SimpleMQTT::_on(MQTT_IF ifType, const char *type, const char *name,
+                     mqtt_invoke_t invoke, mqtt_cb_t cb, uint8_t arg) {
+  if (ifType == EITHER) {
+    return _on(SET, type, name, invoke, cb, arg) &&
+           _on(VALUE, type, name, invoke, cb, arg);
+  }
+  if (handlers_cnt >= MQTT_MAX_HANDLERS) return false;
+  handler_item &e = handlers[handlers_cnt];
+  e.hash = handler_hash(type, name, ifType == SET ? "/set" : "/value");
+  e.type = type;
+  e.name = name;
+  e.suffix = ifType;
+  e.arg = arg;
+  e.invoke = invoke;
+  e.cb = cb;
+  uint16_t h = e.hash & (MQTT_HANDLER_INDEX_SIZE - 1);
+  while (handler_index[h] != 0) h = (h + 1) & (MQTT_HANDLER_INDEX_SIZE - 1);
+  handler_index[h] = ++handlers_cnt;
+  return true;
+}
+
+// topic is the (decompressed) topic of a received command
+bool SimpleMQTT::dispatch(const char *topic, uint16_t topic_len,
+                          const char *value, uint16_t value_len) {
+  uint16_t n = myDeviceName.length();
+  if (topic_len <= n || topic[n] != '/' ||
+      memcmp(topic, myDeviceName.c_str(), n) != 0)
     return false;
-  else {
-    uint8_t b[250];
-    int len = Base64decode((char *)b, _value);
-    cb(b, len);
-    return true;
+  topic += n + 1;
+  topic_len -= n + 1;
+
+  uint32_t hash = fnv1a32(fnv1a32_init, topic, topic_len);
+  for (uint16_t h = hash & (MQTT_HANDLER_INDEX_SIZE - 1);
+       handler_index[h] != 0; h = (h + 1) & (MQTT_HANDLER_INDEX_SIZE - 1)) {
+    const handler_item &e = handlers[handler_index[h] - 1];
+    if (e.hash != hash) continue;
+    // verify the match, "type/name/suffix"
+    uint16_t tl = strlen(e.type), nl = strlen(e.name);
+    const char *suffix = e.suffix == SET ? "/set" : "/value";
+    if (tl + 1 + nl + strlen(suffix) != topic_len ||
+        memcmp(topic, e.type, tl) != 0 || topic[tl] != '/' ||
+        memcmp(topic + tl + 1, e.name, nl) != 0 ||
+        memcmp(topic + tl + 1 + nl, suffix, topic_len - tl - 1 - nl) != 0)
+      continue;
+    return e.invoke(e.cb, value, value_len, _value_buf, e.arg);
   }
+  return false;
+}
+
+bool SimpleMQTT::_onSwitch(MQTT_IF ifType, const char *name,
+                           void (*cb)(MQTT_switch /*value*/)) {
+  return _on(ifType, "switch", name, invoke_switch, (mqtt_cb_t)cb);
+}
+
+bool SimpleMQTT::_onTemp(MQTT_IF ifType, const char *name,
+                         void (*cb)(float /*value*/)) {
+  return _on(ifType, "temp", name, invoke_float, (mqtt_cb_t)cb);
+}
+
+bool SimpleMQTT::_onHumidity(MQTT_IF ifType, const char *name,
+                             void (*cb)(float /*value*/)) {
+  return _on(ifType, "humidity", name, invoke_float, (mqtt_cb_t)cb);
+}
+
+bool SimpleMQTT::_onTrigger(MQTT_IF ifType, const char *name,
+                            void (*cb)(MQTT_trigger /*value*/)) {
+  return _on(ifType, "trigger", name, invoke_trigger, (mqtt_cb_t)cb);
+}
+
+bool SimpleMQTT::_onContact(MQTT_IF ifType, const char *name,
+                            void (*cb)(MQTT_contact /*value*/)) {
+  return _on(ifType, "contact", name, invoke_contact, (mqtt_cb_t)cb);
+}
+
+bool SimpleMQTT::_onDimmer(MQTT_IF ifType, const char *name,
+                           void (*cb)(uint8_t /*value*/)) {
+  return _on(ifType, "dimmer", name, invoke_dimmer, (mqtt_cb_t)cb);
+}
+
+bool SimpleMQTT::_onString(MQTT_IF ifType, const char *name,
+                           void (*cb)(const char * /*value*/)) {
+  return _on(ifType, "string", name, invoke_string, (mqtt_cb_t)cb);
+}
+
+bool SimpleMQTT::_onNumber(MQTT_IF ifType, const char *name,
+                           void (*cb)(int /*min*/, int /*max*/, int /*step*/)) {
+  return _on(ifType, "number", name, invoke_number, (mqtt_cb_t)cb);
+}
+
+bool SimpleMQTT::_onFloat(MQTT_IF ifType, const char *name,
+                          void (*cb)(float /*value*/)) {
+  return _on(ifType, "float", name, invoke_float, (mqtt_cb_t)cb);
+}
+
+bool SimpleMQTT::_onInt(MQTT_IF ifType, const char *name,
+                        void (*cb)(int /*value*/)) {
+  return _on(ifType, "int", name, invoke_int, (mqtt_cb_t)cb);
+}
+
+bool SimpleMQTT::_onShutter(MQTT_IF ifType, const char *name,
+                            void (*cb)(MQTT_shutter /*value*/)) {
+  return _on(ifType, "shutter", name, invoke_shutter, (mqtt_cb_t)cb);
+}
+
+bool SimpleMQTT::_onCounter(MQTT_IF ifType, const char *name,
+                            void (*cb)(int /*value*/)) {
+  return _on(ifType, "counter", name, invoke_int, (mqtt_cb_t)cb);
+}
+
+bool SimpleMQTT::_onFixed(MQTT_IF ifType, const char *type, const char *name,
+                          uint8_t decimals, void (*cb)(int32_t /*value*/)) {
+  return _on(ifType, type, name, invoke_fixed, (mqtt_cb_t)cb, decimals);
+}
+
+bool SimpleMQTT::_onBin(MQTT_IF ifType, const char *name,
+                        void (*cb)(const uint8_t * /*bin*/, int /*length*/)) {
+  return _on(ifType, "bin", name, invoke_bin, (mqtt_cb_t)cb);
 }
 
 void SimpleMQTT::handleEvents(void(cb)(const char *, const char *, char,
@@ -765,17 +1818,250 @@ void SimpleMQTT::handleEvents(void(cb)(const char *, const char *, char,
   publishCallBack = cb;
 }
 
+void SimpleMQTT::handleEvents_view(void(cb)(const char *, const char *, char,
+                                            const char *, uint16_t,
+                                            const char *, uint16_t)) {
+  viewCallBack = cb;
+}
+
 void SimpleMQTT::handleEvents_raw(void(cb)(const uint8_t *, int, uint32_t,
                                            uint16_t)) {
   rawCallBack = cb;
 }
 
-bool SimpleMQTT::send_async(const char *mqttMsg, int len, uint32_t replyId) {
+// Frame as it goes on air: the text itself or its binary encoding in
+// tx->wire_buf (text is kept when it can't be encoded), compressed into
+// tx->lz_buf when that is enabled and makes it smaller.
+const uint8_t *SimpleMQTT::wire_encode(const char *mqttMsg, int *len) {
+  const uint8_t *frame = (const uint8_t *)mqttMsg;
+  if (wire_format == WIRE_BINARY) {
+    int size =
+        binframe_encode(tx->wire_buf, sizeof(tx->wire_buf), mqttMsg, *len);
+    if (size > 0) {
+      *len = size;
+      frame = tx->wire_buf;
+    }
+  }
+  if (compression) {
+    int size = lzframe_compress(tx->lz_buf, sizeof(tx->lz_buf), frame, *len);
+    if (size > 0) {
+      *len = size;
+      frame = tx->lz_buf;
+    }
+  }
+  return frame;
+}
+
+// Appends the commands of a frame to the pending one, the first topic
+// becomes relative to the last one of the pending frame when shorter.
+bool SimpleMQTT::coalesce(const char *mqttMsg, int len, uint8_t qos) {
+  const char *end = mqttMsg + len - (mqttMsg[len - 1] == 0);
+  const char *lines = (const char *)memchr(mqttMsg, '\n', end - mqttMsg);
+  if (lines == NULL || ++lines >= end) return send_frame(mqttMsg, len, qos);
+  // a frame has one QoS; if the pending one can't be sent it stays pending
+  // and the command goes alone
+  if (coalesce_len > 0 && qos != coalesce_qos && !flush())
+    return send_frame(mqttMsg, len, qos);
+  bool eol_last = end[-1] == '\n';
+  const char *eol = (const char *)memchr(lines, '\n', end - lines);
+  if (eol == NULL) eol = end;
+  const char *topic = lines + 2;
+  const char *topic_end = topic;
+  for (; topic_end < eol && *topic_end != ' '; topic_end++)
+    ;
+  uint16_t topic_len = topic_end - topic;
+  bool relative = eol - lines > 2 && lines[1] == ':' && topic[0] != '.' &&
+                  topic_len <= sizeof(tx->coalesce_prev);
+  // room for the " 2" send_frame() adds to a QoS 2 header
+  int cap = (int)sizeof(tx->coalesce_buf) - (qos == 2 ? 2 : 0);
+
+  if (coalesce_len > 0) {
+    char rel[sizeof(tx->coalesce_prev)];
+    uint16_t rel_len = topic_len;
+    if (relative)
+      rel_len = topic_relative(tx->coalesce_prev, coalesce_prev_len, topic,
+                               topic_len, rel);
+    // the commands, a final '\n' and the '\0'
+    int size = 2 + rel_len + (end - topic_end) + !eol_last;
+    if (coalesce_len + size + 1 <= cap) {
+      char *p = tx->coalesce_buf + coalesce_len;
+      memcpy(p, lines, 2);
+      memcpy(p + 2, relative ? rel : topic, rel_len);
+      memcpy(p + 2 + rel_len, topic_end, end - topic_end);
+      if (!eol_last) p[size - 1] = '\n';
+      coalesce_len += size;
+    } else if (!flush()) {
+      // full and can't be sent now
+      return send_frame(mqttMsg, len, qos);
+    }
+  }
+  if (coalesce_len == 0) {
+    int hdr = snprintf(tx->coalesce_buf, sizeof(tx->coalesce_buf),
+                       "MQTT %s/%s\n", myDeviceName.c_str(), get_msg_uuid());
+    int size = (end - lines) + !eol_last;
+    if (hdr + size + 1 > cap) return send_frame(mqttMsg, len, qos);
+    memcpy(tx->coalesce_buf + hdr, lines, end - lines);
+    if (!eol_last) tx->coalesce_buf[hdr + size - 1] = '\n';
+    coalesce_len = hdr + size;
+    coalesce_prev_len = 0;
+    coalesce_ts = millis();
+    coalesce_qos = qos;
+  }
+
+  // follow the topics for the next call
+  for (const char *c = lines; c < end;) {
+    const char *e = (const char *)memchr(c, '\n', end - c);
+    if (e == NULL) e = end;
+    const char *t = c + 2;
+    for (; t < e && *t != ' '; t++)
+      ;
+    if (e - c > 2 && c[1] == ':' &&
+        !topic_apply(tx->coalesce_prev, &coalesce_prev_len,
+                     sizeof(tx->coalesce_prev), c + 2, t - (c + 2)))
+      coalesce_prev_len = 0;
+    c = e + 1;
+  }
+  return true;
+}
+
+// sends the coalesced commands now
+bool SimpleMQTT::flush(void) {
+  if (coalesce_len == 0) return true;
+  tx->coalesce_buf[coalesce_len] = 0;
+  if (!send_frame(tx->coalesce_buf, coalesce_len + 1, coalesce_qos))
+    return false;
+  coalesce_len = 0;
+  return true;
+}
+
+bool SimpleMQTT::send_async(const char *mqttMsg, int len, uint32_t replyId,
+                            uint8_t qos) {
+  if (qos == MQTT_QOS_AUTO) qos = frame_qos(mqttMsg, len);
+  if (coalesce_ms > 0) return coalesce(mqttMsg, len, qos);
+  return send_frame(mqttMsg, len, qos);
+}
+
+void SimpleMQTT::set_default_qos(uint8_t qos) {
+  default_qos = qos > 2 ? 2 : qos;
+}
+
+bool SimpleMQTT::set_qos(const char *levels, uint8_t qos) {
+  uint8_t len = strlen(levels);
+  if (len == 0 || len >= sizeof(qos_rules[0].levels)) return false;
+  uint8_t i = 0;
+  for (; i < qos_rules_cnt && strcmp(qos_rules[i].levels, levels) != 0; i++)
+    ;
+  if (i == MQTT_MAX_QOS_RULES) return false;
+  if (i == qos_rules_cnt) qos_rules_cnt++;
+  memcpy(qos_rules[i].levels, levels, len + 1);
+  qos_rules[i].len = len;
+  qos_rules[i].qos = qos > 2 ? 2 : qos;
+  return true;
+}
+
+// true if topic has the whole levels `l` somewhere
+static bool topic_has_levels(const char *t, uint16_t len, const char *l,
+                             uint8_t l_len) {
+  for (uint16_t i = 0; i + l_len <= len; i++) {
+    if ((i == 0 || t[i - 1] == '/') &&
+        (i + l_len == len || t[i + l_len] == '/') &&
+        memcmp(t + i, l, l_len) == 0)
+      return true;
+  }
+  return false;
+}
+
+// QoS of a command on topic by the set_qos() rules
+uint8_t SimpleMQTT::topic_qos(const char *topic, uint16_t len) {
+  int qos = -1;
+  for (uint8_t i = 0; i < qos_rules_cnt; i++)
+    if (qos_rules[i].qos > qos &&
+        topic_has_levels(topic, len, qos_rules[i].levels, qos_rules[i].len))
+      qos = qos_rules[i].qos;
+  return qos < 0 ? default_qos : qos;
+}
+
+// highest QoS of the commands of a frame by the set_qos() rules; relative
+// topics are matched in their short form, their first full topic decides
+uint8_t SimpleMQTT::frame_qos(const char *mqttMsg, int len) {
+  if (qos_rules_cnt == 0) return default_qos;
+  const char *end = mqttMsg + len - (mqttMsg[len - 1] == 0);
+  const char *c = (const char *)memchr(mqttMsg, '\n', end - mqttMsg);
+  int qos = -1;
+  while (c != NULL && ++c < end) {
+    const char *e = (const char *)memchr(c, '\n', end - c);
+    if (e == NULL) e = end;
+    const char *t = c + 2;
+    const char *t_end = t;
+    for (; t_end < e && *t_end != ' '; t_end++)
+      ;
+    int cmd_qos = e - c > 2 ? topic_qos(t, t_end - t) : default_qos;
+    if (cmd_qos > qos) qos = cmd_qos;
+    c = e;
+  }
+  return qos < 0 ? default_qos : qos;
+}
+
+bool SimpleMQTT::send_frame(const char *mqttMsg, int len, uint8_t qos) {
+  int size = len;
+  if (qos == 0) {
+    // fire and forget: no alias (its binding could be lost), no cache, no
+    // reply id, so no ACK either
+    uint8_t *frame = (uint8_t *)wire_encode(mqttMsg, &size);
+    espNowFloodingMesh_send(frame, size, ttl);
+    TRACE(TRACE_SEND_QOS0, 0, size);
+    return true;
+  }
+  char q2[MC_LARGE_BLOCK_SIZE];
+  if (qos == 2) {
+    // "MQTT src/msgid 2\n" marks it
+    const char *eol = (const char *)memchr(mqttMsg, '\n', len);
+    if (eol == NULL || len + 2 > (int)sizeof(q2)) return false;
+    int hdr = eol - mqttMsg;
+    memcpy(q2, mqttMsg, hdr);
+    q2[hdr] = ' ';
+    q2[hdr + 1] = '2';
+    memcpy(q2 + hdr + 2, eol, len - hdr);
+    mqttMsg = q2;
+    size = len += 2;
+  }
+  uint32_t dest = frame_dest(mqttMsg, len);
+  uint8_t alias_cnt = mqtt_alias_tx_cnt;
+  uint8_t *frame = (uint8_t *)wire_encode(alias_apply(mqttMsg, &size), &size);
+  bool queue = mc_waiting_len > 0 || !cc_window_open();
+  // cached before it's sent: a frame that can't be resent isn't sent
+  int16_t i = mc_store(frame, size, ttl, get_rto(), tryCount);
+  if (i == -1) {
+    mqtt_alias_tx_cnt = alias_cnt;  // its bindings weren't sent either
+    return false;
+  }
+  mc_db[i].reply_id = 1;  // not confirmed, not indexed
+  mc_db[i].qos = qos;
+  mc_db[i].dest = dest;
+  if (dest) {
+    MC_LOCK();
+    node_tx(dest, NODE_TX_SENT, 0);
+    MC_UNLOCK();
+  }
+  if (queue) {
+    // queued behind the others, alias bindings stay in order
+    mc_db[i].waiting = 1;
+    mc_waiting[(mc_waiting_head + mc_waiting_len++) % MAX_MC_ITEMS] = i;
+    if (mc_waiting_len > cc_stats.queued_max)
+      cc_stats.queued_max = mc_waiting_len;
+    TRACE(TRACE_QUEUED, 0, mc_waiting_len);
+    return true;
+  }
   uint32_t replyptr =
-      espNowFloodingMesh_sendAndHandleReply((uint8_t *)mqttMsg, len, ttl, NULL);
-  // Store message in the cache
-  int16_t ret =
-      mc_add_msg((uint8_t *)mqttMsg, len, ttl, replyptr, timeoutMs, tryCount);
+      espNowFloodingMesh_sendAndHandleReply(frame, size, ttl, NULL);
+  mc_sched_set(i);
+  // visible to the ACK handling from here on
+  MC_LOCK();
+  mc_db[i].reply_id = replyptr;
+  mc_db[i].reply_id_prev = 0;
+  mc_index_put(replyptr, i);
+  MC_UNLOCK();
+  TRACE(TRACE_SEND, replyptr, size);
 #ifdef DEBUG_PRINTS
   Serial.print("Send_Async: \"");
   Serial.print(mqttMsg);
@@ -783,18 +2069,11 @@ bool SimpleMQTT::send_async(const char *mqttMsg, int len, uint32_t replyId) {
   Serial.print(" id: ");
   Serial.println(replyptr);
 // Serial.printf(" CORE #%d\n",  xPortGetCoreID());
-// Serial.print(" ret = ");
-// Serial.println(ret);
 #endif
-  if (ret == -1) {
-    return false;
-  }  // failed to store in the cache
   return true;
 }
 
 bool SimpleMQTT::send(const char *mqttMsg, int len, uint32_t replyId) {
-  static SimpleMQTT *myself = this;
-
 #ifdef DEBUG_PRINTS
   Serial.print("Send_sync:\"");
   Serial.print(mqttMsg);
@@ -804,16 +2083,21 @@ bool SimpleMQTT::send(const char *mqttMsg, int len, uint32_t replyId) {
 #endif
 
   if (replyId == 0) {
+    // keep the order of commands coalesced before
+    flush();
+    uint8_t *frame = (uint8_t *)wire_encode(mqttMsg, &len);
+    // one synchronous send at a time: the reply callback has no context
+    mqtt_sync_sender = this;
     bool status = espNowFloodingMesh_sendAndWaitReply(
-        (uint8_t *)mqttMsg, len, ttl, tryCount,
+        frame, len, ttl, tryCount,
         [](const uint8_t *data, int size) {
 #ifdef DEBUG_PRINTS
           Serial.print("send: espNowFloodingMesh_sendAndWaitReply: ");
           Serial.println((char *)data);
 #endif
-          if (size > 0) {
-            myself->parse(data, size, 0);  // Parse simple Mqtt protocol
-                                           // messages
+          if (size > 0 && mqtt_sync_sender != NULL) {
+            mqtt_sync_sender->parse(data, size, 0);  // Parse simple Mqtt
+                                                     // protocol messages
           }
         },
         timeoutMs, 1, backoffMs);  // Send MQTT commands via mesh network
@@ -832,24 +2116,811 @@ bool SimpleMQTT::send(const char *mqttMsg, int len, uint32_t replyId) {
   }
 }
 
-// search for mqtt message id in list, return -1 if not found
-// index returned if found
-int16_t mqtt_get_mqtt_mids_by_id(const char *msg_id) {
-  int16_t idx = 0;
-  bool found = false;
-  while (idx < MQTT_MSG_ID_LIST_SIZE && !found) {
-    if (mqtt_mids[idx].mdsid[0] == msg_id[0] &&
-        mqtt_mids[idx].mdsid[1] == msg_id[1] &&
-        mqtt_mids[idx].mdsid[2] == msg_id[2] &&
-        mqtt_mids[idx].mdsid[3] == msg_id[3]) {
-      return idx;
+// ----------------------------------------------------------------------------
+// topic aliases
+//
+// "P:@3=A1B2C3/temp/bme280/value 21.5" binds alias 3 of the sending node,
+// "P:@3 21.6" uses it. A gateway that doesn't know an alias (restarted)
+// answers ARST instead of ACK without processing the frame; the sender
+// then puts the full topics back into its cached frames, resends them and
+// starts binding again.
+
+// "@n" or "@n=topic": alias number, *bind points to the topic or is NULL
+static int alias_parse(const char *topic, uint16_t len, const char **bind) {
+  uint16_t i = 1;
+  int n = 0;
+  for (; i < len && i < 4 && topic[i] >= '0' && topic[i] <= '9'; i++)
+    n = n * 10 + (topic[i] - '0');
+  if (i == 1 || n > 255) return -1;
+  *bind = NULL;
+  if (i < len) {
+    if (topic[i] != '=') return -1;
+    *bind = topic + i + 1;
+  }
+  return n;
+}
+
+static uint32_t alias_src_hash(const char *src_node_name) {
+  uint32_t h = fnv1a32(fnv1a32_init, src_node_name, strlen(src_node_name));
+  return h != 0 ? h : 1;
+}
+
+// Bindings of node `src`, NULL if there are none. Each node has
+// MQTT_ALIAS_PER_NODE entries, so a node binding many topics only
+// replaces its own (stale) ones; the least recently active node makes
+// room for a new one.
+mqtt_alias_rx_node *SimpleMQTT::alias_rx_node(uint32_t src) {
+  if (gw == NULL) return NULL;
+  for (uint16_t i = 0; i < MQTT_ALIAS_NODES; i++)
+    if (gw->alias_rx[i].src == src) return &gw->alias_rx[i];
+  return NULL;
+}
+
+mqtt_alias_rx_item *SimpleMQTT::alias_rx_find(uint32_t src, uint8_t alias) {
+  mqtt_alias_rx_node *nd = alias_rx_node(src);
+  if (nd == NULL) return NULL;
+  for (uint8_t i = 0; i < MQTT_ALIAS_PER_NODE; i++) {
+    mqtt_alias_rx_item *e = &nd->aliases[i];
+    if (e->len != 0 && e->alias == alias) {
+      nd->used = e->used = ++gw->alias_clock;
+      return e;
     }
-    idx++;
   }
-  // not found
+  return NULL;
+}
+
+void SimpleMQTT::alias_rx_bind(uint32_t src, uint8_t alias, const char *topic,
+                               uint16_t len) {
+  if (gw == NULL || len == 0 || len >= MQTT_ALIAS_TOPIC_LEN) return;
+  uint32_t now = ++gw->alias_clock;
+  mqtt_alias_rx_node *nd = alias_rx_node(src);
+  if (nd == NULL) {
+    // a free node entry or the least recently used one
+    for (uint16_t i = 0; i < MQTT_ALIAS_NODES; i++) {
+      mqtt_alias_rx_node *c = &gw->alias_rx[i];
+      if (c->src == 0) {
+        nd = c;
+        break;
+      }
+      if (nd == NULL || now - c->used > now - nd->used) nd = c;
+    }
+    memset(nd, 0, sizeof(*nd));
+    nd->src = src;
+  }
+  // the same alias, a free entry or the node's least recently used one
+  mqtt_alias_rx_item *e = NULL;
+  for (uint8_t i = 0; i < MQTT_ALIAS_PER_NODE; i++) {
+    mqtt_alias_rx_item *c = &nd->aliases[i];
+    if (c->len != 0 && c->alias == alias) {
+      e = c;
+      break;
+    }
+    if (e == NULL ||
+        (e->len != 0 && (c->len == 0 || now - c->used > now - e->used)))
+      e = c;
+  }
+  nd->used = now;
+  e->used = now;
+  e->alias = alias;
+  e->len = len;
+  memcpy(e->topic, topic, len);
+}
+
+int SimpleMQTT::alias_tx_find(const char *topic, uint16_t len) {
+  for (uint8_t i = 0; i < mqtt_alias_tx_cnt; i++)
+    if (tx->alias_tx[i].len == len &&
+        memcmp(tx->alias_tx[i].topic, topic, len) == 0)
+      return i;
   return -1;
 }
 
+// true if `topic` starts with `dev` and a '/'
+static bool topic_of(const char *topic, uint16_t len, const char *dev,
+                     uint16_t dev_len) {
+  return len > dev_len && topic[dev_len] == '/' &&
+         memcmp(topic, dev, dev_len) == 0;
+}
+
+// Only gateways resolve aliases: topics of this device (state it
+// publishes) and of the gateway get one, those of other devices may be
+// read by MODE_NODE_STD nodes.
+bool SimpleMQTT::alias_topic(const char *topic, uint16_t len) {
+  return topic_of(topic, len, mesh_gw_name, strlen(mesh_gw_name)) ||
+         topic_of(topic, len, myDeviceName.c_str(), myDeviceName.length());
+}
+
+bool SimpleMQTT::my_topic(const char *topic, uint16_t len) {
+  return len >= myDeviceName.length() &&
+         strncmp(topic, myDeviceName.c_str(), myDeviceName.length()) == 0;
+}
+
+// Replaces full topics of a text frame by aliases, new ones are bound as
+// long as the rest of the frame still fits. Returns mqttMsg if unchanged.
+const char *SimpleMQTT::alias_apply(const char *mqttMsg, int *len) {
+  if (!topic_aliases || *len < 2) return mqttMsg;
+  const char *end = mqttMsg + *len - (mqttMsg[*len - 1] == 0);
+  const char *c = (const char *)memchr(mqttMsg, '\n', end - mqttMsg);
+  if (c == NULL) return mqttMsg;
+  c++;
+  char *out = tx->alias_buf;
+  int n = c - mqttMsg;
+  memcpy(out, mqttMsg, n);
+  bool changed = false;
+
+  while (c < end) {
+    const char *eol = (const char *)memchr(c, '\n', end - c);
+    if (eol == NULL) eol = end;
+    const char *topic = c + 2;
+    const char *topic_end = topic;
+    if (eol - c > 2 && c[1] == ':')
+      for (; topic_end < eol && *topic_end != ' '; topic_end++)
+        ;
+    int topic_len = topic_end - topic;
+    char alias[8];
+    int alias_len = 0;
+    bool bind = false;
+    if (topic_len >= MQTT_ALIAS_MIN_LEN && topic_len < MQTT_ALIAS_TOPIC_LEN &&
+        topic[0] != '.' && topic[0] != '@' && alias_topic(topic, topic_len)) {
+      int k = alias_tx_find(topic, topic_len);
+      if (k < 0 && mqtt_alias_tx_cnt < MQTT_TOPIC_ALIASES) {
+        k = mqtt_alias_tx_cnt;
+        bind = true;
+      }
+      if (k >= 0) {
+        alias_len = snprintf(alias, sizeof(alias), bind ? "@%u=" : "@%u",
+                             (uint8_t)(mqtt_alias_tx_base + k));
+        int line_len = (eol - c) + alias_len - (bind ? 0 : topic_len);
+        // the rest of the frame must still fit as it is
+        if (n + line_len + (end - eol) + 1 > (int)sizeof(tx->alias_buf)) {
+          alias_len = 0;
+        } else if (bind) {
+          tx->alias_tx[k].len = topic_len;
+          memcpy(tx->alias_tx[k].topic, topic, topic_len);
+          mqtt_alias_tx_cnt++;
+        }
+      }
+    }
+    if (alias_len > 0) {
+      memcpy(out + n, c, 2);
+      memcpy(out + n + 2, alias, alias_len);
+      n += 2 + alias_len;
+      const char *rest = bind ? topic : topic_end;
+      memcpy(out + n, rest, eol - rest);
+      n += eol - rest;
+      changed = true;
+    } else {
+      memcpy(out + n, c, eol - c);
+      n += eol - c;
+    }
+    if (eol < end) out[n++] = '\n';
+    c = eol + 1;
+  }
+  if (!changed) return mqttMsg;
+  out[n++] = 0;
+  *len = n;
+  return out;
+}
+
+// Topic of a received "@n" / "@n=topic", NULL if the alias is unknown.
+const char *SimpleMQTT::alias_resolve(const char *src_node_name,
+                                      const char *topic, uint16_t *len) {
+  const char *bind;
+  int n = alias_parse(topic, *len, &bind);
+  if (n < 0) return topic;  // not an alias
+  if (bind != NULL) {
+    *len -= bind - topic;
+    if (this->op_mode != MODE_NODE_STD)
+      alias_rx_bind(alias_src_hash(src_node_name), n, bind, *len);
+    return bind;
+  }
+  struct mqtt_alias_rx_item *e = NULL;
+  if (this->op_mode != MODE_NODE_STD)
+    e = alias_rx_find(alias_src_hash(src_node_name), n);
+  if (e == NULL) return NULL;
+  // the table entry may be replaced later in the frame
+  memcpy(_topic_buf, e->topic, e->len);
+  *len = e->len;
+  return _topic_buf;
+}
+
+// false if the frame uses an alias neither known nor bound in the frame;
+// *mine is set if a command is for this device (the frame gets ACKed in
+// MODE_GW_ACK_MY), aliases only stand for topics of the sender or of the
+// gateway
+bool SimpleMQTT::aliases_known(const unsigned char *data, int size,
+                               const char *src_node_name, bool *mine) {
+  *mine = false;
+  if (memchr(data, '@', size) == NULL) return true;
+  uint32_t src = alias_src_hash(src_node_name);
+  char gw_topic[8];
+  int gw_len = snprintf(gw_topic, sizeof(gw_topic), "%s/", mesh_gw_name);
+  uint8_t bound[32] = {0};  // bit per alias bound earlier in the frame
+  bool ok = true;
+  auto known = [&](const char *topic, uint16_t len) {
+    const char *bind;
+    int n = len > 0 && topic[0] == '@' ? alias_parse(topic, len, &bind) : -1;
+    if (n < 0) {
+      if (my_topic(topic, len)) *mine = true;
+      return;
+    }
+    if (bind != NULL) {
+      bound[n >> 3] |= 1 << (n & 7);
+      if (my_topic(bind, len - (bind - topic))) *mine = true;
+      return;
+    }
+    if (!(bound[n >> 3] & (1 << (n & 7))) && alias_rx_find(src, n) == NULL) {
+      ok = false;
+      if (my_topic(gw_topic, gw_len)) *mine = true;
+    }
+  };
+
+  if (binframe_is(data, size)) {
+    binframe_reader r;
+    char name[20], msgid[4], topic[100], num[BINFRAME_NUM_BUF_SIZE];
+    uint8_t flags;
+    char command;
+    uint16_t topic_len, value_len;
+    const char *value;
+    if (!binframe_header(&r, data, size, name, sizeof(name), msgid, &flags))
+      return true;
+    while (binframe_next(&r, &command, topic, sizeof(topic), &topic_len,
+                         &value, &value_len, num) > 0)
+      known(topic, topic_len);
+    return ok;
+  }
+  const char *c = (const char *)data;
+  const char *end = c + size;
+  while ((c = (const char *)memchr(c, '\n', end - c)) != NULL) {
+    c++;
+    if (end - c < 3 || c[1] != ':') continue;
+    const char *t = c + 2;
+    for (; t < end && *t != ' ' && *t != '\n' && *t != 0; t++)
+      ;
+    known(c + 2, t - (c + 2));
+  }
+  return ok;
+}
+
+// Full topics back into a cached frame, true if it used aliases.
+bool SimpleMQTT::alias_expand(uint16_t i) {
+  char text[256], out[256];
+  uint8_t plain[256];
+  int len = mc_db[i].size;
+  bool lz = lzframe_is(mc_db[i].msg_ptr, len);
+  const uint8_t *frame =
+      frame_plain(mc_db[i].msg_ptr, &len, plain, sizeof(plain));
+  if (frame == NULL) return false;
+  const char *c = (const char *)frame;
+  bool bin = binframe_is(frame, len);
+  if (bin) {
+    len = binframe_to_text(text, sizeof(text), frame, len);
+    if (len < 0) return false;
+    c = text;
+  }
+  const char *end = c + len - (c[len - 1] == 0);
+  int n = 0;
+  bool changed = false;
+  while (c < end) {
+    const char *eol = (const char *)memchr(c, '\n', end - c);
+    if (eol == NULL) eol = end;
+    const char *topic_end = c + 2;
+    for (; topic_end < eol && *topic_end != ' '; topic_end++)
+      ;
+    const char *bind = NULL;
+    int a = eol - c > 2 && c[1] == ':' && c[2] == '@'
+                ? alias_parse(c + 2, topic_end - (c + 2), &bind)
+                : -1;
+    uint8_t k = (uint8_t)(a - mqtt_alias_tx_base);
+    const char *from = c;
+    if (a >= 0 && (bind != NULL || k < mqtt_alias_tx_cnt)) {
+      memcpy(out + n, c, 2);
+      n += 2;
+      if (bind != NULL) {
+        from = bind;
+      } else {
+        memcpy(out + n, tx->alias_tx[k].topic, tx->alias_tx[k].len);
+        n += tx->alias_tx[k].len;
+        from = topic_end;
+      }
+      changed = true;
+    }
+    if (n + (eol - from) + 2 > (int)sizeof(out)) return false;
+    memcpy(out + n, from, eol - from);
+    n += eol - from;
+    if (eol < end) out[n++] = '\n';
+    c = eol + 1;
+  }
+  if (!changed) return false;
+  out[n++] = 0;
+
+  uint8_t enc[250];
+  frame = (const uint8_t *)out;
+  if (bin) {
+    n = binframe_encode(enc, sizeof(enc), out, n);
+    if (n < 0) return true;
+    frame = enc;
+  }
+  if (lz) {
+    int size = lzframe_compress(plain, sizeof(plain), frame, n);
+    if (size > 0) {
+      n = size;
+      frame = plain;
+    }
+  }
+  if (n > MC_LARGE_BLOCK_SIZE) return true;
+  uint8_t *p = mc_block_alloc(n);
+  if (p == NULL) return true;
+  memcpy(p, frame, n);
+  MC_LOCK();
+  stats.cache_bytes += mc_block_size(p) - mc_block_size(mc_db[i].msg_ptr);
+  if (stats.cache_bytes > stats.cache_bytes_max)
+    stats.cache_bytes_max = stats.cache_bytes;
+  MC_UNLOCK();
+  mc_block_free(mc_db[i].msg_ptr);
+  mc_db[i].msg_ptr = p;
+  mc_db[i].size = n;
+  return true;
+}
+
+// A receiver lost our aliases: expand every cached frame using them and
+// resend those now, then bind again from the next alias numbers.
+void SimpleMQTT::alias_reset(void) {
+  bool changed = false;
+  uint32_t now = millis();
+  for (uint16_t i = 0; i < mc_slot_bump; i++) {
+    if (mc_db[i].msg_ptr == NULL || mc_db[i].reply_id == 0) continue;
+    if (!alias_expand(i)) continue;
+    changed = true;
+    if (mc_db[i].waiting) continue;  // sent from the send queue
+    mc_db[i].expire_ts = now;
+    mc_sched_set(i);
+  }
+  if (!changed) return;  // repeated ARST, already done
+  mqtt_alias_tx_base += MQTT_TOPIC_ALIASES;
+  mqtt_alias_tx_cnt = 0;
+#ifdef DEBUG_PRINTS
+  Serial.println("Topic aliases reset");
+#endif
+}
+
+// FNV-1a over the node name and the 4 message id characters
+static uint64_t mqtt_dedup_key(const char *src_node_name, const char *msgid) {
+  uint64_t h = 0xCBF29CE484222325ULL;
+  for (const char *p = src_node_name; *p; p++) {
+    h ^= (uint8_t)*p;
+    h *= 0x100000001B3ULL;
+  }
+  h ^= '/';
+  h *= 0x100000001B3ULL;
+  for (int i = 0; i < 4; i++) {
+    h ^= (uint8_t)msgid[i];
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+static_assert(MQTT_DEDUP_SIZE > 0 && MQTT_DEDUP_SIZE < 0xFFFF &&
+                  MQTT_DEDUP_NODE_SIZE > 0 && MQTT_DEDUP_NODE_SIZE < 0xFFFF,
+              "dedup sizes must be within 1..65534");
+
+static inline uint32_t mqtt_dedup_home(uint64_t key, uint32_t mask) {
+  return (uint32_t)(key ^ (key >> 32)) & mask;
+}
+
+void SimpleMQTT::mqtt_dedup_use(mqtt_dedup_item *ring, uint16_t *index,
+                                uint16_t size, uint32_t index_size) {
+  memset(index, 0, index_size * sizeof(index[0]));
+  mqtt_dedup = ring;
+  mqtt_dedup_index = index;
+  mqtt_dedup_size = size;
+  mqtt_dedup_mask = index_size - 1;
+  mqtt_dedup_oldest = 0;
+  mqtt_dedup_count = 0;
+}
+
+// index slot holding ring position `pos` or the empty slot ending the chain
+uint32_t SimpleMQTT::mqtt_dedup_lookup(uint64_t key) {
+  uint32_t h = mqtt_dedup_home(key, mqtt_dedup_mask);
+  while (mqtt_dedup_index[h] != 0 &&
+         mqtt_dedup[mqtt_dedup_index[h] - 1].key != key)
+    h = (h + 1) & mqtt_dedup_mask;
+  return h;
+}
+
+// forget the oldest entry (backward shift deletion in the index)
+void SimpleMQTT::mqtt_dedup_pop_oldest(void) {
+  const uint32_t mask = mqtt_dedup_mask;
+  uint32_t hole = mqtt_dedup_home(mqtt_dedup[mqtt_dedup_oldest].key, mask);
+  while (mqtt_dedup_index[hole] != mqtt_dedup_oldest + 1)
+    hole = (hole + 1) & mask;
+  for (uint32_t j = (hole + 1) & mask; mqtt_dedup_index[j] != 0;
+       j = (j + 1) & mask) {
+    uint32_t home =
+        mqtt_dedup_home(mqtt_dedup[mqtt_dedup_index[j] - 1].key, mask);
+    if (((j - home) & mask) < ((j - hole) & mask)) continue;
+    mqtt_dedup_index[hole] = mqtt_dedup_index[j];
+    hole = j;
+  }
+  mqtt_dedup_index[hole] = 0;
+  mqtt_dedup_oldest = (mqtt_dedup_oldest + 1) % mqtt_dedup_size;
+  mqtt_dedup_count--;
+}
+
+// true if the message was already seen, otherwise it's remembered
+bool SimpleMQTT::mqtt_dedup_check(const char *src_node_name,
+                                  const char *msgid) {
+  return mqtt_dedup_check_key(mqtt_dedup_key(src_node_name, msgid), true);
+}
+
+bool SimpleMQTT::mqtt_dedup_check_key(uint64_t key, bool add) {
+  uint32_t now = millis();
+
+  // expire old entries, they are in insertion order
+  while (mqtt_dedup_count > 0 &&
+         now - mqtt_dedup[mqtt_dedup_oldest].ts >= mqtt_dedup_ttl_ms)
+    mqtt_dedup_pop_oldest();
+
+  uint32_t h = mqtt_dedup_lookup(key);
+  if (mqtt_dedup_index[h] != 0) return true;
+  if (!add) return false;
+
+  if (mqtt_dedup_count == mqtt_dedup_size) {
+    mqtt_dedup_pop_oldest();
+    h = mqtt_dedup_lookup(key);
+  }
+  uint16_t pos = (mqtt_dedup_oldest + mqtt_dedup_count) % mqtt_dedup_size;
+  mqtt_dedup[pos].key = key;
+  mqtt_dedup[pos].ts = now;
+  mqtt_dedup_index[h] = pos + 1;
+  mqtt_dedup_count++;
+  return false;
+}
+
+// Duplicate filter of a received frame, false if it's refused. QoS 2
+// message ids are also held until the sender releases them, then (or when
+// the hold expires) they go back into the duplicate filter as ~key for
+// another mqtt_dedup_ttl_ms. While all entries are held a new QoS 2 frame
+// is neither processed nor ACKed, the sender resends it. parse() frees the
+// entry again if the frame isn't ACKed here.
+bool SimpleMQTT::mqtt_dedup_frame(const char *src_node_name,
+                                  const char *msgid, uint8_t qos,
+                                  bool *new_msg) {
+  if (qos != 2) {
+    *new_msg = !mqtt_dedup_check(src_node_name, msgid);
+    if (!*new_msg) dedup_hit();
+    return true;
+  }
+  uint64_t id = mqtt_dedup_key(src_node_name, msgid);
+  uint64_t key = id | 1;
+  uint32_t now = millis();
+  int16_t free_i = -1;
+  for (uint16_t i = 0; i < MQTT_QOS2_ENTRIES; i++) {
+    if (mqtt_qos2[i].key != 0 && now - mqtt_qos2[i].ts >= MQTT_QOS2_HOLD_MS) {
+      mqtt_dedup_check_key(~mqtt_qos2[i].key, true);
+      mqtt_qos2[i].key = 0;
+    }
+    if (mqtt_qos2[i].key == key) {
+      *new_msg = false;
+      dedup_hit();
+      return true;
+    }
+    if (mqtt_qos2[i].key == 0 && free_i < 0) free_i = i;
+  }
+  *new_msg = !mqtt_dedup_check_key(~key, false) &&
+             !mqtt_dedup_check_key(id, free_i >= 0);
+  if (!*new_msg) {
+    dedup_hit();
+    return true;
+  }
+  if (free_i < 0) {
+    MC_LOCK();
+    stats.qos2_refused++;
+    MC_UNLOCK();
+    return false;
+  }
+  mqtt_qos2[free_i].key = key;
+  mqtt_qos2[free_i].ts = now;
+  qos2_hold = free_i;
+  return true;
+}
+
+void SimpleMQTT::dedup_hit(void) {
+  TRACE(TRACE_DEDUP, replyId, 0);
+  MC_LOCK();
+  stats.dedup_hits++;
+  MC_UNLOCK();
+}
+
+// "REL src/msgid": a held id is released and the release ACKed, again
+// for copies resent because the ACK got lost
+void SimpleMQTT::mqtt_qos2_release(const unsigned char *data, int size) {
+  const char *src = (const char *)data + 4;
+  const char *slash = (const char *)memchr(src, '/', size - 4);
+  char name[20];
+  if (slash == NULL || slash - src >= (int)sizeof(name) ||
+      (const char *)data + size - slash < 5)
+    return;
+  memcpy(name, src, slash - src);
+  name[slash - src] = 0;
+  uint64_t key = mqtt_dedup_key(name, slash + 1) | 1;
+  bool held = false;
+  for (uint16_t i = 0; i < MQTT_QOS2_ENTRIES; i++)
+    if (mqtt_qos2[i].key == key) {
+      mqtt_qos2[i].key = 0;
+      held = true;
+    }
+  // ~key: released here, in the duplicate filter
+  if (!mqtt_dedup_check_key(~key, held) && !held) return;
+  if (replyId) ack_frame = true;
+}
+
+void SimpleMQTT::set_dedup_ttl(uint32_t ms) { mqtt_dedup_ttl_ms = ms; }
+
+// ----------------------------------------------------------------------------
+// node table
+//
+// Gateways keep an entry per source node in gw: MQTT_NODE_ENTRIES entries
+// in a doubly linked list ordered by last seen (moved to the front per
+// frame, the tail is replaced when full) and an open-addressing index on
+// the name hash, names compared on lookup. All of it is guarded by mc_mux:
+// parse() updates the receive counters, the loop those of the frames sent
+// to the node.
+
+static_assert(MQTT_NODE_ENTRIES > 0 && MQTT_NODE_ENTRIES < 0xFFFF,
+              "MQTT_NODE_ENTRIES must be within 1..65534");
+
+#define NODE_NONE MQTT_NODE_ENTRIES
+
+static inline uint32_t node_home(uint32_t key) {
+  return (key ^ (key >> 16)) & (MQTT_NODE_INDEX_SIZE - 1);
+}
+
+// index slot of node `name` (hash `key`) or the empty slot ending its chain
+uint32_t SimpleMQTT::node_lookup(uint32_t key, const char *name) {
+  uint32_t h = node_home(key);
+  for (uint16_t j; (j = gw->node_index[h]) != 0;
+       h = (h + 1) & (MQTT_NODE_INDEX_SIZE - 1)) {
+    const node_item &e = gw->nodes[j - 1];
+    if (e.key == key && strcmp(e.n.name, name) == 0) break;
+  }
+  return h;
+}
+
+// backward shift deletion of entry i, as mqtt_dedup_pop_oldest()
+void SimpleMQTT::node_index_del(uint16_t i) {
+  const uint32_t mask = MQTT_NODE_INDEX_SIZE - 1;
+  uint32_t hole = node_home(gw->nodes[i].key);
+  while (gw->node_index[hole] != 0 && gw->node_index[hole] != i + 1)
+    hole = (hole + 1) & mask;
+  if (gw->node_index[hole] == 0) return;
+  for (uint32_t j = (hole + 1) & mask; gw->node_index[j] != 0;
+       j = (j + 1) & mask) {
+    uint32_t home = node_home(gw->nodes[gw->node_index[j] - 1].key);
+    if (((j - home) & mask) < ((j - hole) & mask)) continue;
+    gw->node_index[hole] = gw->node_index[j];
+    hole = j;
+  }
+  gw->node_index[hole] = 0;
+}
+
+// reference of an entry: its index + 1 and reuse count
+static inline uint32_t node_ref(uint16_t i, uint16_t reuse) {
+  return (uint32_t)reuse << 16 | (i + 1);
+}
+
+// entry a reference names, -1 if it was replaced since
+int32_t SimpleMQTT::node_entry(uint32_t ref) {
+  uint16_t i = (ref & 0xFFFF) - 1;
+  if (gw == NULL || i >= gw->node_cnt || gw->nodes[i].reuse != ref >> 16)
+    return -1;
+  return i;
+}
+
+void SimpleMQTT::node_unlink(uint16_t i) {
+  node_item &e = gw->nodes[i];
+  if (e.prev != NODE_NONE)
+    gw->nodes[e.prev].next = e.next;
+  else
+    gw->node_head = e.next;
+  if (e.next != NODE_NONE)
+    gw->nodes[e.next].prev = e.prev;
+  else
+    gw->node_tail = e.prev;
+}
+
+void SimpleMQTT::node_push_front(uint16_t i) {
+  gw->nodes[i].prev = NODE_NONE;
+  gw->nodes[i].next = gw->node_head;
+  if (gw->node_head != NODE_NONE)
+    gw->nodes[gw->node_head].prev = i;
+  else
+    gw->node_tail = i;
+  gw->node_head = i;
+}
+
+void SimpleMQTT::node_copy(uint16_t i, mqtt_node_st *out) {
+  const node_item &e = gw->nodes[i];
+  *out = e.n;
+  out->interval_ms = e.interval_x8 >> 3;
+  out->srtt_ms = e.srtt_x8 >> 3;
+  out->rttvar_ms = e.rttvar_x4 >> 2;
+}
+
+// a frame from node `name`, new or a copy of one received before
+void SimpleMQTT::node_rx(const char *name, bool new_msg) {
+  if (op_mode != MODE_GW_ACK_ALL && op_mode != MODE_GW_ACK_MY) return;
+  if (gw == NULL || name[0] == 0) return;
+  uint32_t key = alias_src_hash(name);
+  uint32_t now = millis();
+  MC_LOCK();
+  uint32_t h = node_lookup(key, name);
+  uint16_t i;
+  if (gw->node_index[h] != 0) {
+    i = gw->node_index[h] - 1;
+    node_unlink(i);
+  } else {
+    if (gw->node_cnt < MQTT_NODE_ENTRIES) {
+      i = gw->node_cnt++;
+    } else {
+      // replace the least recently seen node
+      i = gw->node_tail;
+      node_unlink(i);
+      node_index_del(i);
+      h = node_lookup(key, name);
+    }
+    // also counts uses before a reset_nodes()
+    uint16_t reuse = gw->nodes[i].reuse + 1;
+    memset(&gw->nodes[i], 0, sizeof(gw->nodes[i]));
+    gw->nodes[i].key = key;
+    gw->nodes[i].reuse = reuse;
+    strncpy(gw->nodes[i].n.name, name, sizeof(gw->nodes[i].n.name) - 1);
+    gw->nodes[i].n.first_seen_ms = now;
+    gw->node_index[h] = i + 1;
+  }
+  node_item &e = gw->nodes[i];
+  e.n.last_seen_ms = now;
+  if (new_msg) {
+    if (e.n.rx_frames > 0) {
+      // EWMA 1/8 of the time between new frames
+      uint32_t d = now - e.last_frame_ms;
+      if (e.interval_x8 == 0)
+        e.interval_x8 = d << 3;
+      else
+        e.interval_x8 += d - (e.interval_x8 >> 3);
+    }
+    e.last_frame_ms = now;
+    e.n.rx_frames++;
+  } else {
+    e.n.rx_dups++;
+  }
+  node_push_front(i);
+  MC_UNLOCK();
+}
+
+// a frame sent to entry `dest` (NODE_TX_*), called with mc_mux held;
+// replaced entries are skipped
+void SimpleMQTT::node_tx(uint32_t dest, uint8_t event, uint32_t rtt) {
+  int32_t i = node_entry(dest);
+  if (i < 0) return;
+  node_item &e = gw->nodes[i];
+  switch (event) {
+    case NODE_TX_SENT:
+      e.n.tx_frames++;
+      break;
+    case NODE_TX_ACKED: {
+      // RFC 6298 SRTT/RTTVAR as rto_sample()
+      int32_t r = rtt > MQTT_RTO_MAX_MS ? MQTT_RTO_MAX_MS : (int32_t)rtt;
+      if (e.srtt_x8 == 0) {
+        e.srtt_x8 = (r << 3) | 1;
+        e.rttvar_x4 = r << 1;
+      } else {
+        int32_t err = r - (int32_t)(e.srtt_x8 >> 3);
+        e.srtt_x8 += err;
+        if (err < 0) err = -err;
+        e.rttvar_x4 += err - (int32_t)(e.rttvar_x4 >> 2);
+      }
+      if (r > e.n.rtt_max_ms) e.n.rtt_max_ms = r;
+    }
+      // fall through
+    case NODE_TX_ACKED_RESENT:
+      e.n.tx_acked++;
+      break;
+    case NODE_TX_RESENT:
+      e.n.tx_resent++;
+      break;
+    case NODE_TX_LOST:
+      e.n.tx_lost++;
+      break;
+  }
+}
+
+// node table entry of the device of the first command ("P:dev/..."), 0 if
+// not a gateway or the device isn't in the table
+uint32_t SimpleMQTT::frame_dest(const char *mqttMsg, int len) {
+  if (op_mode != MODE_GW_ACK_ALL && op_mode != MODE_GW_ACK_MY) return 0;
+  if (gw == NULL) return 0;
+  const char *p = (const char *)memchr(mqttMsg, '\n', len);
+  if (p == NULL || mqttMsg + len - p < 4 || p[2] != ':') return 0;
+  const char *dev = p + 3;
+  const char *end = dev;
+  while (end < mqttMsg + len && *end != '/' && *end != ' ' && *end != '\n' &&
+         *end != 0)
+    end++;
+  char name[sizeof(mqtt_node_st::name)];
+  if (end == dev || end - dev >= (int)sizeof(name)) return 0;
+  memcpy(name, dev, end - dev);
+  name[end - dev] = 0;
+  uint32_t ref = 0;
+  MC_LOCK();
+  uint32_t h = node_lookup(alias_src_hash(name), name);
+  if (gw->node_index[h] != 0) {
+    uint16_t i = gw->node_index[h] - 1;
+    ref = node_ref(i, gw->nodes[i].reuse);
+  }
+  MC_UNLOCK();
+  return ref;
+}
+
+uint16_t SimpleMQTT::node_count(void) { return gw != NULL ? gw->node_cnt : 0; }
+
+uint16_t SimpleMQTT::get_nodes(mqtt_node_st *out, uint16_t max,
+                               uint32_t *cursor) {
+  if (gw == NULL) {
+    if (cursor != NULL) *cursor = 0;
+    return 0;
+  }
+  uint16_t n = 0;
+  MC_LOCK();
+  uint16_t i = gw->node_head;
+  if (cursor != NULL && *cursor != 0) {
+    int32_t last = node_entry(*cursor);
+    i = last < 0 ? NODE_NONE : gw->nodes[last].next;
+  }
+  for (; i != NODE_NONE && n < max; i = gw->nodes[i].next) {
+    node_copy(i, &out[n++]);
+    if (cursor != NULL) *cursor = node_ref(i, gw->nodes[i].reuse);
+  }
+  if (cursor != NULL && i == NODE_NONE) *cursor = 0;
+  MC_UNLOCK();
+  return n;
+}
+
+uint16_t SimpleMQTT::get_silent_nodes(mqtt_node_st *out, uint16_t max,
+                                      uint32_t silent_ms) {
+  if (gw == NULL) return 0;
+  uint16_t n = 0;
+  uint32_t now = millis();
+  MC_LOCK();
+  for (uint16_t i = gw->node_tail;
+       i != NODE_NONE && n < max &&
+       now - gw->nodes[i].n.last_seen_ms >= silent_ms;
+       i = gw->nodes[i].prev)
+    node_copy(i, &out[n++]);
+  MC_UNLOCK();
+  return n;
+}
+
+bool SimpleMQTT::get_node(const char *name, mqtt_node_st *out) {
+  if (gw == NULL) return false;
+  uint32_t key = alias_src_hash(name);
+  MC_LOCK();
+  uint32_t h = node_lookup(key, name);
+  bool found = gw->node_index[h] != 0;
+  if (found) node_copy(gw->node_index[h] - 1, out);
+  MC_UNLOCK();
+  return found;
+}
+
+void SimpleMQTT::reset_nodes(void) {
+  if (gw == NULL) return;
+  MC_LOCK();
+  memset(gw->node_index, 0, sizeof(gw->node_index));
+  gw->node_cnt = 0;
+  gw->node_head = NODE_NONE;
+  gw->node_tail = NODE_NONE;
+  MC_UNLOCK();
+}
+
 // MQTT src_node/MSID\n
 // P:dest_node/...
 
@@ -859,6 +2930,19 @@ void SimpleMQTT::parse(const unsigned char *data, int size, uint32_t replyId) {
   char src_node_name[20] = "";
   bool new_msg = false;
 
+  if (lzframe_is(data, size)) {
+    uint8_t plain[256];
+    int n = lzframe_decompress(plain, sizeof(plain), data, size);
+    if (n > 0) {
+      parse(plain, n, replyId);
+      return;
+    }
+    // not compressed after all: a raw frame
+  }
+  ack_frame = false;
+  qos2_hold = -1;
+  TRACE(TRACE_RECV, replyId, size);
+
 #ifdef DEBUG_PRINTS
   Serial.printf("> Simple mqtt id:%u parse: ", replyId);
   Serial.println((const char *)data);
@@ -878,29 +2962,33 @@ void SimpleMQTT::parse(const unsigned char *data, int size, uint32_t replyId) {
       msgid[1] = data[i + 2];
       msgid[2] = data[i + 3];
       msgid[3] = data[i + 4];
-      // check mqtt message for duplicate
-      int16_t idx = mqtt_get_mqtt_mids_by_id(msgid);
-      if (idx != -1) {
-// found in the cache - not new
+      bool mine;
+      if ((this->op_mode == MODE_GW_ACK_ALL ||
+           this->op_mode == MODE_GW_ACK_MY) &&
+          !aliases_known(data, size, src_node_name, &mine)) {
+        // only the gateway that would ACK the frame asks for full topics
+        if (replyId && (this->op_mode == MODE_GW_ACK_ALL || mine))
+          send("ARST", 5, replyId);
+        return;
+      }
+      // check mqtt message for duplicate, new ones are added to the cache
+      uint8_t qos =
+          i + 6 < size && data[i + 5] == ' ' && data[i + 6] == '2' ? 2 : 1;
+      if (!mqtt_dedup_frame(src_node_name, msgid, qos, &new_msg)) return;
+      node_rx(src_node_name, new_msg);
 #ifdef DEBUG_PRINTS
+      // found in the cache - not new
+      if (!new_msg) {
         Serial.print(" mqtt message skipped, it's in the cache:");
         Serial.println(msgid);
-#endif
-      } else {
-        new_msg = true;
-        // add msgid to the cache
-        mqtt_mids_idx++;
-        if (mqtt_mids_idx >= MQTT_MSG_ID_LIST_SIZE) {
-          mqtt_mids_idx = 0;
-        }
-        mqtt_mids[mqtt_mids_idx].mdsid[0] = msgid[0];
-        mqtt_mids[mqtt_mids_idx].mdsid[1] = msgid[1];
-        mqtt_mids[mqtt_mids_idx].mdsid[2] = msgid[2];
-        mqtt_mids[mqtt_mids_idx].mdsid[3] = msgid[3];
       }
+#endif
     } else {
       i = 0;
     }
+    // relative topics refer to the previous topic of this frame
+    _prev_topic = NULL;
+    _prev_topic_len = 0;
     // process each mqtt message
     while (i < size) {
       for (; i < size; i++) {
@@ -916,16 +3004,43 @@ void SimpleMQTT::parse(const unsigned char *data, int size, uint32_t replyId) {
         }
       }
     }
+  } else if (binframe_is(data, size) && parse_bin(data, size)) {
+    // binary MQTT frame, other frames starting with its magic are raw
   } else {
     uint32_t elapsed = 0;
 
     if (strcmp("ACK", (const char *)data) == 0) {
-      // int16_t idx = mc_del_msg(replyId);
-      int16_t idx = mc_find_msg(replyId);
-      if (idx != -1) {
-        // mark for deletion
+      int16_t idx = -1;
+      bool resent = false;
+      MC_LOCK();
+      int16_t i = mc_index_get(replyId);
+      if (i != -1 && mc_db[i].msg_ptr != NULL && mc_db[i].reply_id != 0 &&
+          (mc_db[i].reply_id == replyId || mc_db[i].reply_id_prev == replyId)) {
+        // mark for deletion, resend_loop frees it
+        idx = i;
+        mc_index_del(mc_db[idx].reply_id, idx);
+        mc_index_del(mc_db[idx].reply_id_prev, idx);
         mc_db[idx].reply_id = 0;
+        resent = mc_db[idx].reply_id_prev != 0;
         elapsed = millis() - (mc_db[idx].expire_ts - mc_db[idx].timeout);
+        if (mc_db[idx].dest)
+          node_tx(mc_db[idx].dest,
+                  resent ? NODE_TX_ACKED_RESENT : NODE_TX_ACKED, elapsed);
+      }
+      MC_UNLOCK();
+      if (idx != -1) {
+        uint16_t head = mc_acked_head;
+        uint16_t next = (head + 1) % (MAX_MC_ITEMS + 1);
+        if (next != __atomic_load_n(&mc_acked_tail, __ATOMIC_ACQUIRE)) {
+          mc_acked[head] = idx;
+          __atomic_store_n(&mc_acked_head, next, __ATOMIC_RELEASE);
+        }
+        // Karn: the ACK may belong to any transmission of a resent frame
+        if (!resent) rto_sample(elapsed);
+        MC_LOCK();
+        hist_add(&stats.rtt_ms, elapsed);
+        MC_UNLOCK();
+        TRACE(TRACE_ACK, replyId, elapsed > 0xFFFF ? 0xFFFF : elapsed);
         if (elapsed < telemetry_t.rtt_min) telemetry_t.rtt_min = elapsed;
         if (elapsed > telemetry_t.rtt_max) telemetry_t.rtt_max = elapsed;
         if (telemetry_t.rtt_avg_x64 == 0)
@@ -956,14 +3071,20 @@ void SimpleMQTT::parse(const unsigned char *data, int size, uint32_t replyId) {
         // Serial.print(" rtt_x512: "); Serial.print(telemetry_t.rtt_avg_x512 >>
         // 9); Serial.print(" rtt_x4096: ");
         // Serial.print(telemetry_t.rtt_avg_x4096 >> 12);
-        Serial.printf("\nUsed mc_db bytes: %u, slots: %u, count_slots: %u\n", mc_used_bytes, mc_used_slots, mc_count_used_slots() );
+        Serial.printf("\nUsed mc_db blocks: %u/%u/%u, slots: %u, count_slots: %u\n", mc_small_slab.used, mc_medium_slab.used, mc_large_slab.used, mc_used_slots, mc_count_used_slots() );
 //        Serial.printf(" CORE #%d\n",  xPortGetCoreID());
 #endif
       } else {
+        TRACE(TRACE_ACK_UNKNOWN, replyId, 0);
 #ifdef DEBUG_PRINTS
         Serial.printf("I: No message with ACK id: %u\n", replyId);
 #endif
       }
+    } else if (strcmp("ARST", (const char *)data) == 0) {
+      // handled by resend_loop, it owns the cached frames
+      alias_rst_pending = true;
+    } else if (size > 4 && strncmp("REL ", (const char *)data, 4) == 0) {
+      mqtt_qos2_release(data, size);
     }
 
     if (this->op_mode == MODE_GW_ACK_ALL || this->op_mode == MODE_GW_ACK_MY) {
@@ -974,21 +3095,26 @@ void SimpleMQTT::parse(const unsigned char *data, int size, uint32_t replyId) {
       }
     }
   }
+  // not ACKed here: not ours to hold
+  if (qos2_hold >= 0 && !ack_frame) mqtt_qos2[qos2_hold].key = 0;
+  if (ack_frame) ack_put(replyId);
 }
 
 const char *SimpleMQTT::decompressTopic(const char *topic) {
-  static char t[100] = {0};
-  static char b[100];
+  char(&t)[sizeof(_decompress_prev)] = _decompress_prev;
+  char(&b)[sizeof(_decompress_buf)] = _decompress_buf;
+  size_t topic_len = strlen(topic);
   if (topic[0] != '.') {
-    memcpyS(t, sizeof(t), topic, strlen(topic) + 2);
+    memcpyS(t, sizeof(t), topic, topic_len + 2);
     return t;
   }
   unsigned int c = 0;
-  for (c = 0; c < strlen(topic) && topic[c] == '.'; c++)
+  for (c = 0; c < topic_len && topic[c] == '.'; c++)
     ;
 
   unsigned int index = 0;
-  for (unsigned int i = 0; i < strlen(t); i++) {
+  size_t t_len = strlen(t);
+  for (unsigned int i = 0; i < t_len; i++) {
     if (t[i] == '/') {
       index++;
       if (index == c) {
@@ -998,47 +3124,163 @@ const char *SimpleMQTT::decompressTopic(const char *topic) {
     }
   }
   memcpyS(b, sizeof(b), t, index);
-  memcpyS(b + index, sizeof(t) - index, topic + c, strlen(topic) + 1);
-  memcpyS(t, sizeof(t), b, strlen(b) + 1);
+  memcpyS(b + index, sizeof(t) - index, topic + c, topic_len - c + 1);
+  memcpyS(t, sizeof(t), b, index + topic_len - c + 1);
   return b;
 }
 
+// Expands a relative topic against the previous one of the same frame
+// without copying full topics: those are returned as they are and only
+// remembered as views into the frame. Returns NULL if it can't be expanded.
+const char *SimpleMQTT::decompressTopic(const char *topic, uint16_t len,
+                                        uint16_t *out_len) {
+  if (len == 0 || topic[0] != '.') {
+    _prev_topic = topic;
+    _prev_topic_len = len;
+    *out_len = len;
+    return topic;
+  }
+  if (_prev_topic == NULL) return NULL;
+
+  uint16_t c = 0;
+  for (; c < len && topic[c] == '.'; c++)
+    ;
+  // keep the first c levels of the previous topic
+  uint16_t index = 0, level = 0;
+  for (; index < _prev_topic_len; index++) {
+    if (_prev_topic[index] == '/' && ++level == c) break;
+  }
+  if (level != c || (uint32_t)(index + len - c) > sizeof(_topic_buf))
+    return NULL;
+
+  if (_prev_topic != _topic_buf) memcpy(_topic_buf, _prev_topic, index);
+  memcpy(_topic_buf + index, topic + c, len - c);
+  _prev_topic = _topic_buf;
+  _prev_topic_len = index + (len - c);
+  *out_len = _prev_topic_len;
+  return _topic_buf;
+}
+
 void SimpleMQTT::parse2(const char *c, unsigned int l, char *src_node_name,
                         char *msgid, bool new_msg) {
-  char command = c[0];
   if (l > 4 && c[1] == ':') {
-    char topic[70];
-    char value[240];
-    bool for_us = false;
     unsigned int i = 2;
 
     for (; (i < l) && c[i] != ' '; i++)
       ;  // find optional ' '
 
-    if (i > sizeof(topic)) {
+    parse_cmd(c[0], c + 2, i - 2, i < l ? c + i + 1 : c + l,
+              i < l ? l - i - 1 : 0, src_node_name, msgid, new_msg);
+  }
+}
+
+// binary frames: the commands are decoded one by one, topics alternate
+// between two buffers as a relative topic may refer to the previous one.
+// False if the header isn't valid (not a binary MQTT frame).
+bool SimpleMQTT::parse_bin(const unsigned char *data, int size) {
+  binframe_reader r;
+  char src_node_name[20];
+  char msgid[] = "XXXX";
+  uint8_t flags;
+  if (!binframe_header(&r, data, size, src_node_name, sizeof(src_node_name),
+                       msgid, &flags)) {
 #ifdef DEBUG_PRINTS
-      Serial.print("Invalid Topic length:");
-      Serial.println(l);
+    Serial.println("Invalid binary frame");
+#endif
+    return false;
+  }
+  bool mine;
+  if ((this->op_mode == MODE_GW_ACK_ALL || this->op_mode == MODE_GW_ACK_MY) &&
+      !aliases_known(data, size, src_node_name, &mine)) {
+    if (replyId && (this->op_mode == MODE_GW_ACK_ALL || mine))
+      send("ARST", 5, replyId);
+    return true;
+  }
+  bool new_msg;
+  if (!mqtt_dedup_frame(src_node_name, msgid, flags & BINFRAME_FLAG_QOS_MASK,
+                        &new_msg))
+    return true;
+  node_rx(src_node_name, new_msg);
+
+  char topic[2][100];
+  char num[BINFRAME_NUM_BUF_SIZE];
+  uint8_t t = 0;
+  _prev_topic = NULL;
+  _prev_topic_len = 0;
+  while (true) {
+    char command;
+    uint16_t topic_len, value_len;
+    const char *value;
+    if (_prev_topic >= topic[t] && _prev_topic < topic[t] + sizeof(topic[t]))
+      t ^= 1;
+    int ret = binframe_next(&r, &command, topic[t], sizeof(topic[t]),
+                            &topic_len, &value, &value_len, num);
+    if (ret <= 0) {
+#ifdef DEBUG_PRINTS
+      if (ret < 0) Serial.println("Invalid binary command");
+#endif
+      return true;
+    }
+    parse_cmd(command, topic[t], topic_len, value != NULL ? value : "",
+              value_len, src_node_name, msgid, new_msg);
+  }
+}
+
+// one command, topic and value are not '\0' terminated
+void SimpleMQTT::parse_cmd(char command, const char *topic_raw,
+                           uint16_t topic_raw_len, const char *value_raw,
+                           uint16_t value_raw_len, char *src_node_name,
+                           char *msgid, bool new_msg) {
+  bool for_us = false;
+
+  if (topic_raw_len > 1 && topic_raw[0] == '@') {
+    topic_raw = alias_resolve(src_node_name, topic_raw, &topic_raw_len);
+    if (topic_raw == NULL) {
+#ifdef DEBUG_PRINTS
+      Serial.println("Unknown topic alias");
 #endif
       return;
     }
+  }
 
-    memcpyS(topic, sizeof(topic), c + 2, l - 2);
-    topic[i - 2] = 0;
+  // is it for us ?
+  if (my_topic(topic_raw, topic_raw_len)) for_us = true;
 
-    // is it for us ?
-    if (strncmp(topic, myDeviceName.c_str(), strlen(myDeviceName.c_str())) ==
-        0) {
-      for_us = true;
+  if (viewCallBack != NULL) {
+    // in place: views of the received frame, only relative topics are
+    // expanded into _topic_buf
+    uint16_t topic_len;
+    const char *topic = decompressTopic(topic_raw, topic_raw_len, &topic_len);
+    if (topic == NULL) {
+#ifdef DEBUG_PRINTS
+      Serial.println("Invalid relative topic");
+#endif
+      return;
+    }
+    if (new_msg && (this->op_mode != MODE_NODE_STD || for_us)) {
+      viewCallBack(src_node_name, msgid, command, topic, topic_len, value_raw,
+                   value_raw_len);
     }
+    if (new_msg && handlers_cnt > 0)
+      dispatch(topic, topic_len, value_raw, value_raw_len);
+  } else {
+    char topic[70];
+    char value[240];
 
-    if (i < l) {  // value is present in message
-      memcpyS(value, sizeof(value), c + i + 1, l - i);
-      value[l - i - 1] = 0;
-    } else {
-      value[0] = 0;
+    if (topic_raw_len + 2u > sizeof(topic)) {
+#ifdef DEBUG_PRINTS
+      Serial.print("Invalid Topic length:");
+      Serial.println(topic_raw_len);
+#endif
+      return;
     }
 
+    memcpy(topic, topic_raw, topic_raw_len);
+    topic[topic_raw_len] = 0;
+    if (value_raw_len >= sizeof(value)) value_raw_len = sizeof(value) - 1;
+    memcpy(value, value_raw, value_raw_len);
+    value[value_raw_len] = 0;
+
     const char *decompressedTopic = decompressTopic(topic);
 
     this->_topic = decompressedTopic;
@@ -1055,12 +3297,12 @@ void SimpleMQTT::parse2(const char *c, unsigned int l, char *src_node_name,
     this->_topic = NULL;
     this->_value = NULL;
 
-    if (replyId && (this->op_mode == MODE_GW_ACK_ALL || for_us)) {
-      // Reply/Ack requested
-      send("ACK", 4, replyId);
-      // async ACK
-      // mc_add_msg((uint8_t *) "ACK", 4, ttl, replyId, 0, 1);
-      telemetry_t.ack_pkt++;
-    }
+    if (new_msg && handlers_cnt > 0)
+      dispatch(decompressedTopic, strlen(decompressedTopic), value,
+               strlen(value));
   }
+
+  // Reply/Ack requested, parse() queues one for the whole frame
+  if (replyId && (this->op_mode == MODE_GW_ACK_ALL || for_us))
+    ack_frame = true;
 }
@@ -5,19 +5,216 @@
 
 const char mesh_gw_name[] = "m";
 
-#define MQTT_MSG_ID_LIST_SIZE 30
+// ESP8266 sketches have ~40 KB of heap left: smaller defaults (~11 KB per
+// object, ~8 KB more in gateway modes) unless they are set before
+#ifdef ESP8266
+#ifndef MAX_MC_ITEMS
+#define MAX_MC_ITEMS 32
+#endif
+#ifndef MAX_MC_MEM
+#define MAX_MC_MEM 4000
+#endif
+#ifndef MQTT_DEDUP_SIZE
+#define MQTT_DEDUP_SIZE 128
+#endif
+#ifndef MQTT_DEDUP_NODE_SIZE
+#define MQTT_DEDUP_NODE_SIZE 32
+#endif
+#ifndef MQTT_MAX_HANDLERS
+#define MQTT_MAX_HANDLERS 16
+#endif
+#ifndef MQTT_ALIAS_NODES
+#define MQTT_ALIAS_NODES 8
+#endif
+#ifndef MQTT_NODE_ENTRIES
+#define MQTT_NODE_ENTRIES 16
+#endif
+#endif
+
+// duplicate message filter: number of (source node, message id) pairs
+// remembered and for how long. Gateways and MODE_NODE_RECEIVE_ALL, which
+// handle every frame, keep MQTT_DEDUP_SIZE (allocated by set_op_mode()),
+// MODE_NODE_STD nodes MQTT_DEDUP_NODE_SIZE.
+#ifndef MQTT_DEDUP_SIZE
+#define MQTT_DEDUP_SIZE 512
+#endif
+#ifndef MQTT_DEDUP_NODE_SIZE
+#define MQTT_DEDUP_NODE_SIZE 64
+#endif
+#ifndef MQTT_DEDUP_TTL_MS
+#define MQTT_DEDUP_TTL_MS 60000
+#endif
 
 #include <Arduino.h>
 #include <safememcpy.h>
 
+#include "hist_util.h"
+
 #include <list>
 #include <map>
 
+// smallest power of two >= n, for hash table sizes
+static constexpr uint32_t mqtt_pow2(uint32_t n, uint32_t p = 1) {
+  return p >= n ? p : mqtt_pow2(n, p * 2);
+}
+
+// number of handlers the _onXxx functions can register (EITHER takes two)
+#ifndef MQTT_MAX_HANDLERS
+#define MQTT_MAX_HANDLERS 32
+#endif
+#define MQTT_HANDLER_INDEX_SIZE mqtt_pow2(2 * MQTT_MAX_HANDLERS)
+// decimals of temp/humidity/pressure/float values unless set_precision()
+// says otherwise, and how many set_precision() calls are kept
+#ifndef MQTT_FLOAT_PRECISION
+#define MQTT_FLOAT_PRECISION 2
+#endif
+#ifndef MQTT_MAX_PRECISIONS
+#define MQTT_MAX_PRECISIONS 8
+#endif
+// largest decoded value handed to a string/bin callback
+#define MQTT_VALUE_BUF_SIZE 240
+
+// topic aliases: topics this node replaces by "@n" when enabled; nodes
+// whose bindings a gateway remembers and bindings per node; longest
+// aliased topic
+#ifndef MQTT_TOPIC_ALIASES
+#define MQTT_TOPIC_ALIASES 8
+#endif
+#ifndef MQTT_ALIAS_NODES
+#define MQTT_ALIAS_NODES 16
+#endif
+#ifndef MQTT_ALIAS_PER_NODE
+#define MQTT_ALIAS_PER_NODE MQTT_TOPIC_ALIASES
+#endif
+#ifndef MQTT_ALIAS_TOPIC_LEN
+#define MQTT_ALIAS_TOPIC_LEN 48
+#endif
+// shorter topics are not worth an alias
+#ifndef MQTT_ALIAS_MIN_LEN
+#define MQTT_ALIAS_MIN_LEN 8
+#endif
+
 // Sent messages cache engine
 
-// max memory used for storing sent message cache
-#define MAX_MC_MEM 10000
+#ifndef MAX_MC_ITEMS
 #define MAX_MC_ITEMS 100
+#endif
+
+// Sent frames are copied into static pools of fixed size blocks (no heap
+// use): a frame takes a block of the smallest size class it fits in, or of
+// a larger one when that pool is exhausted. The pools share MAX_MC_MEM
+// bytes, 1/4 small and 3/8 each medium and large blocks: 39 + 29 + 15
+// blocks of 10000 bytes, 15 + 11 + 6 of 4000 (ESP8266).
+#ifndef MAX_MC_MEM
+#define MAX_MC_MEM 10000
+#endif
+#ifndef MC_SMALL_BLOCK_SIZE
+#define MC_SMALL_BLOCK_SIZE 64
+#endif
+#ifndef MC_SMALL_BLOCKS
+#define MC_SMALL_BLOCKS (MAX_MC_MEM / 4 / MC_SMALL_BLOCK_SIZE)
+#endif
+#ifndef MC_MEDIUM_BLOCK_SIZE
+#define MC_MEDIUM_BLOCK_SIZE 128
+#endif
+#ifndef MC_MEDIUM_BLOCKS
+#define MC_MEDIUM_BLOCKS (MAX_MC_MEM * 3 / 8 / MC_MEDIUM_BLOCK_SIZE)
+#endif
+// ESP-NOW frames are 250 bytes at most
+#ifndef MC_LARGE_BLOCK_SIZE
+#define MC_LARGE_BLOCK_SIZE 250
+#endif
+#ifndef MC_LARGE_BLOCKS
+#define MC_LARGE_BLOCKS (MAX_MC_MEM * 3 / 8 / MC_LARGE_BLOCK_SIZE)
+#endif
+#if MC_SMALL_BLOCKS < 1 || MC_MEDIUM_BLOCKS < 1 || MC_LARGE_BLOCKS < 1
+#error "MAX_MC_MEM too small for one block of each size"
+#endif
+#if MC_SMALL_BLOCKS * MC_SMALL_BLOCK_SIZE + \
+        MC_MEDIUM_BLOCKS * MC_MEDIUM_BLOCK_SIZE + \
+        MC_LARGE_BLOCKS * MC_LARGE_BLOCK_SIZE > MAX_MC_MEM
+#error "MC_*_BLOCKS take more than MAX_MC_MEM"
+#endif
+
+// largest frame built by _raw() / send_commands() (with the '\0'), the
+// message cache takes up to MC_LARGE_BLOCK_SIZE
+#ifndef MQTT_FRAME_BUDGET
+#define MQTT_FRAME_BUDGET 250
+#endif
+
+// bounds of the adaptive resend timeout (RTO), see set_adaptive_rto();
+// the RTO is at least MQTT_RTO_MIN_MS above the smoothed round trip time
+#ifndef MQTT_RTO_MIN_MS
+#define MQTT_RTO_MIN_MS 20
+#endif
+#ifndef MQTT_RTO_MAX_MS
+#define MQTT_RTO_MAX_MS 10000
+#endif
+
+// in-flight window (unACKed frames) of the congestion control, see
+// set_congestion_control()
+#ifndef MQTT_CWND_INIT
+#define MQTT_CWND_INIT 4
+#endif
+#ifndef MQTT_CWND_MAX
+#define MQTT_CWND_MAX 32
+#endif
+
+// QoS of async commands, see set_default_qos() and set_qos():
+// MQTT_QOS_AUTO takes it from the set_qos() rules
+#define MQTT_QOS_AUTO 0xFF
+#ifndef MQTT_MAX_QOS_RULES
+#define MQTT_MAX_QOS_RULES 8
+#endif
+// QoS 2 message ids a receiver holds until the sender releases them, and
+// for how long at most; while all are held new QoS 2 frames are refused
+// (not ACKed, the sender resends them)
+#ifndef MQTT_QOS2_ENTRIES
+#define MQTT_QOS2_ENTRIES 16
+#endif
+#ifndef MQTT_QOS2_HOLD_MS
+#define MQTT_QOS2_HOLD_MS MQTT_DEDUP_TTL_MS
+#endif
+
+// mc_item.qos of a cached release ("REL src/msgid"), resent until ACKed
+#define MC_QOS_REL 3
+
+// resend_next_ms() result when no message is waiting for a resend
+#define MC_NO_DEADLINE 0xFFFFFFFF
+
+// SimpleMQTT objects that can exist at the same time, received frames are
+// handed to each of them
+#ifndef MQTT_MAX_INSTANCES
+#define MQTT_MAX_INSTANCES 4
+#endif
+
+// frames the mesh callback can queue for process_incoming() (a power of
+// two, 0: no deferred receive), each takes a MQTT_RX_FRAME_SIZE slot of
+// heap allocated by set_deferred_receive(true)
+#ifndef MQTT_RX_QUEUE_LEN
+#define MQTT_RX_QUEUE_LEN 8
+#endif
+#define MQTT_RX_FRAME_SIZE 250
+
+// received frames waiting for their ACK from resend_loop() (a power of
+// two); when full, ACKs are sent at once
+#ifndef MQTT_ACK_QUEUE_LEN
+#define MQTT_ACK_QUEUE_LEN 16
+#endif
+
+// nodes a gateway keeps state of (frames, RTT, last seen), see
+// get_nodes(); the least recently seen one makes room for a new one
+#ifndef MQTT_NODE_ENTRIES
+#define MQTT_NODE_ENTRIES 32
+#endif
+
+// hash table sizes: reply id -> cache slot (4 keys per item, load factor
+// at most 50%), (node, message id) -> dedup ring position and node name
+// -> node table entry
+#define MC_INDEX_SIZE mqtt_pow2(4 * MAX_MC_ITEMS)
+#define MQTT_DEDUP_INDEX_SIZE mqtt_pow2(2 * MQTT_DEDUP_SIZE)
+#define MQTT_DEDUP_NODE_INDEX_SIZE mqtt_pow2(2 * MQTT_DEDUP_NODE_SIZE)
+#define MQTT_NODE_INDEX_SIZE mqtt_pow2(2 * MQTT_NODE_ENTRIES)
 
 #pragma pack(push, 1)
 
@@ -30,6 +227,10 @@ struct mc_item {
   uint16_t timeout;
   uint32_t expire_ts;
   uint8_t try_cnt;
+  uint8_t resends;  // times resent, for the retries histogram
+  uint8_t waiting;  // in the send queue, not sent yet
+  uint8_t qos;      // 2: release the message id when ACKed, MC_QOS_REL
+  uint32_t dest;    // node table entry of the first command's device, or 0
 };
 
 struct telemetry_t_st {
@@ -44,6 +245,119 @@ struct telemetry_t_st {
 
 #pragma pack(pop)
 
+// pool of fixed size blocks for cached frames, see mc_slab_alloc()
+struct mc_slab {
+  uint8_t *blocks;
+  uint16_t block_size;
+  uint16_t count;
+  uint16_t free_head;  // index + 1 of the first free block, 0 if none
+  uint16_t bump;       // blocks from here on have never been used
+  uint16_t used;
+  uint16_t used_max;
+};
+
+struct mc_index_item {
+  uint32_t reply_id;
+  uint16_t idx;
+};
+
+struct mqtt_dedup_item {
+  uint64_t key;  // hash of source node name and message id
+  uint32_t ts;   // millis() when seen
+};
+
+struct mqtt_qos_rule {
+  char levels[24];
+  uint8_t len;
+  uint8_t qos;
+};
+
+struct mqtt_alias_tx_item {
+  uint8_t len;
+  char topic[MQTT_ALIAS_TOPIC_LEN];
+};
+
+struct mqtt_alias_rx_item {
+  uint32_t used;  // alias_clock when last used
+  uint8_t alias;
+  uint8_t len;  // 0 = free entry
+  char topic[MQTT_ALIAS_TOPIC_LEN];
+};
+
+// aliases bound by one node (gateway side)
+struct mqtt_alias_rx_node {
+  uint32_t src;  // hash of the source node name, 0 = free entry
+  uint32_t used;
+  mqtt_alias_rx_item aliases[MQTT_ALIAS_PER_NODE];
+};
+
+// deferred receive queue counters, see set_deferred_receive()
+struct mqtt_rx_stats_st {
+  uint32_t received;  // frames queued
+  uint32_t dropped;   // queue full
+  uint32_t oversize;  // longer than MQTT_RX_FRAME_SIZE
+  uint16_t depth;     // frames waiting now
+  uint16_t depth_max;
+};
+
+// delivery and cache statistics, see get_stats(); hist_percentile() reads
+// p50/p99/p99.9 from the histograms
+struct mqtt_stats_st {
+  hist rtt_ms;       // ACK round trip times
+  hist retries;      // resends of each ACKed frame
+  hist parse_us;     // time in parse() per received frame
+  hist cache_slots;  // mc_db slots in use when a frame is added
+  uint16_t cache_slots_max;
+  uint32_t cache_bytes;  // pool blocks in use
+  uint32_t cache_bytes_max;
+  uint32_t delivered;   // frames ACKed
+  uint32_t lost;        // frames given up after tryCount resends
+  uint32_t dedup_hits;  // received frames dropped as duplicates
+  uint32_t qos2_refused;  // QoS 2 frames not taken, all ids held
+  uint32_t cache_full;  // frames not sent, no free slot or block
+  uint32_t flush_failed;  // coalesced frames not sent when due, kept
+};
+
+// congestion control state, see set_congestion_control()
+struct mqtt_cc_stats_st {
+  uint16_t cwnd;        // frames that may be in flight
+  uint16_t in_flight;   // sent, not ACKed yet
+  uint16_t queued;      // waiting for the window
+  uint16_t queued_max;
+  uint32_t cuts;        // window halved on a resend
+};
+
+// what a gateway knows about a node it got frames from, see get_nodes()
+struct mqtt_node_st {
+  char name[20];
+  uint32_t first_seen_ms;  // millis()
+  uint32_t last_seen_ms;
+  uint32_t interval_ms;  // average time between its frames
+  uint32_t rx_frames;    // frames received from it
+  uint32_t rx_dups;      // copies received again: it resent, ACKs get lost
+  uint32_t tx_frames;    // async frames sent to it (device of the topic)
+  uint32_t tx_acked;
+  uint32_t tx_resent;  // resends of these
+  uint32_t tx_lost;    // given up after tryCount resends
+  uint16_t srtt_ms;    // smoothed round trip of its ACKs, 0 = none yet
+  uint16_t rttvar_ms;
+  uint16_t rtt_max_ms;
+};
+
+// message cache block pool usage
+struct mc_pool_stats_st {
+  uint16_t small_block_size;
+  uint16_t small_free;
+  uint16_t small_used_max;
+  uint16_t medium_block_size;
+  uint16_t medium_free;
+  uint16_t medium_used_max;
+  uint16_t large_block_size;
+  uint16_t large_free;
+  uint16_t large_used_max;
+  uint32_t free_bytes;
+};
+
 typedef enum { SUBSCRIBE, UNSUBSCRIBE, GET, PUBLISH } Mqtt_cmd;
 
 typedef enum { SWITCH_ON, SWITCH_OFF } MQTT_switch;
@@ -63,12 +377,22 @@ typedef enum {
   MODE_GW_ACK_MY
 } OP_MODE;
 
-#pragma pack(push, 1)
-struct mqtt_msgid_item {
-  uint8_t mdsid[4];
-  // unsigned long lastseen;
+// format of the sent frames (see binframe_util.h), received frames can be
+// in either
+typedef enum { WIRE_TEXT, WIRE_BINARY } WIRE_FORMAT;
+
+// one command of send_commands()
+struct mqtt_command {
+  char cmd;           // 'P', 'S', 'G' or 'U'
+  const char *topic;  // full topic
+  const char *value;  // NULL if none
 };
-#pragma pack(pop)
+
+// generic callback pointer and the decoder calling it with a typed value
+typedef void (*mqtt_cb_t)(void);
+// (arg: decimals of fixed point values)
+typedef bool (*mqtt_invoke_t)(mqtt_cb_t cb, const char *value, uint16_t len,
+                              char *scratch, uint8_t arg);
 
 // message example
 // MQTT src_node/mUID
@@ -77,13 +401,68 @@ struct mqtt_msgid_item {
 
 class SimpleMQTT {
  public:
+  // Up to MQTT_MAX_INSTANCES objects may exist, each with its own message
+  // cache, duplicate filter and aliases (no state is shared)
   SimpleMQTT(int ttl, const char *myDeviceName, uint16_t tryCount = 10,
              int timeoutMs = 70, uint16_t backoffMs = 70);
   ~SimpleMQTT();
+  SimpleMQTT(const SimpleMQTT &) = delete;
+  SimpleMQTT &operator=(const SimpleMQTT &) = delete;
 
   const char *resend_loop(void);
+  // ms until resend_loop has work to do, MC_NO_DEADLINE if none
+  uint32_t resend_next_ms(void);
+  // timeoutMs is the first resend timeout, adaptive or not
   void setTimeouts(uint16_t tryCount, int timeoutMs, uint16_t backoffMs);
+  // Resend timeouts from the measured round trip times (RFC 6298 SRTT and
+  // RTTVAR, doubled per resend). Off, the default: timeoutMs plus
+  // 1/8..1/4 per resend.
+  void set_adaptive_rto(bool enable);
+  // timeout given to the next frame sent
+  uint16_t get_rto(void);
+  // call it in setup(): the tables of the other modes are allocated once
+  // (heap) on the first switch from MODE_NODE_STD
   void set_op_mode(OP_MODE mode = MODE_NODE_STD);
+  // WIRE_BINARY needs every receiver to run a version that parses it
+  void set_wire_format(WIRE_FORMAT format = WIRE_TEXT);
+  // replace repeated topics by "@n" aliases, for nodes talking to a
+  // gateway that supports them
+  void set_topic_aliases(bool enable);
+  // LZ compress frames against a built-in dictionary of protocol strings
+  // (lzframe_util.h), like WIRE_BINARY every node must understand it
+  void set_compression(bool enable);
+  // Commands of async publish/subscribe/... calls are packed into one frame
+  // (0 = off): it's sent when full, window_ms after its first command
+  // (from resend_loop) or on flush()
+  void set_coalescing(uint16_t window_ms);
+  // false if the frame couldn't be sent (cache full): it stays pending and
+  // resend_loop() tries again window_ms later
+  bool flush(void);
+  // Received frames are only copied into a queue by the mesh callback and
+  // parsed (callbacks, ACKs) by process_incoming() or resend_loop(), in the
+  // task that sends. Off: parsed in the mesh callback, so handlers must not
+  // publish. On by default on ESP32, where that callback is the WiFi task.
+  void set_deferred_receive(bool enable);
+  // parses the queued frames, returns how many (resend_loop() calls it)
+  uint16_t process_incoming(void);
+  void get_rx_stats(mqtt_rx_stats_st *stats);
+  // a frame from the mesh: parsed now or queued
+  void receive(const uint8_t *data, int len, uint32_t replyId);
+  // AIMD window on frames sent and not ACKed yet: it grows by one frame
+  // per window of ACKs and halves (at most once per RTO) when a frame has
+  // to be resent. Async frames beyond it wait in the message cache and are
+  // sent by resend_loop(). Off, the default: frames are sent at once.
+  void set_congestion_control(bool enable);
+  void get_cc_stats(mqtt_cc_stats_st *stats);
+  // QoS of async commands: 0 sent once (not cached, not ACKed), 1 resent
+  // until ACKed (the default), 2 as 1 and delivered exactly once: the
+  // receiver holds the message id until the sender releases it
+  void set_default_qos(uint8_t qos);
+  // QoS of commands whose topic contains the level(s) `levels`, e.g.
+  // "power" or "bme280/value"; a frame gets the highest of its commands
+  bool set_qos(const char *levels, uint8_t qos);
+  // how long received message ids are remembered as duplicates
+  void set_dedup_ttl(uint32_t ms = MQTT_DEDUP_TTL_MS);
   void gen_random_str(char *s, const int len);
   char *get_msg_uuid(void);
   
@@ -95,10 +474,31 @@ class SimpleMQTT {
   int8_t mc_del_msg_idx(uint16_t i);
   uint16_t mc_get_used_slots(void);
   uint16_t mc_count_used_slots(void);
+  void mc_get_pool_stats(mc_pool_stats_st *stats);
+  // updated without synchronization, get_stats() gives a consistent copy
   telemetry_t_st *get_telemetry_t_ptr(void);
+  void get_stats(mqtt_stats_st *stats);
+  void reset_stats(void);
+  // Node table of the gateway modes: each node frames came from, with
+  // counters, the round trip times of its ACKs and when it was last heard
+  // of; updated per frame in O(1). The get functions copy entries under
+  // the cache lock, so ask for a few at a time.
+  uint16_t node_count(void);
+  // up to `max` nodes, most recently seen first. With a cursor (0 at
+  // first) it goes on after the last node of the previous call and sets
+  // it to 0 at the end of the table, or when that node was replaced.
+  uint16_t get_nodes(mqtt_node_st *out, uint16_t max,
+                     uint32_t *cursor = NULL);
+  // up to `max` nodes not heard of for `silent_ms`, longest silent first
+  uint16_t get_silent_nodes(mqtt_node_st *out, uint16_t max,
+                            uint32_t silent_ms);
+  bool get_node(const char *name, mqtt_node_st *out);
+  void reset_nodes(void);
 
   bool publish(const char *deviceName, const char *parameterName,
                const char *value);
+  bool publish(const char *deviceName, const char *parameterName,
+               const char *value, uint8_t qos);
   bool publish_sync(const char *deviceName, const char *parameterName,
                const char *value);
 
@@ -112,11 +512,25 @@ class SimpleMQTT {
 
   void handleEvents(void (*cb)(const char *, const char *, char, const char *,
                                const char *));
+  // Zero copy alternative to handleEvents(): topic and value point into
+  // the received frame and are NOT '\0' terminated, use the lengths. Only
+  // relative ("../") topics are expanded into an internal buffer. While a
+  // view callback is set handleEvents() callbacks and the _ifXxx helpers
+  // are not used.
+  void handleEvents_view(void (*cb)(const char *src_node_name,
+                                    const char *msgid, char command,
+                                    const char *topic, uint16_t topic_len,
+                                    const char *value, uint16_t value_len));
   void handleEvents_raw(void (*cb)(const uint8_t *data, int len,
                                    uint32_t replyId, uint16_t elapsed));
 
   bool compareTopic(const char *topic, const char *deviceName, const char *t);
 
+  // Sends any number of commands in as few frames as possible: they are
+  // sorted by topic (in place, commands on the same topic keep their
+  // order) and each topic is written in its shortest relative form.
+  bool send_commands(mqtt_command *cmds, uint16_t n);
+
   bool _switch(Mqtt_cmd cmd, const char *name, MQTT_switch value = SWITCH_ON);
   bool _temp(Mqtt_cmd cmd, const char *name, float value = 0);
   bool _humidity(Mqtt_cmd cmd, const char *name, float value = 0);
@@ -164,6 +578,19 @@ class SimpleMQTT {
   bool _bin(Mqtt_cmd cmd, const std::list<const char *> &names,
             const uint8_t *data = 0, int len = 0);
 
+  // decimals sent by _temp/_humidity/_pressure/_float for a type or for
+  // one name of it, false when MQTT_MAX_PRECISIONS is reached
+  bool set_precision(const char *type, uint8_t decimals,
+                     const char *name = NULL);
+  // fixed point values without floats: value / 10^decimals, e.g.
+  // _fixed(PUBLISH, "temp", "t1", 2354, 2) sends 23.54
+  bool _fixed(Mqtt_cmd cmd, const char *type, const char *name, int32_t value,
+              uint8_t decimals);
+  bool _ifFixed(MQTT_IF ifType, const char *type, const char *name,
+                uint8_t decimals, void (*cb)(int32_t /*value*/));
+  bool _onFixed(MQTT_IF ifType, const char *type, const char *name,
+                uint8_t decimals, void (*cb)(int32_t /*value*/));
+
   bool _ifSwitch(MQTT_IF ifType, const char *name,
                  void (*cb)(MQTT_switch /*value*/));
   bool _ifTemp(MQTT_IF ifType, const char *name, void (*cb)(float /*value*/));
@@ -187,31 +614,329 @@ class SimpleMQTT {
   bool _ifBin(MQTT_IF ifType, const char *name,
               void (*cb)(const uint8_t * /*bin*/, int /*length*/));
 
+  // Register handlers once instead of calling _ifXxx from the publish
+  // callback: received commands for "<myDeviceName>/type/name/set|value"
+  // are dispatched with a single hash lookup (also in view mode).
+  // Return false when MQTT_MAX_HANDLERS is reached.
+  bool _onSwitch(MQTT_IF ifType, const char *name,
+                 void (*cb)(MQTT_switch /*value*/));
+  bool _onTemp(MQTT_IF ifType, const char *name, void (*cb)(float /*value*/));
+  bool _onHumidity(MQTT_IF ifType, const char *name,
+                   void (*cb)(float /*value*/));
+  bool _onTrigger(MQTT_IF ifType, const char *name,
+                  void (*cb)(MQTT_trigger /*value*/));
+  bool _onContact(MQTT_IF ifType, const char *name,
+                  void (*cb)(MQTT_contact /*value*/));
+  bool _onDimmer(MQTT_IF ifType, const char *name,
+                 void (*cb)(uint8_t /*value*/));
+  bool _onString(MQTT_IF ifType, const char *name,
+                 void (*cb)(const char * /*value*/));
+  bool _onNumber(MQTT_IF ifType, const char *name,
+                 void (*cb)(int /*min*/, int /*max*/, int /*step*/));
+  bool _onFloat(MQTT_IF ifType, const char *name, void (*cb)(float /*value*/));
+  bool _onInt(MQTT_IF ifType, const char *name, void (*cb)(int /*value*/));
+  bool _onShutter(MQTT_IF ifType, const char *name,
+                  void (*cb)(MQTT_shutter /*value*/));
+  bool _onCounter(MQTT_IF ifType, const char *name, void (*cb)(int /*value*/));
+  bool _onBin(MQTT_IF ifType, const char *name,
+              void (*cb)(const uint8_t * /*bin*/, int /*length*/));
+
   bool send(const char *mqttMsg, int len, uint32_t replyId);
-  bool send_async(const char *mqttMsg, int len, uint32_t replyId);
+  bool send_async(const char *mqttMsg, int len, uint32_t replyId,
+                  uint8_t qos = MQTT_QOS_AUTO);
 
  private:
+  // Message cache. The receive callback (ACKs) and the loop (sends,
+  // resend_loop) both change it, on ESP32 possibly from different cores:
+  // reply ids, the index and the slot stack are only touched with mc_mux
+  // held. The schedule and the block pools belong to the loop.
+  mc_item mc_db[MAX_MC_ITEMS];
+  uint16_t mc_used_slots;
+  // free mc_db slots: a LIFO stack of released indexes, slots never used
+  // yet are taken from mc_slot_bump upwards
+  uint16_t mc_free_slots[MAX_MC_ITEMS];
+  uint16_t mc_free_top;
+  uint16_t mc_slot_bump;
+  uint8_t mc_small_blocks[MC_SMALL_BLOCKS][MC_SMALL_BLOCK_SIZE];
+  uint8_t mc_medium_blocks[MC_MEDIUM_BLOCKS][MC_MEDIUM_BLOCK_SIZE];
+  uint8_t mc_large_blocks[MC_LARGE_BLOCKS][MC_LARGE_BLOCK_SIZE];
+  mc_slab mc_small_slab;
+  mc_slab mc_medium_slab;
+  mc_slab mc_large_slab;
+  // retransmission schedule, a min-heap of mc_db indexes by expire_ts
+  uint16_t mc_sched[MAX_MC_ITEMS];
+  uint16_t mc_sched_pos[MAX_MC_ITEMS];  // heap position + 1, 0 if none
+  uint16_t mc_sched_len;
+  // ACKed entries handed over from the receive callback to resend_loop
+  // (single producer, single consumer, positions stored with release)
+  uint16_t mc_acked[MAX_MC_ITEMS + 1];
+  uint16_t mc_acked_head;  // written by the receive callback only
+  uint16_t mc_acked_tail;  // written by resend_loop only
+  mc_index_item mc_index[MC_INDEX_SIZE];
+  // send queue: cached frames waiting for the window, oldest first
+  uint16_t mc_waiting[MAX_MC_ITEMS];
+  uint16_t mc_waiting_head;
+  uint16_t mc_waiting_len;
+#ifdef ESP32
+  portMUX_TYPE mc_mux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+  telemetry_t_st telemetry_t;
+  // written by both tasks with mc_mux held
+  mqtt_stats_st stats;
+  uint8_t *mc_block_alloc(int size);
+  void mc_block_free(uint8_t *p);
+  mc_slab *mc_block_slab(const uint8_t *p);
+  uint16_t mc_block_size(const uint8_t *p);
+  void mc_index_put(uint32_t reply_id, uint16_t idx);
+  int16_t mc_index_get(uint32_t reply_id);
+  void mc_index_del(uint32_t reply_id, uint16_t idx);
+  void mc_sched_swap(uint16_t a, uint16_t b);
+  void mc_sched_up(uint16_t pos);
+  void mc_sched_down(uint16_t pos);
+  void mc_sched_set(uint16_t i);
+  void mc_sched_remove(uint16_t i);
+  int16_t mc_store(uint8_t *binary, int size, int ttl, uint16_t timeout,
+                   uint8_t try_cnt);
+  void mc_waiting_remove(uint16_t i);
+  char lost_buf[32];
+
+  // congestion control, only used by the loop (ACKs are counted when
+  // resend_loop frees the frames)
+  bool cc_enabled = false;
+  uint16_t cwnd;
+  uint16_t cwnd_acks;
+  uint32_t cwnd_cut_ts;
+  mqtt_cc_stats_st cc_stats;
+  void cc_on_ack(void);
+  void cc_on_resend(void);
+  bool cc_window_open(void);
+  void cc_send_waiting(void);
+
+  // node table entry, in a list most recently seen first; referred to
+  // from outside (mc_item.dest, get_nodes() cursors) as its index + 1 and
+  // reuse count, so a replaced entry isn't taken for its successor
+  struct node_item {
+    uint32_t key;  // alias_src_hash() of the name
+    uint16_t prev;  // MQTT_NODE_ENTRIES: none
+    uint16_t next;
+    uint16_t reuse;
+    uint32_t last_frame_ms;
+    uint32_t interval_x8;
+    uint32_t srtt_x8;
+    uint32_t rttvar_x4;
+    mqtt_node_st n;  // srtt, rttvar and interval filled in by node_copy()
+  };
+
+  // tables only the modes other than MODE_NODE_STD use, see set_op_mode()
+  struct gw_tables {
+    mqtt_dedup_item dedup[MQTT_DEDUP_SIZE];
+    uint16_t dedup_index[MQTT_DEDUP_INDEX_SIZE];
+    mqtt_alias_rx_node alias_rx[MQTT_ALIAS_NODES];
+    uint32_t alias_clock;  // counts alias uses, orders them within a ms
+    node_item nodes[MQTT_NODE_ENTRIES];
+    uint16_t node_index[MQTT_NODE_INDEX_SIZE];  // nodes index + 1
+    uint16_t node_cnt;
+    uint16_t node_head;
+    uint16_t node_tail;
+  };
+  gw_tables *gw = NULL;
+
+  // buffers of the opt-in send features (wire format, compression,
+  // coalescing, aliases), allocated when the first one is enabled
+  struct tx_tables {
+    uint8_t wire_buf[250];
+    uint8_t lz_buf[250];
+    char coalesce_buf[250];
+    char coalesce_prev[100];  // last full topic of the coalesced frame
+    char alias_buf[250];
+    mqtt_alias_tx_item alias_tx[MQTT_TOPIC_ALIASES];
+  };
+  tx_tables *tx = NULL;
+  bool tx_alloc(void);
+
+  // duplicate filter, only used by the receive callback: (source node,
+  // message id) pairs seen within the last mqtt_dedup_ttl_ms, kept in
+  // insertion order in a ring and indexed by an open-addressing table;
+  // the ring below or the one of gw
+  mqtt_dedup_item mqtt_dedup_node[MQTT_DEDUP_NODE_SIZE];
+  uint16_t mqtt_dedup_node_index[MQTT_DEDUP_NODE_INDEX_SIZE];
+  mqtt_dedup_item *mqtt_dedup;
+  uint16_t *mqtt_dedup_index;  // ring position + 1
+  uint16_t mqtt_dedup_size;
+  uint16_t mqtt_dedup_mask;  // index size - 1
+  uint16_t mqtt_dedup_oldest;
+  uint16_t mqtt_dedup_count;
+  uint32_t mqtt_dedup_ttl_ms;
+  void mqtt_dedup_use(mqtt_dedup_item *ring, uint16_t *index, uint16_t size,
+                      uint32_t index_size);
+  uint32_t mqtt_dedup_lookup(uint64_t key);
+  void mqtt_dedup_pop_oldest(void);
+  bool mqtt_dedup_check(const char *src_node_name, const char *msgid);
+  bool mqtt_dedup_check_key(uint64_t key, bool add);
+  // QoS 2 message ids held until released ("REL src/msgid"), key 0 = free
+  mqtt_dedup_item mqtt_qos2[MQTT_QOS2_ENTRIES];
+  int16_t qos2_hold;  // entry taken by the frame being parsed, or -1
+  bool mqtt_dedup_frame(const char *src_node_name, const char *msgid,
+                        uint8_t qos, bool *new_msg);
+  void mqtt_qos2_release(const unsigned char *data, int size);
+  void dedup_hit(void);
+  void parse_timed(const unsigned char *data, int size, uint32_t replyId);
+  void mc_release(uint16_t i);
+
+  // Aliases of this node (loop) in tx->alias_tx, slot i is sent as
+  // "@((mqtt_alias_tx_base + i) & 0xFF)"; the base moves on after a reset
+  // so late copies of old bindings can't be mistaken for new ones. Aliases
+  // bound by other nodes are kept in gw->alias_rx (receive callback).
+  uint8_t mqtt_alias_tx_cnt;
+  uint8_t mqtt_alias_tx_base;
+  mqtt_alias_rx_node *alias_rx_node(uint32_t src);
+  mqtt_alias_rx_item *alias_rx_find(uint32_t src, uint8_t alias);
+  void alias_rx_bind(uint32_t src, uint8_t alias, const char *topic,
+                     uint16_t len);
+  int alias_tx_find(const char *topic, uint16_t len);
+
+  // deferred receive: single producer (mesh callback), single consumer
+  // (process_incoming), free running positions
+  struct rx_item {
+    uint32_t reply_id;
+    uint16_t size;
+    uint8_t data[MQTT_RX_FRAME_SIZE];
+  };
+  bool rx_deferred = false;
+  rx_item *rx_queue = NULL;  // MQTT_RX_QUEUE_LEN, allocated when enabled
+  uint16_t rx_head;  // written by the producer only
+  uint16_t rx_tail;  // written by the consumer only
+  mqtt_rx_stats_st rx_stats;
+
+  // one ACK per received frame: queued by parse(), sent by resend_loop()
+  bool ack_frame;  // a command of the frame being parsed asked for it
+  uint32_t ack_queue[MQTT_ACK_QUEUE_LEN];
+  uint16_t ack_head;  // written by parse() only
+  uint16_t ack_tail;  // written by resend_loop() only
+  void ack_put(uint32_t replyId);
+  void ack_flush(void);
+
+  // node table (gw->nodes), updated by both tasks with mc_mux held
+  uint32_t node_lookup(uint32_t key, const char *name);
+  void node_index_del(uint16_t i);
+  int32_t node_entry(uint32_t ref);
+  void node_unlink(uint16_t i);
+  void node_push_front(uint16_t i);
+  void node_copy(uint16_t i, mqtt_node_st *out);
+  void node_rx(const char *name, bool new_msg);
+  void node_tx(uint32_t dest, uint8_t event, uint32_t rtt);
+  uint32_t frame_dest(const char *mqttMsg, int len);
+
+  uint8_t trace_inst;  // instance number in trace events
+
   String myDeviceName;
+  char uuid[5];
   char buffer[250];
   uint32_t replyId;
   OP_MODE op_mode = MODE_NODE_STD;
+  WIRE_FORMAT wire_format = WIRE_TEXT;
+  bool compression = false;
+  const uint8_t *wire_encode(const char *mqttMsg, int *len);
+  // frame being filled by coalesced calls, last full topic in it
+  uint16_t coalesce_ms = 0;
+  uint32_t coalesce_ts;
+  uint16_t coalesce_len = 0;
+  uint16_t coalesce_prev_len = 0;
+  uint8_t coalesce_qos;
+  bool coalesce(const char *mqttMsg, int len, uint8_t qos);
+  bool send_frame(const char *mqttMsg, int len, uint8_t qos);
+  uint8_t default_qos = 1;
+  mqtt_qos_rule qos_rules[MQTT_MAX_QOS_RULES];
+  uint8_t qos_rules_cnt = 0;
+  uint8_t topic_qos(const char *topic, uint16_t len);
+  uint8_t frame_qos(const char *mqttMsg, int len);
+  bool topic_aliases = false;
+  volatile bool alias_rst_pending = false;
+  const char *alias_apply(const char *mqttMsg, int *len);
+  const char *alias_resolve(const char *src_node_name, const char *topic,
+                            uint16_t *len);
+  bool aliases_known(const unsigned char *data, int size,
+                     const char *src_node_name, bool *mine);
+  bool alias_topic(const char *topic, uint16_t len);
+  bool my_topic(const char *topic, uint16_t len);
+  void alias_reset(void);
+  bool alias_expand(uint16_t i);
   bool _raw(Mqtt_cmd cmd, const char *type,
             const std::list<const char *> &names, const char *value);
+  // frame being built in buffer by frame_add(), its last full topic
+  uint16_t frame_len = 0;
+  char frame_prev[100];
+  uint16_t frame_prev_len = 0;
+  bool frame_qos2 = false;  // it has a QoS 2 command
+  bool frame_add(char cmd, const char *topic, uint16_t topic_len,
+                 const char *value);
+  bool frame_flush(void);
   bool _rawIf(MQTT_IF ifType, const char *type, const char *name);
+  bool _rawIf(MQTT_IF ifType, const char *type, const char *name,
+              mqtt_invoke_t invoke, mqtt_cb_t cb, uint8_t arg = 0);
+  bool _on(MQTT_IF ifType, const char *type, const char *name,
+           mqtt_invoke_t invoke, mqtt_cb_t cb, uint8_t arg = 0);
+  bool dispatch(const char *topic, uint16_t topic_len, const char *value,
+                uint16_t value_len);
+
+  struct handler_item {
+    uint32_t hash;
+    const char *type;
+    const char *name;
+    uint8_t suffix;  // SET or VALUE
+    uint8_t arg;
+    mqtt_invoke_t invoke;
+    mqtt_cb_t cb;
+  };
+  handler_item handlers[MQTT_MAX_HANDLERS];
+  uint8_t handler_index[MQTT_HANDLER_INDEX_SIZE];  // handlers index + 1
+  uint8_t handlers_cnt;
+  struct precision_item {
+    uint32_t hash;  // of "type" or "type/name"
+    uint8_t decimals;
+  };
+  precision_item precisions[MQTT_MAX_PRECISIONS];
+  uint8_t precisions_cnt;
+  uint8_t precision(const char *type, const std::list<const char *> &names);
+  char _value_buf[MQTT_VALUE_BUF_SIZE];
   void (*publishCallBack)(const char *src_node_name, const char *msgid,
                           char command, const char *topic, const char *value);
+  void (*viewCallBack)(const char *src_node_name, const char *msgid,
+                       char command, const char *topic, uint16_t topic_len,
+                       const char *value, uint16_t value_len);
   void (*rawCallBack)(const uint8_t *data, int len, uint32_t replyId, uint16_t elapsed);
 
   void parse2(const char *c, unsigned int l, char *src_node_name, char *msgid,
               bool new_msg);
+  bool parse_bin(const unsigned char *data, int size);
+  void parse_cmd(char command, const char *topic, uint16_t topic_len,
+                 const char *value, uint16_t value_len, char *src_node_name,
+                 char *msgid, bool new_msg);
   bool compare(MQTT_IF ifType, const char *type, const char *name);
 
   const char *decompressTopic(const char *topic);
+  const char *decompressTopic(const char *topic, uint16_t len,
+                              uint16_t *out_len);
+  // previous topic of the frame being parsed in view mode
+  const char *_prev_topic;
+  uint16_t _prev_topic_len;
+  char _topic_buf[100];
+  // decompressTopic(): last full topic, result
+  char _decompress_prev[100];
+  char _decompress_buf[100];
 
   int ttl;
   uint16_t tryCount;
   int timeoutMs;
   uint16_t backoffMs;
+  // RTO estimator, fixed point like the telemetry averages; 0 = no sample
+  bool rto_adaptive = false;
+  int32_t rto_srtt_x8;
+  int32_t rto_rttvar_x4;
+  uint16_t rto;
+  void rto_reset(void);
+  void rto_sample(uint32_t rtt);
+  uint16_t rto_backoff(uint16_t timeout);
 
   const char *_topic;
   const char *_value;
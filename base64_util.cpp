@@ -169,3 +169,158 @@ int Base64encode(char *encoded, const char *string, int len) {
 
   return p - encoded;
 }
+
+/* ====================================================================
+ * Bounds checked, streaming codec. Whole groups of 4 characters are
+ * read/written as one 32 bit word and checked once (an invalid character
+ * maps to 64, so OR-ing the four values shows it); only the start and the
+ * tail of the input take the character at a time path.
+ */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LANE(x, i) ((x) >> (24 - 8 * (i)) & 0xFF)
+#define TO_LANE(v, i) ((uint32_t)(v) << (24 - 8 * (i)))
+#else
+#define LANE(x, i) ((x) >> (8 * (i)) & 0xFF)
+#define TO_LANE(v, i) ((uint32_t)(v) << (8 * (i)))
+#endif
+
+// 24 bits -> 4 characters
+static inline void encode_word(char *out, uint32_t w) {
+  uint32_t c = TO_LANE(basis_64[w >> 18], 0) |
+               TO_LANE(basis_64[w >> 12 & 0x3F], 1) |
+               TO_LANE(basis_64[w >> 6 & 0x3F], 2) |
+               TO_LANE(basis_64[w & 0x3F], 3);
+  memcpy(out, &c, 4);
+}
+
+// 4 characters -> 24 bits, false if one of them isn't a base64 character
+static inline bool decode_word(const char *in, uint32_t *w) {
+  uint32_t c;
+  memcpy(&c, in, 4);
+  uint32_t a = pr2six[LANE(c, 0)], b = pr2six[LANE(c, 1)];
+  uint32_t d = pr2six[LANE(c, 2)], e = pr2six[LANE(c, 3)];
+  if ((a | b | d | e) & 0x40) return false;
+  *w = a << 18 | b << 12 | d << 6 | e;
+  return true;
+}
+
+void base64_init(base64_state *s) {
+  s->bits = 0;
+  s->n = 0;
+  s->pad = 0;
+}
+
+int base64_encode_update(base64_state *s, char *out, int out_size,
+                         const uint8_t *in, int len) {
+  if (len < 0 || (s->n + len) / 3 * 4 > out_size) return -1;
+  char *p = out;
+  // complete the bytes left over by the last call
+  while (s->n > 0 && len > 0) {
+    s->bits = s->bits << 8 | *in++;
+    len--;
+    if (++s->n == 3) {
+      encode_word(p, s->bits);
+      p += 4;
+      s->bits = 0;
+      s->n = 0;
+    }
+  }
+  for (; len >= 3; in += 3, len -= 3, p += 4)
+    encode_word(p, (uint32_t)in[0] << 16 | in[1] << 8 | in[2]);
+  for (; len > 0; len--, s->n++) s->bits = s->bits << 8 | *in++;
+  return p - out;
+}
+
+int base64_encode_final(base64_state *s, char *out, int out_size) {
+  if (s->n == 0) return 0;
+  if (out_size < 4) return -1;
+  uint32_t w = s->n == 1 ? s->bits << 16 : s->bits << 8;
+  encode_word(out, w);
+  out[3] = '=';
+  if (s->n == 1) out[2] = '=';
+  base64_init(s);
+  return 4;
+}
+
+// bytes of the 2 or 3 characters before the padding
+static int decode_tail(base64_state *s, uint8_t *out, int out_size) {
+  if (s->n < 2 || out_size < s->n - 1) return -1;
+  if (s->n == 2) {
+    out[0] = (uint8_t)(s->bits >> 4);
+  } else {
+    out[0] = (uint8_t)(s->bits >> 10);
+    out[1] = (uint8_t)(s->bits >> 2);
+  }
+  return s->n - 1;
+}
+
+int base64_decode_update(base64_state *s, uint8_t *out, int out_size,
+                         const char *in, int len) {
+  uint8_t *p = out;
+  uint8_t *end = out + out_size;
+  const char *in_end = in + len;
+  while (in < in_end) {
+    // whole words; in place is safe as 4 characters are read before 3
+    // bytes are written
+    uint32_t w;
+    while (s->n == 0 && in_end - in >= 4 && end - p >= 3 &&
+           decode_word(in, &w)) {
+      p[0] = (uint8_t)(w >> 16);
+      p[1] = (uint8_t)(w >> 8);
+      p[2] = (uint8_t)w;
+      p += 3;
+      in += 4;
+    }
+    if (in == in_end) break;
+    unsigned char c = *in++;
+    if (c == '=') {
+      if (s->pad == 0) {
+        int n = decode_tail(s, p, end - p);
+        if (n < 0) return -1;
+        p += n;
+      } else if (s->n + s->pad == 4) {
+        return -1;
+      }
+      s->pad++;
+      continue;
+    }
+    if (s->pad || pr2six[c] > 63) return -1;
+    s->bits = s->bits << 6 | pr2six[c];
+    if (++s->n == 4) {
+      if (end - p < 3) return -1;
+      p[0] = (uint8_t)(s->bits >> 16);
+      p[1] = (uint8_t)(s->bits >> 8);
+      p[2] = (uint8_t)s->bits;
+      p += 3;
+      s->bits = 0;
+      s->n = 0;
+    }
+  }
+  return p - out;
+}
+
+int base64_decode_final(base64_state *s, uint8_t *out, int out_size) {
+  int n = s->pad || s->n == 0 ? 0 : decode_tail(s, out, out_size);
+  base64_init(s);
+  return n;
+}
+
+int base64_encode(char *out, int out_size, const uint8_t *in, int len) {
+  base64_state s;
+  base64_init(&s);
+  if (len < 0 || BASE64_ENCODED_LEN(len) + 1 > out_size) return -1;
+  int n = base64_encode_update(&s, out, out_size, in, len);
+  n += base64_encode_final(&s, out + n, out_size - n);
+  out[n] = 0;
+  return n;
+}
+
+int base64_decode(uint8_t *out, int out_size, const char *in, int len) {
+  base64_state s;
+  base64_init(&s);
+  int n = base64_decode_update(&s, out, out_size, in, len);
+  if (n < 0) return -1;
+  int t = base64_decode_final(&s, out + n, out_size - n);
+  return t < 0 ? -1 : n + t;
+}
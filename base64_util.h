@@ -1,9 +1,39 @@
 #ifndef __BASE__H_
 #define __BASE__H_
 
+#include <stdint.h>
+
 int Base64decode_len(const char *bufcoded);
 int Base64decode(char *bufplain, const char *bufcoded);
 int Base64encode_len(int len);
 int Base64encode(char *encoded, const char *string, int len);
 
+// Bounds checked codec, 4 characters per 32 bit word. Every call takes the
+// output capacity and returns the bytes written or -1 (output too small,
+// invalid input); the output is undefined after -1.
+//
+// Streaming: base64_init(), then any number of _update() calls with input
+// split anywhere, then _final(). Decoding may be done in place (out == in).
+
+#define BASE64_ENCODED_LEN(n) (((n) + 2) / 3 * 4)
+
+struct base64_state {
+  uint32_t bits;  // input not converted yet
+  uint8_t n;      // bytes (encode) or characters (decode) in `bits`
+  uint8_t pad;    // decode: '=' seen
+};
+
+void base64_init(base64_state *s);
+int base64_encode_update(base64_state *s, char *out, int out_size,
+                         const uint8_t *in, int len);
+int base64_encode_final(base64_state *s, char *out, int out_size);
+// padding is optional, anything after it but '=' is invalid
+int base64_decode_update(base64_state *s, uint8_t *out, int out_size,
+                         const char *in, int len);
+int base64_decode_final(base64_state *s, uint8_t *out, int out_size);
+
+// one shot versions, base64_encode() also writes a '\0' (not counted)
+int base64_encode(char *out, int out_size, const uint8_t *in, int len);
+int base64_decode(uint8_t *out, int out_size, const char *in, int len);
+
 #endif
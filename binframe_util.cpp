@@ -0,0 +1,358 @@
+#include "binframe_util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// topic levels and values common enough to be sent as one byte, append
+// only: the index is on the wire
+static const char *const topic_tokens[] = {
+    "m",      "value",   "set",     "switch", "temp",  "humidity",
+    "pressure", "trigger", "contact", "dimmer", "string", "number",
+    "float",  "int",     "shutter", "counter", "bin"};
+#define TOPIC_TOKENS (sizeof(topic_tokens) / sizeof(topic_tokens[0]))
+
+static const char *const value_tokens[] = {
+    "on", "off", "open", "closed", "close", "stop", "triggered"};
+#define VALUE_TOKENS (sizeof(value_tokens) / sizeof(value_tokens[0]))
+
+enum { V_NONE, V_STRING, V_INT, V_DECIMAL, V_TOKEN };
+
+static const char commands[] = {'P', 'S', 'G', 'U'};
+
+#define MAX_DOTS 7
+#define MAX_SEGMENTS 31
+// digits of a number carried as a varint (fits int64 with room to scale)
+#define MAX_DIGITS 18
+
+static int find_token(const char *const *tokens, int n, const char *s,
+                      int len) {
+  for (int i = 0; i < n; i++)
+    if (strncmp(tokens[i], s, len) == 0 && tokens[i][len] == 0) return i;
+  return -1;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = (uint8_t)v | 0x80;
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+static bool get_varint(binframe_reader *r, uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (r->p >= r->end) return false;
+    uint8_t b = *r->p++;
+    *v |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+static inline uint64_t zigzag(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// Parses a number written the canonical way (no '+', no leading zeros,
+// no "-0"), so printing it back gives the same text. scale = digits after
+// the point, -1 if there is no point.
+static bool parse_number(const char *s, int len, int64_t *mantissa,
+                         int *scale) {
+  int i = 0;
+  bool neg = false;
+  if (i < len && s[i] == '-') {
+    neg = true;
+    i++;
+  }
+  int int_start = i;
+  uint64_t m = 0;
+  int digits = 0;
+  for (; i < len && s[i] >= '0' && s[i] <= '9'; i++, digits++)
+    m = m * 10 + (s[i] - '0');
+  int int_digits = i - int_start;
+  if (int_digits == 0 || (int_digits > 1 && s[int_start] == '0'))
+    return false;
+  *scale = -1;
+  if (i < len && s[i] == '.') {
+    int frac_start = ++i;
+    for (; i < len && s[i] >= '0' && s[i] <= '9'; i++, digits++)
+      m = m * 10 + (s[i] - '0');
+    *scale = i - frac_start;
+    if (*scale == 0) return false;
+  }
+  if (i != len || digits > MAX_DIGITS || (neg && m == 0)) return false;
+  *mantissa = neg ? -(int64_t)m : (int64_t)m;
+  return true;
+}
+
+static int print_number(char *out, int64_t mantissa, int scale) {
+  char digits[MAX_DIGITS + 2];
+  uint64_t m = mantissa < 0 ? -(uint64_t)mantissa : (uint64_t)mantissa;
+  int n = 0;
+  do {
+    digits[n++] = '0' + m % 10;
+    m /= 10;
+  } while (m > 0 && n < MAX_DIGITS + 1);
+  while (n <= scale && n < MAX_DIGITS + 1) digits[n++] = '0';
+
+  char *p = out;
+  if (mantissa < 0) *p++ = '-';
+  while (n > 0) {
+    if (n == scale) *p++ = '.';
+    *p++ = digits[--n];
+  }
+  return p - out;
+}
+
+bool binframe_is(const uint8_t *data, int size) {
+  return size > 0 && (data[0] & 0xF0) == BINFRAME_MAGIC;
+}
+
+int binframe_encode(uint8_t *out, int out_size, const char *text,
+                    int text_len) {
+  while (text_len > 0 && text[text_len - 1] == 0) text_len--;
+  const char *end = text + text_len;
+  uint8_t *p = out;
+
+  // header "MQTT src/msgid\n", "MQTT src/msgid 2\n" for QoS 2
+  if (text_len < 11 || strncmp(text, "MQTT ", 5) != 0) return -1;
+  const char *src = text + 5;
+  const char *slash = (const char *)memchr(src, '/', end - src);
+  if (slash == NULL || slash - src > 0x7F || end - slash < 6 ||
+      7 + (slash - src) > out_size)
+    return -1;
+  uint8_t flags = 0;
+  const char *c = slash + 6;
+  if (slash[5] == ' ' && end - slash >= 8 && slash[6] == '2' &&
+      slash[7] == '\n') {
+    flags = 2;
+    c = slash + 8;
+  } else if (slash[5] != '\n') {
+    return -1;
+  }
+  *p++ = BINFRAME_MAGIC | BINFRAME_VERSION;
+  *p++ = (uint8_t)(slash - src);
+  memcpy(p, src, slash - src);
+  p += slash - src;
+  memcpy(p, slash + 1, 4);
+  p += 4;
+  *p++ = flags;
+
+  while (c < end) {
+    const char *eol = (const char *)memchr(c, '\n', end - c);
+    if (eol == NULL) eol = end;
+    if (eol - c < 3 || c[1] != ':') return -1;
+    // a command takes at most 2 bytes more than its text line
+    if (p + (eol - c) + 2 > out + out_size) return -1;
+
+    int cmd = -1;
+    for (int k = 0; k < 4; k++)
+      if (commands[k] == c[0]) cmd = k;
+    if (cmd < 0) return -1;
+    const char *topic = c + 2;
+    const char *sp = (const char *)memchr(topic, ' ', eol - topic);
+    const char *topic_end = sp != NULL ? sp : eol;
+    uint8_t *cmd_byte = p++;
+
+    // topic: leading dots of a relative topic, then its levels
+    int dots = 0;
+    const char *t = topic;
+    for (; t < topic_end && *t == '.'; t++) dots++;
+    if (dots > MAX_DOTS) return -1;
+    if (dots > 0) {
+      if (t == topic_end || *t != '/') return -1;
+      t++;
+    }
+    uint8_t *topic_hdr = p++;
+    int segments = 0;
+    while (true) {
+      const char *s = t;
+      for (; t < topic_end && *t != '/'; t++)
+        ;
+      int len = t - s;
+      int tok = find_token(topic_tokens, TOPIC_TOKENS, s, len);
+      if (++segments > MAX_SEGMENTS || len > 0x7F) return -1;
+      if (tok >= 0) {
+        *p++ = 0x80 | tok;
+      } else {
+        *p++ = (uint8_t)len;
+        memcpy(p, s, len);
+        p += len;
+      }
+      if (t == topic_end) break;
+      t++;
+    }
+    *topic_hdr = (uint8_t)(dots << 5 | segments);
+
+    // value
+    int type = V_NONE;
+    if (sp != NULL) {
+      const char *v = sp + 1;
+      int len = eol - v;
+      int64_t mantissa;
+      int scale;
+      int tok = find_token(value_tokens, VALUE_TOKENS, v, len);
+      if (tok >= 0) {
+        type = V_TOKEN;
+        *p++ = (uint8_t)tok;
+      } else if (parse_number(v, len, &mantissa, &scale)) {
+        type = scale < 0 ? V_INT : V_DECIMAL;
+        p = put_varint(p, zigzag(mantissa));
+        if (scale >= 0) *p++ = (uint8_t)scale;
+      } else {
+        if (len > 0xFF) return -1;
+        type = V_STRING;
+        *p++ = (uint8_t)len;
+        memcpy(p, v, len);
+        p += len;
+      }
+    }
+    *cmd_byte = (uint8_t)(cmd | type << 2);
+    c = eol + 1;
+  }
+
+  return p - out;
+}
+
+bool binframe_header(binframe_reader *r, const uint8_t *data, int size,
+                     char *src, int src_size, char *msgid, uint8_t *flags) {
+  if (size < 7 || data[0] != (BINFRAME_MAGIC | BINFRAME_VERSION))
+    return false;
+  int len = data[1];
+  if (2 + len + 5 > size || len >= src_size) return false;
+  memcpy(src, data + 2, len);
+  src[len] = 0;
+  memcpy(msgid, data + 2 + len, 4);
+  *flags = data[2 + len + 4];
+  r->p = data + 2 + len + 5;
+  r->end = data + size;
+  return true;
+}
+
+int binframe_next(binframe_reader *r, char *command, char *topic,
+                  int topic_size, uint16_t *topic_len, const char **value,
+                  uint16_t *value_len, char *num_buf) {
+  if (r->p >= r->end) return 0;
+  uint8_t cmd = *r->p++;
+  *command = commands[cmd & 0x03];
+
+  // topic
+  if (r->p >= r->end) return -1;
+  uint8_t hdr = *r->p++;
+  int dots = hdr >> 5;
+  int segments = hdr & 0x1F;
+  int n = 0;
+  if (dots + 1 > topic_size) return -1;
+  for (; n < dots; n++) topic[n] = '.';
+  for (int k = 0; k < segments; k++) {
+    if (r->p >= r->end) return -1;
+    uint8_t b = *r->p++;
+    const char *s;
+    int len;
+    if (b & 0x80) {
+      if ((b & 0x7F) >= TOPIC_TOKENS) return -1;
+      s = topic_tokens[b & 0x7F];
+      len = strlen(s);
+    } else {
+      s = (const char *)r->p;
+      len = b;
+      if (r->p + len > r->end) return -1;
+      r->p += len;
+    }
+    if (n + 1 + len > topic_size) return -1;
+    if (k > 0 || dots > 0) topic[n++] = '/';
+    memcpy(topic + n, s, len);
+    n += len;
+  }
+  *topic_len = n;
+
+  // value
+  uint64_t v;
+  switch (cmd >> 2 & 0x07) {
+    case V_NONE:
+      *value = NULL;
+      *value_len = 0;
+      break;
+    case V_STRING:
+      if (r->p >= r->end || r->p + 1 + *r->p > r->end) return -1;
+      *value_len = *r->p++;
+      *value = (const char *)r->p;
+      r->p += *value_len;
+      break;
+    case V_INT:
+      if (!get_varint(r, &v)) return -1;
+      *value_len = print_number(num_buf, unzigzag(v), -1);
+      *value = num_buf;
+      break;
+    case V_DECIMAL:
+      if (!get_varint(r, &v) || r->p >= r->end || *r->p > MAX_DIGITS)
+        return -1;
+      *value_len = print_number(num_buf, unzigzag(v), *r->p++);
+      *value = num_buf;
+      break;
+    case V_TOKEN:
+      if (r->p >= r->end || *r->p >= VALUE_TOKENS) return -1;
+      *value = value_tokens[*r->p++];
+      *value_len = strlen(*value);
+      break;
+    default:
+      return -1;
+  }
+  return 1;
+}
+
+int binframe_to_text(char *out, int out_size, const uint8_t *data,
+                     int size) {
+  int n = binframe_header_text(out, out_size, data, size);
+  if (n < 0 || n + 1 >= out_size) return -1;
+  out[n++] = '\n';
+
+  binframe_reader r;
+  char src[0x80], msgid[4], num[BINFRAME_NUM_BUF_SIZE];
+  uint8_t flags;
+  binframe_header(&r, data, size, src, sizeof(src), msgid, &flags);
+  while (true) {
+    char command;
+    uint16_t topic_len, value_len;
+    const char *value;
+    if (n + 2 > out_size) return -1;
+    int ret = binframe_next(&r, &command, out + n + 2, out_size - n - 2,
+                            &topic_len, &value, &value_len, num);
+    if (ret < 0) return -1;
+    if (ret == 0) break;
+    out[n++] = command;
+    out[n++] = ':';
+    n += topic_len;
+    if (value != NULL) {
+      if (n + 1 + value_len > out_size) return -1;
+      out[n++] = ' ';
+      memcpy(out + n, value, value_len);
+      n += value_len;
+    }
+    if (n + 1 > out_size) return -1;
+    out[n++] = '\n';
+  }
+  if (n + 1 > out_size) return -1;
+  out[n++] = 0;
+  return n;
+}
+
+int binframe_header_text(char *out, int out_size, const uint8_t *data,
+                         int size) {
+  binframe_reader r;
+  char src[0x80];
+  char msgid[5] = "";
+  uint8_t flags;
+  if (!binframe_header(&r, data, size, src, sizeof(src), msgid, &flags))
+    return -1;
+  return snprintf(out, out_size,
+                  (flags & BINFRAME_FLAG_QOS_MASK) == 2 ? "MQTT %s/%s 2"
+                                                        : "MQTT %s/%s",
+                  src, msgid);
+}
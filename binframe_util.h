@@ -0,0 +1,61 @@
+#ifndef __BINFRAME_UTIL_H_
+#define __BINFRAME_UTIL_H_
+
+#include <stdint.h>
+
+// Compact binary encoding of the SimpleMQTT text frames, same commands and
+// topics (relative "../" forms included), typed values:
+//
+//   frame:   0xB0|version  src_len src[src_len]  msgid[4]  flags  command*
+//   flags:   bits 0-1: QoS level of "MQTT src/msgid 2" text headers
+//   command: cmd_byte topic [value]
+//   cmd_byte bits 0-1: P, S, G, U    bits 2-4: value type
+//   topic:   (dots << 5) | segment count, then per segment a dictionary
+//            token (0x80 | index) or a length (< 0x80) followed by the bytes
+//   value:   none | string: len + bytes | int: zigzag varint |
+//            decimal: zigzag varint mantissa + digits after the point |
+//            token: dictionary index
+//
+// Values are encoded so that decoding gives back exactly the text that was
+// sent ("23.540000" stays "23.540000").
+
+#define BINFRAME_MAGIC 0xB0
+#define BINFRAME_VERSION 1
+#define BINFRAME_FLAG_QOS_MASK 0x03
+
+// first byte of a binary frame, text frames start with "MQTT " or "ACK"
+bool binframe_is(const uint8_t *data, int size);
+
+// Encode a text frame ("MQTT src/msgid\n" + command lines), text_len may
+// include the trailing '\0'. Returns the binary size or -1 if the frame
+// can't be represented (the caller sends it as text then).
+int binframe_encode(uint8_t *out, int out_size, const char *text,
+                    int text_len);
+
+struct binframe_reader {
+  const uint8_t *p;
+  const uint8_t *end;
+};
+
+// Reads the header, src gets the '\0' terminated node name, msgid 4 chars.
+bool binframe_header(binframe_reader *r, const uint8_t *data, int size,
+                     char *src, int src_size, char *msgid, uint8_t *flags);
+
+// Reads the next command: topic is written to `topic` (not terminated),
+// *value points into the frame, a static token or num_buf (at least
+// BINFRAME_NUM_BUF_SIZE bytes), NULL if the command has no value.
+// Returns 1 for a command, 0 at the end of the frame, -1 if malformed.
+#define BINFRAME_NUM_BUF_SIZE 24
+int binframe_next(binframe_reader *r, char *command, char *topic,
+                  int topic_size, uint16_t *topic_len, const char **value,
+                  uint16_t *value_len, char *num_buf);
+
+// Text form of a binary frame ('\0' terminated), returns its size with
+// the '\0' or -1 if it doesn't fit / is malformed.
+int binframe_to_text(char *out, int out_size, const uint8_t *data, int size);
+
+// "MQTT src/msgid" of a binary frame, for messages reported as lost
+int binframe_header_text(char *out, int out_size, const uint8_t *data,
+                         int size);
+
+#endif
@@ -0,0 +1,638 @@
+// Host benchmarks for the SimpleMQTT hot paths.
+//
+//   simplemqtt_bench [--filter substr] [--min-ms N] [--save file]
+//                    [--compare file]
+//
+// Prints ns/op and heap allocations/op for every case. --save writes the
+// results as a baseline, --compare prints the change against one.
+
+#include <chrono>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include <EspNowFloodingMesh.h>
+
+// the benchmarks drive private helpers (_raw, decompressTopic) directly
+#define private public
+#include "SimpleMqtt.h"
+#undef private
+#include "base64_util.h"
+#include "binframe_util.h"
+#include "lzframe_util.h"
+#include "numfmt_util.h"
+#include "trace_util.h"
+
+// ----------------------------------------------------------------------------
+// heap accounting: interpose the glibc allocator
+
+extern "C" {
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void __libc_free(void *);
+
+static uint64_t heap_allocs = 0;
+
+void *malloc(size_t n) {
+  heap_allocs++;
+  return __libc_malloc(n);
+}
+void *calloc(size_t n, size_t s) {
+  heap_allocs++;
+  return __libc_calloc(n, s);
+}
+void *realloc(void *p, size_t n) {
+  heap_allocs++;
+  return __libc_realloc(p, n);
+}
+void free(void *p) { __libc_free(p); }
+}
+
+// ----------------------------------------------------------------------------
+// harness
+
+struct bench_result {
+  std::string name;
+  double ns_per_op;
+  double allocs_per_op;
+};
+
+static std::vector<bench_result> results;
+static const char *filter = NULL;
+static unsigned min_ms = 200;
+static volatile uint32_t sink;
+
+// Runs op() in batches of `batch` calls; reset() runs untimed before every
+// batch to put the library back into the state the case describes.
+template <typename Op, typename Reset>
+static void run(const std::string &name, uint32_t batch, Op op, Reset reset) {
+  if (filter != NULL && name.find(filter) == std::string::npos) return;
+  typedef std::chrono::steady_clock clock;
+  clock::duration total = clock::duration::zero();
+  uint64_t ops = 0, allocs = 0;
+
+  reset();
+  for (uint32_t i = 0; i < batch; i++) op(i);  // warm up
+
+  while (total < std::chrono::milliseconds(min_ms)) {
+    reset();
+    uint64_t a = heap_allocs;
+    clock::time_point t0 = clock::now();
+    for (uint32_t i = 0; i < batch; i++) op(i);
+    total += clock::now() - t0;
+    allocs += heap_allocs - a;
+    ops += batch;
+  }
+  bench_result r;
+  r.name = name;
+  r.ns_per_op =
+      std::chrono::duration<double, std::nano>(total).count() / (double)ops;
+  r.allocs_per_op = (double)allocs / (double)ops;
+  results.push_back(r);
+  printf("%-44s %12.1f ns/op %8.2f allocs/op\n", r.name.c_str(), r.ns_per_op,
+         r.allocs_per_op);
+  fflush(stdout);
+}
+
+static void no_reset(void) {}
+
+// ----------------------------------------------------------------------------
+// fixtures
+
+static SimpleMQTT *mqtt;
+
+static const int frame_size = 40;
+static uint8_t frame[frame_size] = "MQTT A1B2C3/abcd\nP:m/temp/t/value 1\n";
+static const uint32_t fill_id_base = 1000000;
+// frames the cache holds: slots, or blocks of the MAX_MC_MEM pools
+static const uint16_t cache_cap =
+    MAX_MC_ITEMS < MC_SMALL_BLOCKS + MC_MEDIUM_BLOCKS + MC_LARGE_BLOCKS
+        ? MAX_MC_ITEMS
+        : MC_SMALL_BLOCKS + MC_MEDIUM_BLOCKS + MC_LARGE_BLOCKS;
+
+static void cache_clear(void) {
+  for (uint16_t i = 0; i < MAX_MC_ITEMS; i++) mqtt->mc_del_msg_idx(i);
+}
+
+// fill the message cache to `percent` of cache_cap with entries that are
+// not due for a long time
+static uint16_t cache_fill(unsigned percent) {
+  cache_clear();
+  uint16_t n = (uint16_t)((uint32_t)cache_cap * percent / 100);
+  for (uint16_t i = 0; i < n; i++) {
+    if (mqtt->mc_add_msg(frame, frame_size, 1, fill_id_base + i, 60000, 10) <
+        0) {
+      fprintf(stderr, "cache_fill: cache full after %u entries\n", i);
+      return i;
+    }
+  }
+  return n;
+}
+
+static void pct_name(std::string &s, const char *base, unsigned pct) {
+  char b[64];
+  snprintf(b, sizeof(b), "%s @%u%%", base, pct);
+  s = b;
+}
+
+// distinct message ids so the duplicate filter never hides a frame
+static void set_msgid(char *id, uint32_t n) {
+  static const char alphanum[] =
+      "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+  for (int i = 0; i < 4; i++) {
+    id[i] = alphanum[n % 62];
+    n /= 62;
+  }
+}
+
+static void publish_cb(const char *src, const char *msgid, char cmd,
+                       const char *topic, const char *value) {
+  sink += cmd + topic[0] + value[0];
+}
+
+static void view_cb(const char *src, const char *msgid, char cmd,
+                    const char *topic, uint16_t topic_len, const char *value,
+                    uint16_t value_len) {
+  sink += cmd + topic_len + value_len;
+}
+
+// ----------------------------------------------------------------------------
+// cases
+
+static void bench_send(void) {
+  run("publish()", 50,
+      [](uint32_t) { mqtt->publish("m/temp/bme280", "/value", "23.54"); },
+      cache_clear);
+  run("publish() qos 0", 50,
+      [](uint32_t) { mqtt->publish("m/temp/bme280", "/value", "23.54", 0); },
+      cache_clear);
+  mqtt->set_wire_format(WIRE_BINARY);
+  run("publish() binary", 50,
+      [](uint32_t) { mqtt->publish("m/temp/bme280", "/value", "23.54"); },
+      cache_clear);
+  mqtt->set_wire_format(WIRE_TEXT);
+  mqtt->set_compression(true);
+  run("publish() compressed", 50,
+      [](uint32_t) { mqtt->publish("m/temp/bme280", "/value", "23.54"); },
+      cache_clear);
+  mqtt->set_compression(false);
+  mqtt->set_topic_aliases(true);
+  run("publish() topic alias", 50,
+      [](uint32_t) { mqtt->publish("m/temp/bme280", "/value", "23.54"); },
+      cache_clear);
+  mqtt->set_topic_aliases(false);
+  static const char *sensors[8] = {
+      "m/temp/bme280",  "m/humidity/bme280", "m/pressure/bme280",
+      "m/temp/dallas1", "m/temp/dallas2",    "m/switch/led",
+      "m/switch/led2",  "m/contact/door"};
+  run("publish() x8", 10,
+      [](uint32_t) {
+        for (int i = 0; i < 8; i++) mqtt->publish(sensors[i], "/value", "1.5");
+      },
+      cache_clear);
+  mqtt->set_coalescing(100);
+  run("publish() x8 coalesced + flush()", 10,
+      [](uint32_t) {
+        for (int i = 0; i < 8; i++) mqtt->publish(sensors[i], "/value", "1.5");
+        mqtt->flush();
+      },
+      cache_clear);
+  mqtt->set_compression(true);
+  run("publish() x8 coalesced + flush() compressed", 10,
+      [](uint32_t) {
+        for (int i = 0; i < 8; i++) mqtt->publish(sensors[i], "/value", "1.5");
+        mqtt->flush();
+      },
+      cache_clear);
+  mqtt->set_compression(false);
+  mqtt->set_coalescing(0);
+
+  static const char *names[10] = {"t0", "t1", "t2", "t3", "t4",
+                                  "t5", "t6", "t7", "t8", "t9"};
+  static const int counts[3] = {1, 3, 10};
+  for (int c = 0; c < 3; c++) {
+    std::list<const char *> l(names, names + counts[c]);
+    char n[64];
+    snprintf(n, sizeof(n), "_raw(PUBLISH) %d names", counts[c]);
+    run(n, 10, [&](uint32_t) { mqtt->_raw(PUBLISH, "temp", l, "23.54"); },
+        cache_clear);
+    snprintf(n, sizeof(n), "_raw(SUBSCRIBE) %d names", counts[c]);
+    run(n, 10, [&](uint32_t) { mqtt->_raw(SUBSCRIBE, "switch", l, NULL); },
+        cache_clear);
+  }
+}
+
+static void bench_parse(void) {
+  static char single[] =
+      "MQTT 5CCF7F/XXXX\n"
+      "P:m/temp/bme280/value 23.54\n";
+  static char multi[] =
+      "MQTT 5CCF7F/XXXX\n"
+      "G:device1/switch/led/value\n"
+      "S:.../set\n"
+      "G:../led1/value\n"
+      "S:.../set\n"
+      "G:./temp/dallas1/value\n"
+      "G:../dallas2/value\n"
+      "G:device2/switch/led/value\n"
+      "S:.../set\n";
+  static uint32_t seq = 0;
+
+  mqtt->set_op_mode(MODE_GW_ACK_ALL);
+  mqtt->handleEvents(publish_cb);
+  cache_clear();
+
+  run("parse() single command", 1000,
+      [](uint32_t) {
+        set_msgid(single + 12, seq++);
+        mqtt->parse((const unsigned char *)single, sizeof(single), 1234);
+      },
+      no_reset);
+  run("parse() compressed 8 commands", 1000,
+      [](uint32_t) {
+        set_msgid(multi + 12, seq++);
+        mqtt->parse((const unsigned char *)multi, sizeof(multi), 1234);
+      },
+      no_reset);
+  mqtt->handleEvents_view(view_cb);
+  run("parse() view single command", 1000,
+      [](uint32_t) {
+        set_msgid(single + 12, seq++);
+        mqtt->parse((const unsigned char *)single, sizeof(single), 1234);
+      },
+      no_reset);
+  run("parse() view compressed 8 commands", 1000,
+      [](uint32_t) {
+        set_msgid(multi + 12, seq++);
+        mqtt->parse((const unsigned char *)multi, sizeof(multi), 1234);
+      },
+      no_reset);
+
+  // the same frames binary encoded, message id after the node name
+  static uint8_t single_bin[250], multi_bin[250];
+  static int single_bin_len =
+      binframe_encode(single_bin, sizeof(single_bin), single, sizeof(single));
+  static int multi_bin_len =
+      binframe_encode(multi_bin, sizeof(multi_bin), multi, sizeof(multi));
+  run("parse() view binary single command", 1000,
+      [](uint32_t) {
+        set_msgid((char *)single_bin + 8, seq++);
+        mqtt->parse(single_bin, single_bin_len, 1234);
+      },
+      no_reset);
+  run("parse() view binary 8 commands", 1000,
+      [](uint32_t) {
+        set_msgid((char *)multi_bin + 8, seq++);
+        mqtt->parse(multi_bin, multi_bin_len, 1234);
+      },
+      no_reset);
+  // LZ compressed, the message id can't be patched in: duplicates expire
+  // at once instead
+  static uint8_t multi_lz[250];
+  static int multi_lz_len = lzframe_compress(
+      multi_lz, sizeof(multi_lz), (const uint8_t *)multi, sizeof(multi));
+  mqtt->set_dedup_ttl(0);
+  run("parse() view lz 8 commands", 1000,
+      [](uint32_t) { mqtt->parse(multi_lz, multi_lz_len, 1234); }, no_reset);
+  mqtt->set_dedup_ttl();
+  // a new source node per frame: its node table entry replaces the least
+  // recently seen one
+  static char sources[sizeof(single)];
+  memcpy(sources, single, sizeof(single));
+  run("parse() 1000 sources, node table full", 1000,
+      [](uint32_t i) {
+        char src[8];
+        snprintf(src, sizeof(src), "%06X", (unsigned)(i % 1000));
+        memcpy(sources + 5, src, 6);
+        set_msgid(sources + 12, seq++);
+        mqtt->parse((const unsigned char *)sources, sizeof(sources), 1234);
+      },
+      no_reset);
+  mqtt->reset_nodes();
+  // queued by the mesh callback, parsed from the loop
+  mqtt->set_deferred_receive(true);
+  run("receive() deferred + process_incoming()", 1000,
+      [](uint32_t) {
+        set_msgid(single + 12, seq++);
+        mqtt->receive((const unsigned char *)single, sizeof(single), 1234);
+        mqtt->process_incoming();
+      },
+      no_reset);
+  mqtt->set_deferred_receive(false);
+  mqtt->handleEvents_view(NULL);
+  run("parse() duplicate frame", 1000,
+      [](uint32_t) {
+        mqtt->parse((const unsigned char *)single, sizeof(single), 1234);
+      },
+      no_reset);
+
+  static uint16_t filled;
+  run("parse(ACK) @50%", cache_cap / 2,
+      [](uint32_t i) {
+        mqtt->parse((const unsigned char *)"ACK", 4,
+                    fill_id_base + (i % filled));
+      },
+      [] { filled = cache_fill(50); });
+  cache_clear();
+  mqtt->set_op_mode(MODE_NODE_STD);
+}
+
+// 30 handlers, the frame hits the 18th
+static const char *handler_names[30] = {
+    "h0",  "h1",  "h2",  "h3",  "h4",  "h5",  "h6",  "h7",  "h8",  "h9",
+    "h10", "h11", "h12", "h13", "h14", "h15", "h16", "h17", "h18", "h19",
+    "h20", "h21", "h22", "h23", "h24", "h25", "h26", "h27", "h28", "h29"};
+
+static void int_cb(int v) { sink += v; }
+
+static void if_chain_cb(const char *src, const char *msgid, char cmd,
+                        const char *topic, const char *value) {
+  for (int i = 0; i < 30; i++) mqtt->_ifInt(SET, handler_names[i], int_cb);
+}
+
+static void bench_dispatch(void) {
+  static char f[64];
+  static int len;
+  static uint32_t seq = 0;
+  len = snprintf(f, sizeof(f), "MQTT 5CCF7F/XXXX\nP:%s/int/h17/set 5\n",
+                 mqtt->myDeviceName.c_str()) + 1;
+
+  mqtt->handleEvents(if_chain_cb);
+  run("parse() + 30 _ifInt() in callback", 1000,
+      [](uint32_t) {
+        set_msgid(f + 12, seq++);
+        mqtt->parse((const unsigned char *)f, len, 0);
+      },
+      no_reset);
+  mqtt->handleEvents(publish_cb);
+  for (int i = 0; i < 30; i++) mqtt->_onInt(SET, handler_names[i], int_cb);
+  run("parse() + 30 _onInt() handlers", 1000,
+      [](uint32_t) {
+        set_msgid(f + 12, seq++);
+        mqtt->parse((const unsigned char *)f, len, 0);
+      },
+      no_reset);
+  mqtt->handlers_cnt = 0;
+  memset(mqtt->handler_index, 0, sizeof(mqtt->handler_index));
+}
+
+static void bench_decompress(void) {
+  mqtt->decompressTopic("device1/switch/led/value");
+  run("decompressTopic() full", 1000,
+      [](uint32_t) {
+        sink += mqtt->decompressTopic("device1/switch/led/value")[0];
+      },
+      no_reset);
+  run("decompressTopic() ../", 1000,
+      [](uint32_t) { sink += mqtt->decompressTopic("../led1/value")[0]; },
+      no_reset);
+  run("decompressTopic() .../", 1000,
+      [](uint32_t) { sink += mqtt->decompressTopic(".../set")[0]; },
+      no_reset);
+}
+
+static void bench_numbers(void) {
+  static char b[24];
+  run("format float snprintf %f", 1000,
+      [](uint32_t i) {
+        sink += snprintf(b, sizeof(b), "%f", 20.0f + (i & 0xFF) * 0.01f);
+      },
+      no_reset);
+  run("format float numfmt_float 2", 1000,
+      [](uint32_t i) {
+        sink += numfmt_float(b, sizeof(b), 20.0f + (i & 0xFF) * 0.01f, 2);
+      },
+      no_reset);
+  run("format fixed numfmt_fixed 2", 1000,
+      [](uint32_t i) {
+        sink += numfmt_fixed(b, sizeof(b), 2000 + (i & 0xFF), 2);
+      },
+      no_reset);
+  run("format int snprintf %d", 1000,
+      [](uint32_t i) { sink += snprintf(b, sizeof(b), "%d", (int)i - 500); },
+      no_reset);
+  run("format int numfmt_i32", 1000,
+      [](uint32_t i) { sink += numfmt_i32(b, sizeof(b), (int)i - 500); },
+      no_reset);
+  run("parse float sscanf %f", 1000,
+      [](uint32_t) {
+        float f;
+        sscanf("23.54", "%f", &f);
+        sink += (uint32_t)f;
+      },
+      no_reset);
+  run("parse float numparse_float", 1000,
+      [](uint32_t) {
+        float f;
+        numparse_float("23.54", 5, &f);
+        sink += (uint32_t)f;
+      },
+      no_reset);
+  run("parse fixed numparse_fixed 2", 1000,
+      [](uint32_t) {
+        int32_t v;
+        numparse_fixed("23.54", 5, 2, &v);
+        sink += v;
+      },
+      no_reset);
+  run("parse int sscanf %d", 1000,
+      [](uint32_t) {
+        int v;
+        sscanf("-1234", "%d", &v);
+        sink += v;
+      },
+      no_reset);
+  run("parse int numparse_i32", 1000,
+      [](uint32_t) {
+        int32_t v;
+        numparse_i32("-1234", 5, &v);
+        sink += v;
+      },
+      no_reset);
+}
+
+static uint8_t b64_data[180];
+static char b64_text[256];
+static uint8_t b64_out[256];
+
+static void bench_base64(void) {
+  static const int sizes[2] = {48, 180};
+  for (int i = 0; i < (int)sizeof(b64_data); i++) b64_data[i] = i * 37 + 11;
+  for (int k = 0; k < 2; k++) {
+    static int n;
+    n = sizes[k];
+    std::string s = std::to_string(n);
+    run("base64 encode Base64encode " + s, 100,
+        [](uint32_t) {
+          sink += Base64encode(b64_text, (const char *)b64_data, n);
+        },
+        no_reset);
+    run("base64 encode base64_encode " + s, 100,
+        [](uint32_t) {
+          sink += base64_encode(b64_text, sizeof(b64_text), b64_data, n);
+        },
+        no_reset);
+    static int text_len;
+    text_len = base64_encode(b64_text, sizeof(b64_text), b64_data, n);
+    run("base64 decode Base64decode " + s, 100,
+        [](uint32_t) { sink += Base64decode((char *)b64_out, b64_text); },
+        no_reset);
+    run("base64 decode base64_decode " + s, 100,
+        [](uint32_t) {
+          sink += base64_decode(b64_out, sizeof(b64_out), b64_text, text_len);
+        },
+        no_reset);
+  }
+}
+
+// cost of one event, -DSIMPLEMQTT_TRACE=ON builds only
+static void bench_trace(void) {
+#ifdef MQTT_TRACE
+  run("trace_record()", 100,
+      [](uint32_t i) { trace_record(TRACE_SEND, 0, i, 64); }, no_reset);
+  trace_clear();
+#endif
+}
+
+static void bench_cache(void) {
+  static const unsigned pcts[3] = {0, 50, 90};
+  static uint32_t id;
+  std::string n;
+
+  for (int p = 0; p < 3; p++) {
+    static unsigned pct;
+    pct = pcts[p];
+    pct_name(n, "mc_add_msg", pct);
+    run(n, 10,
+        [](uint32_t i) {
+          mqtt->mc_add_msg(frame, frame_size, 1, ++id, 60000, 10);
+        },
+        [] { cache_fill(pct); });
+
+    pct_name(n, "mc_del_msg", pct);
+    run(n, 10, [](uint32_t i) { mqtt->mc_del_msg(id - i); },
+        [] {
+          cache_fill(pct);
+          for (int i = 0; i < 10; i++)
+            mqtt->mc_add_msg(frame, frame_size, 1, ++id, 60000, 10);
+        });
+  }
+
+  static uint16_t filled;
+  filled = cache_fill(50);
+  run("mc_find_msg hit @50%", 1000,
+      [](uint32_t i) { sink += mqtt->mc_find_msg(fill_id_base + i % filled); },
+      no_reset);
+  run("mc_find_msg miss @50%", 1000,
+      [](uint32_t i) { sink += mqtt->mc_find_msg(12345); }, no_reset);
+  filled = cache_fill(100);
+  run("mc_find_msg hit @100%", 1000,
+      [](uint32_t i) { sink += mqtt->mc_find_msg(fill_id_base + i % filled); },
+      no_reset);
+  run("mc_find_msg miss @100%", 1000,
+      [](uint32_t i) { sink += mqtt->mc_find_msg(12345); }, no_reset);
+  run("mc_count_used_slots @100%", 1000,
+      [](uint32_t i) { sink += mqtt->mc_count_used_slots(); }, no_reset);
+  cache_clear();
+}
+
+static void bench_resend(void) {
+  static const unsigned pcts[3] = {0, 50, 100};
+  std::string n;
+  for (int p = 0; p < 3; p++) {
+    cache_fill(pcts[p]);
+    pct_name(n, "resend_loop() nothing due", pcts[p]);
+    run(n, 1000, [](uint32_t) { sink += mqtt->resend_loop() != NULL; },
+        no_reset);
+  }
+  cache_clear();
+}
+
+// ----------------------------------------------------------------------------
+// baseline files: one "name<TAB>ns<TAB>allocs" line per case
+
+static void save(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    return;
+  }
+  for (size_t i = 0; i < results.size(); i++)
+    fprintf(f, "%s\t%.1f\t%.2f\n", results[i].name.c_str(),
+            results[i].ns_per_op, results[i].allocs_per_op);
+  fclose(f);
+}
+
+static void compare(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return;
+  }
+  printf("\n%-44s %12s %12s %8s %12s\n", "case", "base ns", "now ns", "delta",
+         "allocs");
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    char *tab1 = strchr(line, '\t');
+    if (tab1 == NULL) continue;
+    *tab1 = 0;
+    double ns = 0, allocs = 0;
+    if (sscanf(tab1 + 1, "%lf\t%lf", &ns, &allocs) != 2) continue;
+    for (size_t i = 0; i < results.size(); i++) {
+      if (results[i].name != line) continue;
+      char a[32];
+      snprintf(a, sizeof(a), "%.2f->%.2f", allocs, results[i].allocs_per_op);
+      printf("%-44s %12.1f %12.1f %+7.1f%% %12s\n", line, ns,
+             results[i].ns_per_op, (results[i].ns_per_op / ns - 1.0) * 100.0,
+             a);
+    }
+  }
+  fclose(f);
+}
+
+int main(int argc, char **argv) {
+  const char *save_path = NULL;
+  const char *compare_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+      filter = argv[++i];
+    else if (strcmp(argv[i], "--min-ms") == 0 && i + 1 < argc)
+      min_ms = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+      save_path = argv[++i];
+    else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc)
+      compare_path = argv[++i];
+    else {
+      fprintf(stderr,
+              "usage: %s [--filter substr] [--min-ms N] [--save file] "
+              "[--compare file]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  host_set_micros(1000000);
+  randomSeed(1);
+  mqtt = new SimpleMQTT(1, "bench");
+  // no ACKs come in: measure the send path, not the send queue
+  mqtt->set_congestion_control(false);
+
+  printf("MAX_MC_ITEMS=%d MAX_MC_MEM=%d (%u frames)\n", MAX_MC_ITEMS,
+         MAX_MC_MEM, cache_cap);
+  bench_send();
+  bench_parse();
+  bench_dispatch();
+  bench_decompress();
+  bench_numbers();
+  bench_base64();
+  bench_trace();
+  bench_cache();
+  bench_resend();
+
+  if (save_path) save(save_path);
+  if (compare_path) compare(compare_path);
+  return 0;
+}
@@ -0,0 +1,424 @@
+// Load test of the reliability engine on a simulated flooding mesh
+// (sim_mesh.h): node 0 is a MODE_GW_ACK_ALL gateway, every other node
+// publishes "m/sim/<node>/value <seq>" at random (Poisson) times.
+//
+//   simplemqtt_sim [--nodes N] [--topology line|ring|grid|star|full|random]
+//                  [--links file] [--loss P] [--latency MS] [--jitter MS]
+//                  [--kbps N] [--ttl N] [--rate MSGS_PER_S] [--duration S]
+//                  [--drain S] [--qos 0|1|2] [--sync] [--binary]
+//                  [--coalesce MS] [--cc] [--adaptive-rto] [--seed N]
+//
+// --links reads "a b [loss [latency_ms [jitter_ms]]]" lines instead of a
+// generated topology. Publishing stops after --duration, the run goes on
+// for --drain to let resends finish. Prints delivered throughput, the
+// publish to gateway callback latency, duplicates and the retransmission
+// and flooding overhead; the same seed and options give the same run
+// (compare the digest).
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <Arduino.h>
+
+#include "SimpleMqtt.h"
+#include "hist_util.h"
+#include "sim_mesh.h"
+
+// how long a node's loop takes to come round again after a frame arrived
+#define SIM_LOOP_US 500
+// longest sleep of an idle node
+#define SIM_MAX_SLEEP_US 1000000
+
+struct sim_opts {
+  uint16_t nodes;
+  const char *topology;
+  const char *links;
+  float loss;
+  float latency_ms;
+  float jitter_ms;
+  uint32_t kbps;
+  int ttl;
+  float rate;
+  float duration_s;
+  float drain_s;
+  int qos;
+  bool sync;
+  bool binary;
+  uint16_t coalesce_ms;
+  bool cc;
+  bool adaptive_rto;
+  uint64_t seed;
+};
+
+struct node_st {
+  SimpleMQTT *mqtt;
+  uint64_t next_pub_us;
+  uint32_t seq;
+  uint16_t resends_seen;  // telemetry resend_pkt at the last wake up
+  std::vector<uint64_t> pub_us;  // per seq
+  std::vector<uint8_t> got;      // per seq, deliveries at the gateway
+};
+
+static sim_opts opt;
+static std::vector<node_st> nodes;
+static uint64_t publish_end_us;
+static uint64_t resends = 0;
+static uint64_t publish_failed = 0;
+static uint64_t app_dups = 0;
+static uint64_t delivered = 0;
+static hist latency_ms;
+
+static uint64_t next_interval_us(void) {
+  // exponential inter-arrival times
+  double u = sim_rand01();
+  return (uint64_t)(-log(1.0 - u) / opt.rate * 1e6) + 1;
+}
+
+static void node_wake(uint16_t n) {
+  node_st &d = nodes[n];
+  uint64_t now = sim_now();
+  if (n != 0 && opt.rate > 0 && now >= d.next_pub_us &&
+      d.next_pub_us < publish_end_us) {
+    char dev[20], value[12];
+    snprintf(dev, sizeof(dev), "m/sim/%u", n);
+    snprintf(value, sizeof(value), "%u", d.seq);
+    d.pub_us.push_back(now);
+    d.got.push_back(0);
+    d.seq++;
+    bool ok;
+    if (opt.sync)
+      ok = d.mqtt->publish_sync(dev, "/value", value);
+    else if (opt.qos >= 0)
+      ok = d.mqtt->publish(dev, "/value", value, (uint8_t)opt.qos);
+    else
+      ok = d.mqtt->publish(dev, "/value", value);
+    if (!ok) publish_failed++;
+    d.next_pub_us += next_interval_us();
+    now = sim_now();  // a synchronous publish takes time
+  }
+  d.mqtt->resend_loop();
+  uint16_t r = d.mqtt->get_telemetry_t_ptr()->resend_pkt;
+  resends += (uint16_t)(r - d.resends_seen);
+  d.resends_seen = r;
+
+  uint32_t ms = d.mqtt->resend_next_ms();
+  uint64_t next = ms == 0 ? SIM_LOOP_US
+                  : ms > SIM_MAX_SLEEP_US / 1000 ? SIM_MAX_SLEEP_US
+                                                : (uint64_t)ms * 1000;
+  next += now;
+  if (n != 0 && d.next_pub_us < publish_end_us && d.next_pub_us < next)
+    next = d.next_pub_us;
+  sim_wake(n, next);
+}
+
+static void node_deliver(uint16_t n, const uint8_t *data, int len,
+                         uint32_t replyId) {
+  nodes[n].mqtt->receive(data, len, replyId);
+  sim_wake(n, sim_now() + SIM_LOOP_US);
+}
+
+// gateway callback
+static void gw_publish(const char *src, const char *msgid, char cmd,
+                       const char *topic, const char *value) {
+  unsigned n;
+  if (cmd != 'P' || sscanf(topic, "m/sim/%u/value", &n) != 1 ||
+      n >= nodes.size())
+    return;
+  uint32_t seq = strtoul(value, NULL, 10);
+  node_st &d = nodes[n];
+  if (seq >= d.got.size()) return;
+  if (d.got[seq]++ > 0) {
+    app_dups++;
+    return;
+  }
+  delivered++;
+  hist_add(&latency_ms, (uint32_t)((sim_now() - d.pub_us[seq]) / 1000));
+}
+
+// ----------------------------------------------------------------------------
+// topologies
+
+static void link(uint16_t a, uint16_t b) {
+  sim_link(a, b, opt.loss, (uint32_t)(opt.latency_ms * 1000),
+           (uint32_t)(opt.jitter_ms * 1000));
+}
+
+static bool read_links(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return false;
+  char line[128];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    unsigned a, b;
+    float loss = opt.loss, lat = opt.latency_ms, jit = opt.jitter_ms;
+    if (line[0] == '#' ||
+        sscanf(line, "%u %u %f %f %f", &a, &b, &loss, &lat, &jit) < 2)
+      continue;
+    sim_link(a, b, loss, (uint32_t)(lat * 1000), (uint32_t)(jit * 1000));
+  }
+  fclose(f);
+  return true;
+}
+
+// nodes in the unit square, linked within `radius`; nodes out of reach
+// are linked to the nearest connected one
+static void random_topology(uint16_t n) {
+  std::vector<double> x(n), y(n);
+  for (uint16_t i = 0; i < n; i++) {
+    x[i] = sim_rand01();
+    y[i] = sim_rand01();
+  }
+  double radius = sqrt(3.0 / n);
+  for (uint16_t i = 0; i < n; i++)
+    for (uint16_t j = i + 1; j < n; j++)
+      if (hypot(x[i] - x[j], y[i] - y[j]) < radius) link(i, j);
+  std::vector<uint8_t> in(n, 0);
+  in[0] = 1;
+  for (bool grown = true; grown;) {
+    grown = false;
+    for (uint16_t i = 0; i < n; i++)
+      for (uint16_t j = 0; j < n && in[i]; j++)
+        if (!in[j] && sim_linked(i, j)) in[j] = 1, grown = true;
+    if (grown) continue;
+    int best_i = -1, best_j = -1;
+    double best = 1e9;
+    for (uint16_t i = 0; i < n; i++)
+      for (uint16_t j = 0; j < n; j++)
+        if (in[i] && !in[j] && hypot(x[i] - x[j], y[i] - y[j]) < best) {
+          best = hypot(x[i] - x[j], y[i] - y[j]);
+          best_i = i;
+          best_j = j;
+        }
+    if (best_i >= 0) {
+      link(best_i, best_j);
+      grown = true;
+    }
+  }
+}
+
+static bool build_topology(void) {
+  uint16_t n = opt.nodes;
+  if (opt.links != NULL) return read_links(opt.links);
+  const char *t = opt.topology;
+  if (strcmp(t, "line") == 0 || strcmp(t, "ring") == 0) {
+    for (uint16_t i = 0; i + 1 < n; i++) link(i, i + 1);
+    if (t[0] == 'r' && n > 2) link(n - 1, 0);
+  } else if (strcmp(t, "grid") == 0) {
+    uint16_t w = (uint16_t)ceil(sqrt((double)n));
+    for (uint16_t i = 0; i < n; i++) {
+      if ((i + 1) % w != 0 && i + 1 < n) link(i, i + 1);
+      if (i + w < n) link(i, i + w);
+    }
+  } else if (strcmp(t, "star") == 0) {
+    for (uint16_t i = 1; i < n; i++) link(0, i);
+  } else if (strcmp(t, "full") == 0) {
+    for (uint16_t i = 0; i < n; i++)
+      for (uint16_t j = i + 1; j < n; j++) link(i, j);
+  } else if (strcmp(t, "random") == 0) {
+    random_topology(n);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--nodes N] [--topology line|ring|grid|star|full|random]\n"
+          "  [--links file] [--loss P] [--latency MS] [--jitter MS] "
+          "[--kbps N]\n"
+          "  [--ttl N] [--rate MSGS_PER_S] [--duration S] [--drain S]\n"
+          "  [--qos 0|1|2] [--sync] [--binary] [--coalesce MS] [--cc]\n"
+          "  [--adaptive-rto] [--seed N]\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  opt.nodes = 16;
+  opt.topology = "random";
+  opt.links = NULL;
+  opt.loss = 0.05f;
+  opt.latency_ms = 2;
+  opt.jitter_ms = 1;
+  opt.kbps = 1000;
+  opt.ttl = -1;
+  opt.rate = 1;
+  opt.duration_s = 60;
+  opt.drain_s = 10;
+  opt.qos = -1;
+  opt.sync = false;
+  opt.binary = false;
+  opt.coalesce_ms = 0;
+  opt.cc = false;
+  opt.adaptive_rto = false;
+  opt.seed = 1;
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(a, "--sync") == 0)
+      opt.sync = true;
+    else if (strcmp(a, "--binary") == 0)
+      opt.binary = true;
+    else if (strcmp(a, "--cc") == 0)
+      opt.cc = true;
+    else if (strcmp(a, "--adaptive-rto") == 0)
+      opt.adaptive_rto = true;
+    else if (v == NULL) {
+      usage(argv[0]);
+      return 1;
+    } else if (strcmp(a, "--nodes") == 0)
+      opt.nodes = atoi(v), i++;
+    else if (strcmp(a, "--topology") == 0)
+      opt.topology = v, i++;
+    else if (strcmp(a, "--links") == 0)
+      opt.links = v, i++;
+    else if (strcmp(a, "--loss") == 0)
+      opt.loss = atof(v), i++;
+    else if (strcmp(a, "--latency") == 0)
+      opt.latency_ms = atof(v), i++;
+    else if (strcmp(a, "--jitter") == 0)
+      opt.jitter_ms = atof(v), i++;
+    else if (strcmp(a, "--kbps") == 0)
+      opt.kbps = atoi(v), i++;
+    else if (strcmp(a, "--ttl") == 0)
+      opt.ttl = atoi(v), i++;
+    else if (strcmp(a, "--rate") == 0)
+      opt.rate = atof(v), i++;
+    else if (strcmp(a, "--duration") == 0)
+      opt.duration_s = atof(v), i++;
+    else if (strcmp(a, "--drain") == 0)
+      opt.drain_s = atof(v), i++;
+    else if (strcmp(a, "--qos") == 0)
+      opt.qos = atoi(v), i++;
+    else if (strcmp(a, "--coalesce") == 0)
+      opt.coalesce_ms = atoi(v), i++;
+    else if (strcmp(a, "--seed") == 0)
+      opt.seed = strtoull(v, NULL, 10), i++;
+    else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (opt.nodes < 2 || opt.qos > 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  sim_init(opt.nodes, opt.seed, opt.kbps);
+  if (!build_topology()) {
+    usage(argv[0]);
+    return 1;
+  }
+  uint16_t ecc = sim_eccentricity(0);
+  if (ecc == 0xFFFF) {
+    fprintf(stderr, "not every node can reach the gateway\n");
+    return 1;
+  }
+  // one rebroadcast less than hops is enough, keep one spare
+  int ttl = opt.ttl >= 0 ? opt.ttl : ecc;
+  // the library's own random numbers (message ids, resend jitter)
+  randomSeed((unsigned long)opt.seed);
+
+  nodes.resize(opt.nodes);
+  for (uint16_t i = 0; i < opt.nodes; i++) {
+    node_st &d = nodes[i];
+    host_chip_id = 0x100 + i;  // the device name
+    d.mqtt = new SimpleMQTT(ttl, "sim");
+    d.mqtt->set_congestion_control(opt.cc);
+    d.mqtt->set_adaptive_rto(opt.adaptive_rto);
+    if (opt.binary) d.mqtt->set_wire_format(WIRE_BINARY);
+    if (opt.coalesce_ms) d.mqtt->set_coalescing(opt.coalesce_ms);
+    d.next_pub_us = next_interval_us();
+    d.seq = 0;
+    d.resends_seen = 0;
+    sim_wake(i, i == 0 ? 0 : d.next_pub_us);
+  }
+  nodes[0].mqtt->set_op_mode(MODE_GW_ACK_ALL);
+  nodes[0].mqtt->handleEvents(gw_publish);
+  sim_callbacks(node_wake, node_deliver);
+  memset(&latency_ms, 0, sizeof(latency_ms));
+
+  publish_end_us = (uint64_t)(opt.duration_s * 1e6);
+  sim_run_until(publish_end_us + (uint64_t)(opt.drain_s * 1e6));
+
+  uint64_t offered = 0;
+  mqtt_stats_st s;
+  uint64_t cache_full = 0, lost = 0, dedup = 0;
+  for (uint16_t i = 0; i < opt.nodes; i++) {
+    offered += nodes[i].seq;
+    nodes[i].mqtt->get_stats(&s);
+    lost += s.lost;
+    dedup += s.dedup_hits;
+    cache_full += s.cache_full;
+  }
+  const sim_mesh_stats_st *m = sim_mesh_stats();
+
+  printf("simplemqtt_sim: %u nodes, %s, gateway %u hops max, ttl %d, "
+         "seed %llu\n",
+         opt.nodes, opt.links ? opt.links : opt.topology, ecc, ttl,
+         (unsigned long long)opt.seed);
+  printf("links: loss %.3f, latency %.1f+%.1f ms, %u kbit/s; "
+         "%.0f s publishing at %.2f/s per node, %.0f s drain\n",
+         opt.loss, opt.latency_ms, opt.jitter_ms, opt.kbps, opt.duration_s,
+         opt.rate, opt.drain_s);
+  printf("offered      %llu msgs (%.2f/s)\n", (unsigned long long)offered,
+         offered / opt.duration_s);
+  printf("delivered    %llu (%.2f%%), %.2f msgs/s\n",
+         (unsigned long long)delivered,
+         offered ? 100.0 * delivered / offered : 0.0,
+         delivered / opt.duration_s);
+  printf("latency ms   p50 %u  p90 %u  p99 %u  p99.9 %u  max %u\n",
+         hist_percentile(&latency_ms, 500), hist_percentile(&latency_ms, 900),
+         hist_percentile(&latency_ms, 990), hist_percentile(&latency_ms, 999),
+         latency_ms.max);
+  printf("duplicates   %llu delivered twice, %llu filtered by the library\n",
+         (unsigned long long)app_dups, (unsigned long long)dedup);
+  printf("failures     %llu given up, %llu refused (cache full %llu)\n",
+         (unsigned long long)lost, (unsigned long long)publish_failed,
+         (unsigned long long)cache_full);
+  printf("resends      %llu (%.1f%% of %llu frames)\n",
+         (unsigned long long)resends,
+         m->frames ? 100.0 * resends / m->frames : 0.0,
+         (unsigned long long)m->frames);
+  printf("air          %llu tx (%.1f per delivered msg): %llu frames, %llu "
+         "replies, %llu forwards; %.1f s airtime\n",
+         (unsigned long long)m->tx, delivered ? (double)m->tx / delivered : 0,
+         (unsigned long long)m->frames, (unsigned long long)m->replies,
+         (unsigned long long)m->forwards, m->airtime_us / 1e6);
+  uint64_t rx_all = m->rx + m->rx_lost + m->rx_collided + m->rx_deaf;
+  printf("receptions   %llu: %llu lost, %llu collided, %llu while sending, "
+         "%llu copies\n",
+         (unsigned long long)rx_all, (unsigned long long)m->rx_lost,
+         (unsigned long long)m->rx_collided, (unsigned long long)m->rx_deaf,
+         (unsigned long long)m->rx_dup);
+  // the gateway's view: nodes whose frames it got again most often
+  // (of nodes with 10 frames or more, the table may have replaced others)
+  uint16_t cnt = nodes[0].mqtt->node_count();
+  std::vector<mqtt_node_st> table(cnt), ranked;
+  cnt = nodes[0].mqtt->get_nodes(table.data(), cnt);
+  for (uint16_t i = 0; i < cnt; i++)
+    if (table[i].rx_frames >= 10) ranked.push_back(table[i]);
+  for (size_t i = 0; i < ranked.size(); i++)
+    for (size_t j = i + 1; j < ranked.size(); j++)
+      if ((uint64_t)ranked[j].rx_dups * ranked[i].rx_frames >
+          (uint64_t)ranked[i].rx_dups * ranked[j].rx_frames)
+        std::swap(ranked[i], ranked[j]);
+  printf("node table   %u nodes, most frames received twice:", cnt);
+  for (size_t i = 0; i < ranked.size() && i < 3; i++)
+    printf(" %s %u/%u", ranked[i].name, ranked[i].rx_dups,
+           ranked[i].rx_frames);
+  printf("\n");
+  if (m->oversize)
+    printf("oversize     %llu frames over 250 bytes not sent\n",
+           (unsigned long long)m->oversize);
+  printf("digest       %016llx\n", (unsigned long long)m->digest);
+
+  for (uint16_t i = 0; i < opt.nodes; i++) delete nodes[i].mqtt;
+  return 0;
+}
@@ -0,0 +1,509 @@
+// EspNowFloodingMesh on a simulated radio, see sim_mesh.h.
+
+#include "sim_mesh.h"
+
+#include <Arduino.h>
+#include <EspNowFloodingMesh.h>
+#include <string.h>
+
+#include <deque>
+#include <queue>
+#include <vector>
+
+#define SIM_MAX_FRAME 250
+#define SIM_PREAMBLE_US 192
+#define SIM_SLOT_US 50
+#define SIM_BACKOFF_SLOTS 16
+
+enum { EV_WAKE, EV_TX, EV_RX, EV_HELD };
+
+struct sim_event {
+  uint64_t t;
+  uint64_t seq;  // FIFO among events at the same time
+  uint8_t type;
+  uint16_t node;
+  uint32_t arg;
+  bool operator<(const sim_event &o) const {
+    return t != o.t ? t > o.t : seq > o.seq;
+  }
+};
+
+enum { MSG_PLAIN, MSG_REQUEST, MSG_REPLY };
+
+struct sim_msg {
+  std::vector<uint8_t> data;
+  std::vector<uint8_t> seen;  // per node
+  uint32_t reply_id;
+  uint32_t refs;  // tx queue entries, receptions and held copies
+  uint8_t type;
+};
+
+enum { RX_OK, RX_LOST, RX_COLLIDED, RX_DEAF };
+
+struct sim_reception {
+  uint32_t msg;
+  uint8_t ttl;
+  uint8_t state;
+};
+
+struct sim_link_st {
+  uint16_t to;
+  float loss;
+  uint32_t latency_us;
+  uint32_t jitter_us;
+};
+
+struct sim_tx_item {
+  uint32_t msg;
+  uint8_t ttl;
+};
+
+// a frame that arrived while its node was blocked in sendAndWaitReply()
+struct sim_held {
+  uint32_t msg;
+  uint32_t reply_id;
+};
+
+struct sim_node {
+  std::vector<sim_link_st> links;
+  std::deque<sim_tx_item> txq;
+  bool tx_pending;
+  uint64_t tx_end;  // own transmission
+  uint64_t cs_end;  // a neighbour's transmission (carrier sense)
+  uint64_t rx_end;  // latest reception in progress
+  uint32_t rx_cur;  // ... and its record
+  uint64_t wake_at;
+  // sendAndWaitReply() in progress
+  bool blocked;
+  uint32_t wait_id;
+  int wait_replies;
+  void (*wait_cb)(const uint8_t *, int);
+  std::vector<sim_held> held;
+};
+
+// who sent request `id`, index id - 2
+struct sim_request {
+  uint16_t origin;
+  void (*cb)(const uint8_t *, int);
+};
+
+static std::vector<sim_node> nodes;
+// a deque: delivered frames stay in place while nodes send new ones
+static std::deque<sim_msg> msgs;
+static std::vector<uint32_t> msgs_free;
+static std::vector<sim_reception> recs;
+static std::vector<uint32_t> recs_free;
+static std::vector<sim_request> requests;
+static std::priority_queue<sim_event> events;
+static uint64_t ev_seq = 0;
+static uint64_t now_us = 0;
+static uint64_t rnd_state = 1;
+static uint32_t bits_kbps = 1000;
+static uint16_t current = 0;
+static sim_mesh_stats_st stats;
+static void (*wake_cb)(uint16_t) = NULL;
+static void (*deliver_cb)(uint16_t, const uint8_t *, int, uint32_t) = NULL;
+
+// splitmix64
+static uint64_t rnd64(void) {
+  uint64_t z = (rnd_state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+uint32_t sim_rand(void) { return (uint32_t)(rnd64() >> 32); }
+
+double sim_rand01(void) { return (rnd64() >> 11) * (1.0 / 9007199254740992.0); }
+
+static void digest(uint64_t v) {
+  for (int i = 0; i < 8; i++, v >>= 8) {
+    stats.digest ^= v & 0xFF;
+    stats.digest *= 0x100000001B3ull;
+  }
+}
+
+static void push(uint64_t t, uint8_t type, uint16_t node, uint32_t arg) {
+  sim_event e = {t, ev_seq++, type, node, arg};
+  events.push(e);
+}
+
+void sim_init(uint16_t n, uint64_t seed, uint32_t kbps) {
+  nodes.assign(n, sim_node());
+  for (uint16_t i = 0; i < n; i++) {
+    sim_node &d = nodes[i];
+    d.tx_pending = false;
+    d.tx_end = d.cs_end = d.rx_end = 0;
+    d.rx_cur = 0;
+    d.wake_at = SIM_NEVER;
+    d.blocked = false;
+    d.wait_id = 0;
+    d.wait_replies = 0;
+    d.wait_cb = NULL;
+  }
+  msgs.clear();
+  msgs_free.clear();
+  recs.clear();
+  recs_free.clear();
+  requests.clear();
+  events = std::priority_queue<sim_event>();
+  ev_seq = 0;
+  now_us = 0;
+  rnd_state = seed;
+  bits_kbps = kbps > 0 ? kbps : 1000;
+  current = 0;
+  memset(&stats, 0, sizeof(stats));
+  stats.digest = 0xCBF29CE484222325ull;
+  host_set_micros(0);
+}
+
+void sim_link(uint16_t a, uint16_t b, float loss, uint32_t latency_us,
+              uint32_t jitter_us) {
+  if (a == b || a >= nodes.size() || b >= nodes.size() || sim_linked(a, b))
+    return;
+  sim_link_st l = {b, loss, latency_us, jitter_us};
+  nodes[a].links.push_back(l);
+  l.to = a;
+  nodes[b].links.push_back(l);
+}
+
+bool sim_linked(uint16_t a, uint16_t b) {
+  if (a >= nodes.size()) return false;
+  for (size_t i = 0; i < nodes[a].links.size(); i++)
+    if (nodes[a].links[i].to == b) return true;
+  return false;
+}
+
+uint16_t sim_nodes(void) { return (uint16_t)nodes.size(); }
+
+uint16_t sim_eccentricity(uint16_t node) {
+  std::vector<uint16_t> hops(nodes.size(), 0xFFFF);
+  std::deque<uint16_t> q;
+  hops[node] = 0;
+  q.push_back(node);
+  uint16_t ecc = 0;
+  while (!q.empty()) {
+    uint16_t n = q.front();
+    q.pop_front();
+    if (hops[n] > ecc) ecc = hops[n];
+    for (size_t i = 0; i < nodes[n].links.size(); i++) {
+      uint16_t to = nodes[n].links[i].to;
+      if (hops[to] != 0xFFFF) continue;
+      hops[to] = hops[n] + 1;
+      q.push_back(to);
+    }
+  }
+  for (size_t i = 0; i < hops.size(); i++)
+    if (hops[i] == 0xFFFF) return 0xFFFF;
+  return ecc;
+}
+
+void sim_callbacks(void (*wake)(uint16_t),
+                   void (*deliver)(uint16_t, const uint8_t *, int, uint32_t)) {
+  wake_cb = wake;
+  deliver_cb = deliver;
+}
+
+void sim_wake(uint16_t node, uint64_t us) {
+  if (us < now_us) us = now_us;
+  if (us >= nodes[node].wake_at) return;
+  nodes[node].wake_at = us;
+  push(us, EV_WAKE, node, 0);
+}
+
+uint16_t sim_current(void) { return current; }
+
+uint64_t sim_now(void) { return now_us; }
+
+const sim_mesh_stats_st *sim_mesh_stats(void) { return &stats; }
+
+// ----------------------------------------------------------------------------
+// radio
+
+static void msg_release(uint32_t m) {
+  if (--msgs[m].refs == 0) msgs_free.push_back(m);
+}
+
+static uint32_t backoff_us(void) {
+  return SIM_SLOT_US + (sim_rand() % SIM_BACKOFF_SLOTS) * SIM_SLOT_US;
+}
+
+static void tx_enqueue(uint16_t n, uint32_t m, uint8_t ttl) {
+  sim_tx_item item = {m, ttl};
+  msgs[m].refs++;
+  nodes[n].txq.push_back(item);
+  if (!nodes[n].tx_pending) {
+    nodes[n].tx_pending = true;
+    push(now_us + backoff_us(), EV_TX, n, 0);
+  }
+}
+
+static uint32_t msg_new(const uint8_t *data, int size, uint8_t type,
+                        uint32_t reply_id) {
+  uint32_t m;
+  if (!msgs_free.empty()) {
+    m = msgs_free.back();
+    msgs_free.pop_back();
+  } else {
+    m = msgs.size();
+    msgs.push_back(sim_msg());
+  }
+  msgs[m].data.assign(data, data + size);
+  msgs[m].seen.assign(nodes.size(), 0);
+  msgs[m].reply_id = reply_id;
+  msgs[m].refs = 0;
+  msgs[m].type = type;
+  return m;
+}
+
+// a frame of the current node into the mesh
+static bool originate(const uint8_t *data, int size, int ttl, uint8_t type,
+                      uint32_t reply_id) {
+  if (size <= 0 || size > SIM_MAX_FRAME) {
+    stats.oversize++;
+    return false;
+  }
+  uint32_t m = msg_new(data, size, type, reply_id);
+  msgs[m].seen[current] = 1;
+  if (type == MSG_REPLY)
+    stats.replies++;
+  else
+    stats.frames++;
+  tx_enqueue(current, m, ttl < 0 ? 0 : (uint8_t)ttl);
+  return true;
+}
+
+static void transmit(uint16_t n) {
+  sim_node &d = nodes[n];
+  if (d.txq.empty()) {
+    d.tx_pending = false;
+    return;
+  }
+  uint64_t busy = d.tx_end > d.cs_end ? d.tx_end : d.cs_end;
+  if (now_us < busy) {
+    push(busy + backoff_us(), EV_TX, n, 0);
+    return;
+  }
+  sim_tx_item item = d.txq.front();
+  d.txq.pop_front();
+  uint32_t size = msgs[item.msg].data.size();
+  uint64_t air = SIM_PREAMBLE_US + (uint64_t)size * 8000 / bits_kbps;
+  d.tx_end = now_us + air;
+  stats.tx++;
+  stats.tx_bytes += size;
+  stats.airtime_us += air;
+
+  for (size_t i = 0; i < d.links.size(); i++) {
+    const sim_link_st &l = d.links[i];
+    sim_node &r = nodes[l.to];
+    if (r.cs_end < d.tx_end) r.cs_end = d.tx_end;
+    sim_reception rec = {item.msg, item.ttl, RX_OK};
+    if (sim_rand01() < l.loss) rec.state = RX_LOST;
+    if (r.tx_end > now_us) {
+      rec.state = RX_DEAF;
+    } else if (now_us < r.rx_end) {
+      if (recs[r.rx_cur].state == RX_OK) recs[r.rx_cur].state = RX_COLLIDED;
+      rec.state = RX_COLLIDED;
+    }
+    uint32_t ri;
+    if (!recs_free.empty()) {
+      ri = recs_free.back();
+      recs_free.pop_back();
+      recs[ri] = rec;
+    } else {
+      ri = recs.size();
+      recs.push_back(rec);
+    }
+    if (d.tx_end > r.rx_end) {
+      r.rx_end = d.tx_end;
+      r.rx_cur = ri;
+    }
+    msgs[item.msg].refs++;
+    uint64_t lat = l.latency_us + (l.jitter_us ? sim_rand() % l.jitter_us : 0);
+    push(d.tx_end + lat, EV_RX, l.to, ri);
+  }
+  msg_release(item.msg);
+
+  if (d.txq.empty())
+    d.tx_pending = false;
+  else
+    push(d.tx_end + backoff_us(), EV_TX, n, 0);
+}
+
+// hands a frame to node n, unless it's blocked in a synchronous send
+static void deliver(uint16_t n, uint32_t m, uint32_t reply_id) {
+  sim_node &d = nodes[n];
+  const sim_msg &msg = msgs[m];
+  uint16_t prev = current;
+  current = n;
+  if (d.blocked && msg.type == MSG_REPLY && reply_id == d.wait_id) {
+    d.wait_replies++;
+    if (d.wait_cb != NULL) d.wait_cb(&msg.data[0], msg.data.size());
+  } else if (d.blocked) {
+    sim_held h = {m, reply_id};
+    msgs[m].refs++;
+    d.held.push_back(h);
+  } else if (msg.type == MSG_REPLY && requests[reply_id - 2].cb != NULL) {
+    requests[reply_id - 2].cb(&msg.data[0], msg.data.size());
+  } else if (deliver_cb != NULL) {
+    deliver_cb(n, &msg.data[0], msg.data.size(), reply_id);
+  }
+  current = prev;
+}
+
+static void receive(uint16_t n, uint32_t ri) {
+  sim_reception rec = recs[ri];
+  recs_free.push_back(ri);
+  sim_msg &msg = msgs[rec.msg];
+  switch (rec.state) {
+    case RX_LOST:
+      stats.rx_lost++;
+      break;
+    case RX_COLLIDED:
+      stats.rx_collided++;
+      break;
+    case RX_DEAF:
+      stats.rx_deaf++;
+      break;
+    default:
+      stats.rx++;
+      if (msg.seen[n]) {
+        stats.rx_dup++;
+        break;
+      }
+      msg.seen[n] = 1;
+      if (rec.ttl > 0) {
+        stats.forwards++;
+        tx_enqueue(n, rec.msg, rec.ttl - 1);
+      }
+      if (msg.type == MSG_PLAIN)
+        deliver(n, rec.msg, 0);
+      else if (msg.type == MSG_REQUEST)
+        deliver(n, rec.msg, msg.reply_id);
+      else if (requests[msg.reply_id - 2].origin == n)
+        deliver(n, rec.msg, msg.reply_id);
+  }
+  msg_release(rec.msg);
+}
+
+// one event; nested (a node waits in sendAndWaitReply()): node code other
+// than receiving isn't run, wake ups are returned in `deferred`
+static void step(std::vector<uint16_t> *deferred) {
+  sim_event e = events.top();
+  events.pop();
+  now_us = e.t;
+  host_set_micros(now_us);
+  switch (e.type) {
+    case EV_WAKE:
+      if (nodes[e.node].wake_at != e.t) return;  // replaced by an earlier one
+      nodes[e.node].wake_at = SIM_NEVER;
+      if (deferred != NULL || nodes[e.node].blocked) {
+        if (deferred != NULL) deferred->push_back(e.node);
+        return;
+      }
+      if (wake_cb != NULL) {
+        current = e.node;
+        wake_cb(e.node);
+      }
+      break;
+    case EV_TX:
+      transmit(e.node);
+      break;
+    case EV_RX:
+      receive(e.node, e.arg);
+      break;
+    case EV_HELD: {
+      sim_node &d = nodes[e.node];
+      std::vector<sim_held> held;
+      held.swap(d.held);
+      for (size_t i = 0; i < held.size(); i++) {
+        deliver(e.node, held[i].msg, held[i].reply_id);
+        msg_release(held[i].msg);
+      }
+      break;
+    }
+  }
+  digest(e.t);
+  digest((uint64_t)e.type << 32 | (uint64_t)e.node << 16);
+}
+
+void sim_run_until(uint64_t us) {
+  while (!events.empty() && events.top().t <= us) step(NULL);
+  now_us = us;
+  host_set_micros(now_us);
+}
+
+// ----------------------------------------------------------------------------
+// EspNowFloodingMesh
+
+void espNowFloodingMesh_RecvCB(void (*callback)(const uint8_t *, int,
+                                                uint32_t)) {
+  // frames go to sim_callbacks() deliver, per node
+}
+
+void espNowFloodingMesh_send(uint8_t *msg, int size, int ttl) {
+  originate(msg, size, ttl, MSG_PLAIN, 0);
+}
+
+void espNowFloodingMesh_sendReply(uint8_t *msg, int size, int ttl,
+                                  uint32_t replyIdentifier) {
+  if (replyIdentifier < 2 || replyIdentifier - 2 >= requests.size()) return;
+  originate(msg, size, ttl, MSG_REPLY, replyIdentifier);
+}
+
+static uint32_t request_new(void (*f)(const uint8_t *, int)) {
+  sim_request r = {current, f};
+  requests.push_back(r);
+  // reply ids 0 and 1 have special meaning in the message cache
+  return requests.size() + 1;
+}
+
+uint32_t espNowFloodingMesh_sendAndHandleReply(uint8_t *msg, int size,
+                                               int ttl,
+                                               void (*f)(const uint8_t *,
+                                                         int)) {
+  uint32_t id = request_new(f);
+  originate(msg, size, ttl, MSG_REQUEST, id);
+  return id;
+}
+
+// Blocks the current node: events run on (other nodes receive, forward,
+// reply) until enough replies arrived or every try timed out. Wake ups are
+// postponed meanwhile, frames for the blocked node are handed over after.
+bool espNowFloodingMesh_sendAndWaitReply(uint8_t *msg, int size, int ttl,
+                                         int tryCount,
+                                         void (*f)(const uint8_t *, int),
+                                         int timeoutMs,
+                                         int expectedCountOfReplies,
+                                         uint16_t backoffMs) {
+  uint16_t self = current;
+  sim_node &d = nodes[self];
+  if (d.blocked) return false;
+  d.blocked = true;
+  d.wait_cb = f;
+  d.wait_replies = 0;
+  std::vector<uint16_t> deferred;
+  for (int t = 0; t < tryCount && d.wait_replies < expectedCountOfReplies;
+       t++) {
+    if (t > 0 && backoffMs > 0) {
+      uint64_t until = now_us + (uint64_t)backoffMs * 1000;
+      while (!events.empty() && events.top().t <= until) step(&deferred);
+      now_us = until;
+    }
+    d.wait_id = request_new(NULL);
+    current = self;
+    if (!originate(msg, size, ttl, MSG_REQUEST, d.wait_id)) break;
+    uint64_t until = now_us + (uint64_t)timeoutMs * 1000;
+    while (!events.empty() && events.top().t <= until &&
+           d.wait_replies < expectedCountOfReplies)
+      step(&deferred);
+    if (d.wait_replies < expectedCountOfReplies) now_us = until;
+  }
+  host_set_micros(now_us);
+  current = self;
+  d.blocked = false;
+  d.wait_id = 0;
+  for (size_t i = 0; i < deferred.size(); i++) sim_wake(deferred[i], now_us);
+  if (!d.held.empty()) push(now_us, EV_HELD, self, 0);
+  return d.wait_replies >= expectedCountOfReplies;
+}
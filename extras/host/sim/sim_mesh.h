@@ -0,0 +1,71 @@
+#ifndef ___SIM_MESH_H_
+#define ___SIM_MESH_H_
+
+// Simulated ESP-NOW flooding mesh: implements the EspNowFloodingMesh
+// functions for any number of nodes on a virtual topology, driven by a
+// discrete event queue on the virtual clock (host_set_micros()).
+//
+// Radio model: one shared channel, a frame occupies the air for
+// preamble + bytes at `kbps`. A node defers while any neighbour transmits
+// (carrier sense plus a random backoff of 50 us slots), a reception that
+// overlaps another one at the receiver is lost for both (hidden nodes),
+// every link drops frames with its own probability and adds its latency
+// (processing, queueing in the stack) before the frame is handed over.
+// Flooding: each node handles a frame once (by mesh message) and
+// rebroadcasts it while its ttl lasts. Replies are flooded too and handed
+// to the node that sent the request only.
+//
+// All randomness comes from the seed, so runs are reproducible.
+
+#include <stdint.h>
+
+#define SIM_NEVER 0xFFFFFFFFFFFFFFFFull
+
+struct sim_mesh_stats_st {
+  uint64_t frames;      // originated: plain sends and requests
+  uint64_t replies;     // originated replies (ACKs)
+  uint64_t forwards;    // rebroadcasts
+  uint64_t tx;          // transmissions, all of the above
+  uint64_t tx_bytes;
+  uint64_t airtime_us;  // summed over transmissions
+  uint64_t rx;          // receptions handed to the flooding layer
+  uint64_t rx_dup;      // copies of frames a node had seen already
+  uint64_t rx_lost;     // dropped by the link
+  uint64_t rx_collided; // overlapping receptions
+  uint64_t rx_deaf;     // receiver was transmitting
+  uint64_t oversize;    // frames longer than 250 bytes, not sent
+  uint64_t digest;      // FNV-1a of every event, equal for equal runs
+};
+
+// `nodes` nodes without links; frames take 192 us + 8 bits/byte at `kbps`
+void sim_init(uint16_t nodes, uint64_t seed, uint32_t kbps);
+// a link in both directions
+void sim_link(uint16_t a, uint16_t b, float loss, uint32_t latency_us,
+              uint32_t jitter_us);
+bool sim_linked(uint16_t a, uint16_t b);
+uint16_t sim_nodes(void);
+// hops from `node` to the farthest node, 0xFFFF if not all are reachable
+uint16_t sim_eccentricity(uint16_t node);
+
+// Node code is only run from these callbacks, with the node current: the
+// EspNowFloodingMesh functions send from the current node.
+//   wake:    a timer set with sim_wake() expired
+//   deliver: a frame arrived (replyId != 0: the sender wants a reply)
+void sim_callbacks(void (*wake)(uint16_t node),
+                   void (*deliver)(uint16_t node, const uint8_t *data,
+                                   int len, uint32_t replyId));
+// wake `node` at `us` (an earlier pending wake up is kept)
+void sim_wake(uint16_t node, uint64_t us);
+uint16_t sim_current(void);
+
+// runs the events up to `us` and sets the clock to it
+void sim_run_until(uint64_t us);
+uint64_t sim_now(void);
+const sim_mesh_stats_st *sim_mesh_stats(void);
+
+// seeded generator of the simulation (links, backoff, workload)
+uint32_t sim_rand(void);
+// uniform in [0, 1)
+double sim_rand01(void);
+
+#endif
@@ -0,0 +1,117 @@
+#include "Arduino.h"
+
+#include <chrono>
+
+HardwareSerial Serial;
+EspClass ESP;
+uint32_t host_chip_id = 0xA1B2C3;
+
+static bool virtual_clock = false;
+static uint64_t virtual_us = 0;
+
+static uint64_t wall_us(void) {
+  static const auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+unsigned long millis(void) {
+  return (unsigned long)((virtual_clock ? virtual_us : wall_us()) / 1000);
+}
+
+unsigned long micros(void) {
+  return (unsigned long)(virtual_clock ? virtual_us : wall_us());
+}
+
+void host_set_micros(uint64_t us) {
+  virtual_clock = true;
+  virtual_us = us;
+}
+
+void host_advance_millis(unsigned long ms) {
+  if (!virtual_clock) host_set_micros(wall_us());
+  virtual_us += (uint64_t)ms * 1000;
+}
+
+void host_use_wall_clock(void) { virtual_clock = false; }
+
+// xorshift32, deterministic for a given seed so host runs are reproducible
+static uint32_t rnd_state = 0x9E3779B9;
+
+void randomSeed(unsigned long seed) { rnd_state = seed ? (uint32_t)seed : 1; }
+
+long random(long howsmall, long howbig) {
+  if (howsmall >= howbig) return howsmall;
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 17;
+  rnd_state ^= rnd_state << 5;
+  return howsmall + (long)(rnd_state % (uint32_t)(howbig - howsmall));
+}
+
+long secureRandom(long howsmall, long howbig) {
+  return random(howsmall, howbig);
+}
+
+String::String(const char *s) : buf(NULL), len(0) {
+  assign(s ? s : "", s ? strlen(s) : 0);
+}
+
+String::String(const String &s) : buf(NULL), len(0) { assign(s.buf, s.len); }
+
+String::~String() { free(buf); }
+
+String &String::operator=(const String &s) {
+  if (this != &s) assign(s.buf, s.len);
+  return *this;
+}
+
+String &String::operator=(const char *s) {
+  assign(s ? s : "", s ? strlen(s) : 0);
+  return *this;
+}
+
+String &String::operator+=(const char *s) {
+  unsigned int n = strlen(s);
+  char *p = (char *)realloc(buf, len + n + 1);
+  if (p == NULL) return *this;
+  memcpy(p + len, s, n + 1);
+  buf = p;
+  len += n;
+  return *this;
+}
+
+String &String::operator+=(const String &s) { return *this += s.c_str(); }
+
+void String::assign(const char *s, unsigned int n) {
+  char *p = (char *)realloc(buf, n + 1);
+  if (p == NULL) return;
+  memmove(p, s, n);
+  p[n] = 0;
+  buf = p;
+  len = n;
+}
+
+size_t HardwareSerial::print(const char *s) { return fputs(s, stdout) < 0 ? 0 : strlen(s); }
+size_t HardwareSerial::print(char c) { return putchar(c) == EOF ? 0 : 1; }
+size_t HardwareSerial::print(int v) { return ::printf("%d", v); }
+size_t HardwareSerial::print(unsigned int v) { return ::printf("%u", v); }
+size_t HardwareSerial::print(long v) { return ::printf("%ld", v); }
+size_t HardwareSerial::print(unsigned long v) { return ::printf("%lu", v); }
+size_t HardwareSerial::print(double v) { return ::printf("%.2f", v); }
+size_t HardwareSerial::println(void) { return print('\n'); }
+
+size_t HardwareSerial::printf(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vprintf(fmt, ap);
+  va_end(ap);
+  return n < 0 ? 0 : n;
+}
+
+size_t HardwareSerial::write(const uint8_t *data, size_t len) {
+  return fwrite(data, 1, len, stdout);
+}
+
+uint32_t EspClass::getChipId(void) { return host_chip_id; }
+uint64_t EspClass::getEfuseMac(void) { return host_chip_id; }
@@ -0,0 +1,78 @@
+#ifndef ___HOST_ARDUINO_H_
+#define ___HOST_ARDUINO_H_
+
+// Minimal Arduino core stand-in so the library compiles on a Linux host.
+// Only what SimpleMqtt.cpp touches is provided.
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define sniprintf snprintf
+
+unsigned long millis(void);
+unsigned long micros(void);
+long random(long howsmall, long howbig);
+long secureRandom(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+// host clock control: once a virtual time is set, millis()/micros() return
+// it instead of the wall clock
+void host_set_micros(uint64_t us);
+void host_advance_millis(unsigned long ms);
+void host_use_wall_clock(void);
+
+class String {
+ public:
+  String(const char *s = "");
+  String(const String &s);
+  ~String();
+  String &operator=(const String &s);
+  String &operator=(const char *s);
+  String &operator+=(const char *s);
+  String &operator+=(const String &s);
+  const char *c_str() const { return buf; }
+  unsigned int length() const { return len; }
+
+ private:
+  void assign(const char *s, unsigned int n);
+  char *buf;
+  unsigned int len;
+};
+
+class HardwareSerial {
+ public:
+  size_t print(const char *s);
+  size_t print(char c);
+  size_t print(int v);
+  size_t print(unsigned int v);
+  size_t print(long v);
+  size_t print(unsigned long v);
+  size_t print(double v);
+  size_t println(void);
+  template <typename T>
+  size_t println(T v) {
+    size_t n = print(v);
+    return n + println();
+  }
+  size_t printf(const char *fmt, ...);
+  size_t write(const uint8_t *data, size_t len);
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+ public:
+  uint32_t getChipId(void);
+  uint64_t getEfuseMac(void);
+};
+
+extern EspClass ESP;
+
+// value returned by ESP.getChipId(), lets a host process run several nodes
+extern uint32_t host_chip_id;
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef ___HOST_ESPNOWFLOODINGMESH_H_
+#define ___HOST_ESPNOWFLOODINGMESH_H_
+
+// Declarations of the EspNowFloodingMesh functions used by SimpleMQTT.
+// The host build links one implementation of them: the loopback stub in
+// EspNowFloodingMesh.cpp for benchmarks, the simulated mesh of
+// ../sim/sim_mesh.cpp for simplemqtt_sim.
+
+#include <stddef.h>
+#include <stdint.h>
+
+void espNowFloodingMesh_RecvCB(void (*callback)(const uint8_t *, int,
+                                                uint32_t));
+void espNowFloodingMesh_send(uint8_t *msg, int size, int ttl = 0);
+void espNowFloodingMesh_sendReply(uint8_t *msg, int size, int ttl,
+                                  uint32_t replyIdentifier);
+uint32_t espNowFloodingMesh_sendAndHandleReply(uint8_t *msg, int size,
+                                               int ttl,
+                                               void (*f)(const uint8_t *,
+                                                         int));
+bool espNowFloodingMesh_sendAndWaitReply(
+    uint8_t *msg, int size, int ttl, int tryCount = 1,
+    void (*f)(const uint8_t *, int) = NULL, int timeoutMs = 3000,
+    int expectedCountOfReplies = 1, uint16_t backoffMs = 0);
+
+// loopback stub bookkeeping
+struct host_mesh_stats_st {
+  uint32_t sent;
+  uint32_t replies;
+  uint32_t bytes;
+  uint32_t last_reply_id;
+};
+
+extern host_mesh_stats_st host_mesh_stats;
+extern void (*host_mesh_recv_cb)(const uint8_t *, int, uint32_t);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef ___HOST_SAFEMEMCPY_H_
+#define ___HOST_SAFEMEMCPY_H_
+
+#include <stddef.h>
+#include <string.h>
+
+// copy at most destSize bytes
+static inline void *memcpyS(void *dest, size_t destSize, const void *src,
+                            size_t count) {
+  return memcpy(dest, src, count < destSize ? count : destSize);
+}
+
+#endif
@@ -0,0 +1,408 @@
+// Host unit tests for the SimpleMQTT data structures and protocol paths
+// that are hard to hit on a mesh: index wrap-around, the resend schedule
+// across the millis() wrap, duplicate filter expiry, topic aliases and
+// QoS 2 releases.
+//
+//   simplemqtt_test
+//
+// Prints a line per failed check, exits non-zero if any failed.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include <EspNowFloodingMesh.h>
+
+// the tests look at private state (index, schedule, duplicate filter)
+#define private public
+#include "SimpleMqtt.h"
+#undef private
+
+// ----------------------------------------------------------------------------
+// recording mesh: transmissions are kept for the test to deliver by hand
+
+struct tx_frame {
+  std::string data;
+  uint32_t reply_id;  // of the request, or the one answered
+  bool reply;
+};
+
+host_mesh_stats_st host_mesh_stats;
+void (*host_mesh_recv_cb)(const uint8_t *, int, uint32_t) = NULL;
+static std::vector<tx_frame> air;
+static uint32_t next_reply_id = 2;
+
+static void air_put(const uint8_t *msg, int size, uint32_t id, bool reply) {
+  tx_frame f;
+  f.data.assign((const char *)msg, size);
+  f.reply_id = id;
+  f.reply = reply;
+  air.push_back(f);
+}
+
+void espNowFloodingMesh_RecvCB(void (*callback)(const uint8_t *, int,
+                                                uint32_t)) {
+  host_mesh_recv_cb = callback;
+}
+
+void espNowFloodingMesh_send(uint8_t *msg, int size, int ttl) {
+  air_put(msg, size, 0, false);
+}
+
+void espNowFloodingMesh_sendReply(uint8_t *msg, int size, int ttl,
+                                  uint32_t replyIdentifier) {
+  air_put(msg, size, replyIdentifier, true);
+}
+
+uint32_t espNowFloodingMesh_sendAndHandleReply(uint8_t *msg, int size,
+                                               int ttl,
+                                               void (*f)(const uint8_t *,
+                                                         int)) {
+  air_put(msg, size, next_reply_id, false);
+  return next_reply_id++;
+}
+
+bool espNowFloodingMesh_sendAndWaitReply(uint8_t *msg, int size, int ttl,
+                                         int tryCount,
+                                         void (*f)(const uint8_t *, int),
+                                         int timeoutMs,
+                                         int expectedCountOfReplies,
+                                         uint16_t backoffMs) {
+  air_put(msg, size, 0, false);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+// harness
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(c)                                                     \
+  do {                                                               \
+    checks++;                                                        \
+    if (!(c)) {                                                      \
+      failures++;                                                    \
+      printf("%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__,    \
+             __func__, #c);                                          \
+    }                                                                \
+  } while (0)
+
+static std::string delivered;  // "topic value\n" per command
+
+static void on_view(const char *src_node_name, const char *msgid, char command,
+                    const char *topic, uint16_t topic_len, const char *value,
+                    uint16_t value_len) {
+  delivered += std::string(topic, topic_len) + " " +
+               std::string(value, value_len) + "\n";
+}
+
+static void deliver(SimpleMQTT &m, const tx_frame &f) {
+  m.parse((const uint8_t *)f.data.data(), f.data.size(), f.reply_id);
+}
+
+static void ack(SimpleMQTT &m, uint32_t reply_id) {
+  m.parse((const uint8_t *)"ACK", 4, reply_id);
+}
+
+// replies ("ACK", "ARST") to `reply_id` sent since air[from]
+static std::string replies(size_t from, uint32_t reply_id) {
+  std::string r;
+  for (size_t i = from; i < air.size(); i++)
+    if (air[i].reply && air[i].reply_id == reply_id)
+      r += air[i].data.c_str() + std::string(" ");
+  return r;
+}
+
+static int held_ids(SimpleMQTT &m) {
+  int n = 0;
+  for (uint16_t i = 0; i < MQTT_QOS2_ENTRIES; i++)
+    if (m.mqtt_qos2[i].key != 0) n++;
+  return n;
+}
+
+// ----------------------------------------------------------------------------
+// tests
+
+// reply id index: a probe chain across the end of the table survives
+// deleting its head and reinserting it
+static void test_index_wrap(void) {
+  SimpleMQTT m(1, "t");
+  const uint32_t last = MC_INDEX_SIZE - 1;
+  // reply ids whose home slot is the last one / the first one
+  std::vector<uint32_t> at_last, at_first;
+  for (uint32_t id = 2; at_last.size() < 3 || at_first.empty(); id++) {
+    m.mc_index_put(id, 7);
+    uint32_t pos = 0;
+    while (m.mc_index[pos].reply_id != id) pos++;
+    m.mc_index_del(id, 7);
+    if (pos == last && at_last.size() < 3) at_last.push_back(id);
+    if (pos == 0 && at_first.empty()) at_first.push_back(id);
+  }
+  // slots last, 0, 1 and 2
+  for (uint16_t k = 0; k < 3; k++) m.mc_index_put(at_last[k], k);
+  m.mc_index_put(at_first[0], 3);
+  CHECK(m.mc_index[last].reply_id == at_last[0]);
+  CHECK(m.mc_index[0].reply_id == at_last[1]);
+  CHECK(m.mc_index[2].reply_id == at_first[0]);
+
+  m.mc_index_del(at_last[0], 0);
+  CHECK(m.mc_index_get(at_last[0]) == -1);
+  CHECK(m.mc_index_get(at_last[1]) == 1);
+  CHECK(m.mc_index_get(at_last[2]) == 2);
+  CHECK(m.mc_index_get(at_first[0]) == 3);
+  CHECK(m.mc_index[last].reply_id == at_last[1]);  // shifted back over 0
+
+  m.mc_index_put(at_last[0], 0);
+  for (uint16_t k = 0; k < 3; k++) CHECK(m.mc_index_get(at_last[k]) == k);
+  CHECK(m.mc_index_get(at_first[0]) == 3);
+
+  // the same reply id for two slots (a resent frame): only that pair goes
+  m.mc_index_put(at_first[0], 4);
+  m.mc_index_del(at_first[0], 3);
+  CHECK(m.mc_index_get(at_first[0]) == 4);
+  for (uint16_t k = 0; k < 3; k++) m.mc_index_del(at_last[k], k);
+  m.mc_index_del(at_first[0], 4);
+  for (uint32_t i = 0; i < MC_INDEX_SIZE; i++)
+    CHECK(m.mc_index[i].reply_id == 0);
+}
+
+// the resend schedule orders deadlines that lie across the millis() wrap
+static void test_sched_wrap(void) {
+  host_set_micros((uint64_t)(0xFFFFFFFFUL - 50) * 1000);
+  SimpleMQTT m(1, "t");
+  uint8_t frame[] = "MQTT A1B2C3/abcd\nP:m/x/value 1\n";
+  const uint16_t timeouts[] = {100, 10, 300, 30, 60};
+  for (uint16_t k = 0; k < 5; k++)
+    CHECK(m.mc_add_msg(frame, sizeof(frame), 1, 1000 + k, timeouts[k], 1) >=
+          0);
+  std::vector<uint16_t> order;
+  while (m.mc_sched_len > 0) {
+    uint16_t i = m.mc_sched[0];
+    order.push_back(m.mc_db[i].timeout);
+    m.mc_sched_remove(i);
+  }
+  const uint16_t sorted[] = {10, 30, 60, 100, 300};
+  CHECK(order.size() == 5);
+  for (uint16_t k = 0; k < order.size() && k < 5; k++)
+    CHECK(order[k] == sorted[k]);
+
+  // only the frames due by now are resent, on both sides of the wrap
+  for (uint16_t k = 0; k < 5; k++) m.mc_del_msg_idx(k);
+  for (uint16_t k = 0; k < 5; k++)
+    m.mc_add_msg(frame, sizeof(frame), 1, 2000 + k, timeouts[k], 5);
+  size_t sent = air.size();
+  host_advance_millis(40);
+  m.resend_loop();
+  CHECK(air.size() - sent == 2);  // 10 and 30
+  host_advance_millis(100);       // past the wrap
+  m.resend_loop();
+  CHECK(air.size() - sent == 6);  // 60, 100 and the two resent ones again
+  CHECK(m.mc_sched_len == 5);
+  uint16_t waiting = 0;  // 300 isn't due yet
+  for (uint16_t i = 0; i < m.mc_slot_bump; i++)
+    if (m.mc_db[i].msg_ptr != NULL && m.mc_db[i].resends == 0) waiting++;
+  CHECK(waiting == 1);
+  host_use_wall_clock();
+}
+
+// duplicate filter: entries expire after the TTL, a full ring forgets the
+// oldest one
+static void test_dedup(void) {
+  host_set_micros(1000000);
+  SimpleMQTT m(1, "t");
+  CHECK(!m.mqtt_dedup_check("N1", "AAAA"));
+  CHECK(m.mqtt_dedup_check("N1", "AAAA"));
+  CHECK(!m.mqtt_dedup_check("N2", "AAAA"));
+  host_advance_millis(MQTT_DEDUP_TTL_MS - 1);
+  CHECK(m.mqtt_dedup_check("N1", "AAAA"));
+  host_advance_millis(1);
+  CHECK(!m.mqtt_dedup_check("N1", "AAAA"));  // expired, remembered again
+  CHECK(m.mqtt_dedup_check("N1", "AAAA"));
+
+  m.mqtt_dedup_use(m.mqtt_dedup_node, m.mqtt_dedup_node_index,
+                   MQTT_DEDUP_NODE_SIZE, MQTT_DEDUP_NODE_INDEX_SIZE);
+  char id[5];
+  for (int k = 0; k <= MQTT_DEDUP_NODE_SIZE; k++) {
+    snprintf(id, sizeof(id), "%04d", k);
+    CHECK(!m.mqtt_dedup_check("N3", id));
+  }
+  CHECK(m.mqtt_dedup_count == MQTT_DEDUP_NODE_SIZE);
+  for (int k = MQTT_DEDUP_NODE_SIZE; k >= 1; k--) {
+    snprintf(id, sizeof(id), "%04d", k);
+    CHECK(m.mqtt_dedup_check("N3", id));
+  }
+  CHECK(!m.mqtt_dedup_check("N3", "0000"));  // evicted
+  host_use_wall_clock();
+}
+
+// topic aliases: bound on first use, resolved by the gateway, full topics
+// again after an ARST; topics of other devices are never aliased
+static void test_aliases(void) {
+  host_set_micros(1000000);
+  SimpleMQTT n(1, "n");
+  SimpleMQTT g(1, "g");
+  n.set_topic_aliases(true);
+  g.set_op_mode(MODE_GW_ACK_ALL);
+  g.handleEvents_view(on_view);
+
+  size_t from = air.size();
+  n.publish("m/temp/bme280", "/value", "21.5");
+  const tx_frame bind = air.back();
+  CHECK(bind.data.find("P:@0=m/temp/bme280/value 21.5") != std::string::npos);
+  delivered.clear();
+  deliver(g, bind);
+  g.resend_loop();
+  CHECK(delivered == "m/temp/bme280/value 21.5\n");
+  CHECK(replies(from, bind.reply_id) == "ACK ");
+  ack(n, bind.reply_id);
+
+  n.publish("m/temp/bme280", "/value", "21.6");
+  const tx_frame use = air.back();
+  CHECK(use.data.find("P:@0 21.6") != std::string::npos);
+  delivered.clear();
+  deliver(g, use);
+  CHECK(delivered == "m/temp/bme280/value 21.6\n");
+  ack(n, use.reply_id);
+
+  // MODE_NODE_STD receivers can't resolve aliases
+  n.publish("B2/light/lamp", "/set", "on");
+  CHECK(air.back().data.find("P:B2/light/lamp/set on") != std::string::npos);
+  ack(n, air.back().reply_id);
+
+  // the gateway lost its bindings: ARST, then the full topic
+  memset(g.gw->alias_rx, 0, sizeof(g.gw->alias_rx));
+  n.publish("m/temp/bme280", "/value", "21.7");
+  const tx_frame lost = air.back();
+  from = air.size();
+  delivered.clear();
+  deliver(g, lost);
+  g.resend_loop();
+  CHECK(delivered.empty());
+  CHECK(replies(from, lost.reply_id) == "ARST ");
+
+  // a MODE_GW_ACK_MY gateway not addressed by the frame keeps quiet
+  {
+    SimpleMQTT other(1, "o");
+    other.set_op_mode(MODE_GW_ACK_MY);
+    from = air.size();
+    deliver(other, lost);
+    other.resend_loop();
+    CHECK(replies(from, lost.reply_id).empty());
+  }
+
+  n.parse((const uint8_t *)"ARST", 5, lost.reply_id);
+  from = air.size();
+  n.resend_loop();
+  CHECK(air.size() == from + 1);
+  if (air.size() == from + 1) {
+    CHECK(air.back().data.find("P:m/temp/bme280/value 21.7") !=
+          std::string::npos);
+    deliver(g, air.back());
+    CHECK(delivered == "m/temp/bme280/value 21.7\n");
+    ack(n, air.back().reply_id);
+  }
+  // and binds again
+  n.publish("m/temp/bme280", "/value", "21.8");
+  CHECK(air.back().data.find("=m/temp/bme280/value 21.8") !=
+        std::string::npos);
+  host_use_wall_clock();
+}
+
+// QoS 2: copies are dropped while the id is held, after the (resent)
+// release and after the hold expired; a full hold table refuses new ids
+static void test_qos2(void) {
+  host_set_micros(1000000);
+  SimpleMQTT n(1, "n");
+  SimpleMQTT g(1, "g");
+  n.set_qos("cnt", 2);
+  g.set_op_mode(MODE_GW_ACK_ALL);
+  g.handleEvents_view(on_view);
+
+  n.publish("m/cnt/c", "/value", "1");
+  const tx_frame f = air.back();
+  CHECK(f.data.find(" 2\n") != std::string::npos);
+  delivered.clear();
+  deliver(g, f);
+  deliver(g, f);
+  CHECK(delivered == "m/cnt/c/value 1\n");
+  CHECK(held_ids(g) == 1);
+
+  // ACKed: the sender releases the id until the release is ACKed
+  ack(n, f.reply_id);
+  size_t from = air.size();
+  n.resend_loop();
+  CHECK(air.size() == from + 1 && air.back().data.compare(0, 4, "REL ") == 0);
+  const tx_frame rel = air.back();
+  CHECK(n.mc_get_used_slots() == 1);
+  host_advance_millis(n.get_rto() * 4);
+  from = air.size();
+  n.resend_loop();
+  CHECK(air.size() == from + 1 && air.back().data == rel.data);
+  const tx_frame rel2 = air.back();
+
+  from = air.size();
+  deliver(g, rel);
+  g.resend_loop();
+  CHECK(held_ids(g) == 0);
+  CHECK(replies(from, rel.reply_id) == "ACK ");
+  // its ACK was lost: the resent release is ACKed again
+  deliver(g, rel2);
+  g.resend_loop();
+  CHECK(replies(from, rel2.reply_id) == "ACK ");
+  ack(n, rel2.reply_id);
+  n.resend_loop();
+  CHECK(n.mc_get_used_slots() == 0);
+
+  // a copy after the release
+  delivered.clear();
+  deliver(g, f);
+  CHECK(delivered.empty());
+
+  // a copy after the hold expired, the frame's own entry with it
+  n.publish("m/cnt/c", "/value", "2");
+  const tx_frame f2 = air.back();
+  deliver(g, f2);
+  ack(n, f2.reply_id);
+  host_advance_millis(MQTT_QOS2_HOLD_MS);
+  delivered.clear();
+  deliver(g, f2);
+  CHECK(delivered.empty());
+  CHECK(held_ids(g) == 0);
+
+  // all ids held: refused without an ACK until one is released
+  from = air.size();
+  std::vector<tx_frame> burst;
+  for (int k = 0; k <= MQTT_QOS2_ENTRIES; k++) {
+    n.publish("m/cnt/c", "/value", "3");
+    burst.push_back(air.back());
+  }
+  delivered.clear();
+  for (size_t k = 0; k < burst.size(); k++) deliver(g, burst[k]);
+  g.resend_loop();
+  CHECK(held_ids(g) == MQTT_QOS2_ENTRIES);
+  CHECK(replies(from, burst.back().reply_id).empty());
+  mqtt_stats_st s;
+  g.get_stats(&s);
+  CHECK(s.qos2_refused == 1);
+  std::string rel_first = "REL ";
+  rel_first += burst[0].data.substr(5, burst[0].data.find(' ', 5) - 5);
+  g.parse((const uint8_t *)rel_first.c_str(), rel_first.size() + 1, 0);
+  deliver(g, burst.back());
+  g.resend_loop();
+  CHECK(replies(from, burst.back().reply_id) == "ACK ");
+  host_use_wall_clock();
+}
+
+int main(int argc, char **argv) {
+  test_index_wrap();
+  test_sched_wrap();
+  test_dedup();
+  test_aliases();
+  test_qos2();
+  printf("%d checks, %d failed\n", checks, failures);
+  return failures != 0;
+}
@@ -0,0 +1,87 @@
+// Prints a trace_dump() (trace_util.h) as a timeline:
+//
+//   simplemqtt_trace_decode dump.bin [--ids]
+//
+// one line per event: time since the first event, delta to the previous
+// one, instance, event, reply id and argument. --ids also follows each
+// reply id: time from its SEND/RESEND to its ACK.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <map>
+#include <vector>
+
+#include "trace_util.h"
+
+static uint32_t get32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+int main(int argc, char **argv) {
+  const char *path = NULL;
+  bool ids = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--ids") == 0)
+      ids = true;
+    else
+      path = argv[i];
+  }
+  FILE *f = path != NULL ? fopen(path, "rb") : stdin;
+  if (f == NULL) {
+    fprintf(stderr, "usage: %s [dump.bin] [--ids]\n", argv[0]);
+    return 1;
+  }
+  uint8_t hdr[16];
+  if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) ||
+      memcmp(hdr, "MQTR", 4) != 0 || hdr[4] != TRACE_VERSION ||
+      hdr[5] != sizeof(trace_event)) {
+    fprintf(stderr, "not a version %d trace dump\n", TRACE_VERSION);
+    return 1;
+  }
+  uint32_t count = get32(hdr + 8);
+  uint32_t overwritten = get32(hdr + 12);
+  std::vector<trace_event> ev(count);
+  if (count > 0 && fread(ev.data(), sizeof(trace_event), count, f) != count) {
+    fprintf(stderr, "truncated dump\n");
+    return 1;
+  }
+  if (overwritten > 0)
+    printf("# %u older events were overwritten\n", overwritten);
+  printf("%12s %10s %4s %-10s %10s %6s\n", "t_ms", "+us", "inst", "event",
+         "id", "arg");
+
+  // timestamps are 32 bit micros(): unwrap assuming events < 71 min apart
+  uint64_t t = 0, t0 = 0, prev = 0;
+  std::map<uint32_t, uint64_t> sent;  // reply id -> send time
+  for (uint32_t i = 0; i < count; i++) {
+    const trace_event &e = ev[i];
+    if (i == 0) {
+      t = t0 = prev = e.ts_us;
+    } else {
+      t += (uint32_t)(e.ts_us - (uint32_t)t);
+    }
+    printf("%12.3f %10llu %4u %-10s %10u %6u", (t - t0) / 1000.0,
+           (unsigned long long)(t - prev), e.inst, trace_type_name(e.type),
+           e.id, e.arg);
+    if (ids) {
+      if (e.type == TRACE_SEND || e.type == TRACE_RESEND) {
+        sent[e.id] = t;
+      } else if (e.type == TRACE_ACK) {
+        auto s = sent.find(e.id);
+        if (s != sent.end()) {
+          printf("  acked after %.3f ms", (t - s->second) / 1000.0);
+          sent.erase(s);
+        }
+      }
+    }
+    printf("\n");
+    prev = t;
+  }
+  if (ids && !sent.empty()) {
+    printf("# not ACKed in the trace:");
+    for (auto &s : sent) printf(" %u", s.first);
+    printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,37 @@
+#include "hist_util.h"
+
+static uint8_t hist_index(uint32_t v) {
+  if (v < 4) return v;
+  uint8_t k = 31 - __builtin_clz(v);  // v >= 2^k, k >= 2
+  if (k > 16) return HIST_BUCKETS - 1;
+  return 4 + (k - 2) * 4 + ((v >> (k - 2)) & 3);
+}
+
+void hist_add(hist *h, uint32_t v) {
+  h->bucket[hist_index(v)]++;
+  h->count++;
+  if (v > h->max) h->max = v;
+}
+
+uint32_t hist_bucket_max(uint8_t i) {
+  if (i < 4) return i;
+  if (i >= HIST_BUCKETS - 1) return 0xFFFFFFFF;
+  uint8_t k = (i - 4) / 4 + 2;
+  uint32_t sub = (i - 4) % 4;
+  return ((4 + sub + 1) << (k - 2)) - 1;
+}
+
+uint32_t hist_percentile(const hist *h, uint16_t permille) {
+  if (h->count == 0) return 0;
+  uint64_t rank = ((uint64_t)h->count * permille + 999) / 1000;
+  if (rank == 0) rank = 1;
+  uint32_t seen = 0;
+  for (uint8_t i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->bucket[i];
+    if (seen >= rank) {
+      uint32_t m = hist_bucket_max(i);
+      return m < h->max ? m : h->max;
+    }
+  }
+  return h->max;
+}
@@ -0,0 +1,27 @@
+#ifndef __HIST_UTIL_H_
+#define __HIST_UTIL_H_
+
+#include <stdint.h>
+
+// Log-linear histogram of unsigned values: 0..3 exact, then 4 buckets per
+// power of two (at most 25% wide) up to 2^17, larger values count in the
+// last bucket. Adding is a clz and an increment, percentiles are read
+// from the counts.
+
+#define HIST_BUCKETS 64
+
+struct hist {
+  uint32_t count;
+  uint32_t max;
+  uint32_t bucket[HIST_BUCKETS];
+};
+
+void hist_add(hist *h, uint32_t v);
+// largest value of bucket i
+uint32_t hist_bucket_max(uint8_t i);
+// value below which permille/1000 of the values are, as the upper bound
+// of its bucket (but at most the maximum seen): 500 = p50, 999 = p99.9;
+// 0 if empty
+uint32_t hist_percentile(const hist *h, uint16_t permille);
+
+#endif
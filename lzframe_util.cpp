@@ -0,0 +1,114 @@
+#include "lzframe_util.h"
+
+#include <string.h>
+
+// Protocol strings, the ones most likely to occur last (a match may run
+// on into the next string).
+static const char dict[] =
+    " triggered\n closed\n open\n stop\n"
+    "/contact//trigger//shutter//dimmer//counter//string//number//float/"
+    "/int//bin//humidity//pressure//temp//switch/"
+    "/value\nG:../value\nG:.../set\nS:.../set\nS:../"
+    "/value off\n/value on\n/set off\n/set on\n"
+    "/value\nP:../\nU:m/\nG:m/\nS:m/\nP:m/MQTT ";
+#define DICT_LEN ((int)sizeof(dict) - 1)
+
+#define MIN_MATCH 3
+#define MAX_MATCH (MIN_MATCH + 0x3F)
+#define MAX_OFFSET 0x3FF
+
+bool lzframe_is(const uint8_t *data, int size) {
+  return size > 0 && data[0] == (LZFRAME_MAGIC | LZFRAME_VERSION);
+}
+
+// byte `i` of dictionary + input, i < 0 is in the dictionary
+static inline uint8_t at(const uint8_t *in, int i) {
+  return i < 0 ? (uint8_t)dict[DICT_LEN + i] : in[i];
+}
+
+// Longest match for in[i..] among the positions [from, to) of dictionary +
+// input whose first byte is in[i], found with memchr.
+static void find_match(const uint8_t *in, int i, int max, int from, int to,
+                       int *best_len, int *best_off) {
+  const uint8_t *base = from < 0 ? (const uint8_t *)dict + DICT_LEN : in;
+  const uint8_t *q = base + from;
+  const uint8_t *q_end = base + to;
+  while ((q = (const uint8_t *)memchr(q, in[i], q_end - q)) != NULL) {
+    int j = q++ - base;
+    if (at(in, j + 1) != in[i + 1] || at(in, j + *best_len) != in[i + *best_len])
+      continue;
+    int n = 2;
+    while (n < max && at(in, j + n) == in[i + n]) n++;
+    if (n > *best_len) {
+      *best_len = n;
+      *best_off = i - j;
+      if (n == max) return;
+    }
+  }
+}
+
+int lzframe_compress(uint8_t *out, int out_size, const uint8_t *in, int len) {
+  if (out_size >= len) out_size = len - 1;  // must get smaller
+  if (out_size < 2) return -1;
+  uint8_t *p = out;
+  uint8_t *end = out + out_size;
+  *p++ = LZFRAME_MAGIC | LZFRAME_VERSION;
+  uint8_t *flags = NULL;
+  int item = 8;
+  for (int i = 0; i < len;) {
+    int best_len = 0, best_off = 0;
+    int max = len - i < MAX_MATCH ? len - i : MAX_MATCH;
+    if (max >= MIN_MATCH) {
+      int from = i - MAX_OFFSET < -DICT_LEN ? -DICT_LEN : i - MAX_OFFSET;
+      if (from < 0)
+        find_match(in, i, max, from, 0, &best_len, &best_off);
+      if (best_len < max && i > 0)
+        find_match(in, i, max, from < 0 ? 0 : from, i, &best_len, &best_off);
+    }
+    if (item == 8) {
+      if (p == end) return -1;
+      flags = p++;
+      *flags = 0;
+      item = 0;
+    }
+    if (best_len >= MIN_MATCH) {
+      if (end - p < 2) return -1;
+      *flags |= 1 << item;
+      *p++ = (uint8_t)best_off;
+      *p++ = (uint8_t)((best_off >> 8) << 6 | (best_len - MIN_MATCH));
+      i += best_len;
+    } else {
+      if (p == end) return -1;
+      *p++ = in[i++];
+    }
+    item++;
+  }
+  return p - out;
+}
+
+int lzframe_decompress(uint8_t *out, int out_size, const uint8_t *in,
+                       int len) {
+  if (len < 1 || in[0] != (LZFRAME_MAGIC | LZFRAME_VERSION)) return -1;
+  const uint8_t *end = in + len;
+  const uint8_t *c = in + 1;
+  int n = 0;
+  while (c < end) {
+    uint8_t flags = *c++;
+    for (int item = 0; item < 8 && c < end; item++) {
+      if (!(flags & (1 << item))) {
+        if (n == out_size) return -1;
+        out[n++] = *c++;
+        continue;
+      }
+      if (end - c < 2) return -1;
+      int off = c[0] | (c[1] >> 6) << 8;
+      int match = (c[1] & 0x3F) + MIN_MATCH;
+      c += 2;
+      if (off == 0 || off > n + DICT_LEN || n + match > out_size) return -1;
+      // byte by byte: a match may overlap its own output
+      for (int k = n - off; match > 0; k++, match--)
+        out[n++] = k < 0 ? (uint8_t)dict[DICT_LEN + k] : out[k];
+    }
+  }
+  return n;
+}
@@ -0,0 +1,35 @@
+#ifndef __LZFRAME_UTIL_H_
+#define __LZFRAME_UTIL_H_
+
+#include <stdint.h>
+
+// LZ77 compression of whole frames (text or binary) against a built-in
+// dictionary of protocol strings ("MQTT ", "/value\n", "switch/"...), so
+// even the first occurrence of a token in a frame is a back reference:
+//
+//   frame: 0xC0|version  group*
+//   group: flag byte, bit i (LSB first) tells whether item i is a match,
+//          then up to 8 items
+//   item:  literal byte | match: offset low 8 bits,
+//          (offset >> 8) << 6 | (length - 3)
+//
+// Offsets (1..1023) count back from the current output position into the
+// dictionary followed by the output, lengths are 3..66. Decompressing
+// needs no memory besides the output buffer.
+
+#define LZFRAME_MAGIC 0xC0
+#define LZFRAME_VERSION 1
+
+// first byte of a compressed frame of this version; other frames may
+// start with it too (raw ones), see lzframe_decompress()
+bool lzframe_is(const uint8_t *data, int size);
+
+// Returns the compressed size, or -1 when it isn't smaller than `len` or
+// doesn't fit `out_size` (the caller sends the frame as it is then).
+int lzframe_compress(uint8_t *out, int out_size, const uint8_t *in, int len);
+
+// Returns the decompressed size, -1 if malformed or larger than out_size.
+int lzframe_decompress(uint8_t *out, int out_size, const uint8_t *in,
+                       int len);
+
+#endif
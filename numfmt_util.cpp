@@ -0,0 +1,177 @@
+#include "numfmt_util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const float pow10f[] = {1e0f,  1e1f,  1e2f,  1e3f,  1e4f,  1e5f,
+                               1e6f,  1e7f,  1e8f,  1e9f,  1e10f, 1e11f,
+                               1e12f, 1e13f, 1e14f, 1e15f, 1e16f, 1e17f,
+                               1e18f};
+#define MAX_DECIMALS 9
+
+// digits of v, written backwards ending at `end`, returns the first one
+static char *put_digits(char *end, uint64_t v) {
+  while (v >= 100) {
+    uint32_t i = (uint32_t)(v % 100) * 2;
+    v /= 100;
+    *--end = digit_pairs[i + 1];
+    *--end = digit_pairs[i];
+  }
+  if (v >= 10) {
+    *--end = digit_pairs[v * 2 + 1];
+    *--end = digit_pairs[v * 2];
+  } else {
+    *--end = '0' + (char)v;
+  }
+  return end;
+}
+
+static int put(char *out, int size, const char *s, int len) {
+  if (len + 1 > size) {
+    if (size > 0) out[0] = 0;
+    return 0;
+  }
+  memcpy(out, s, len);
+  out[len] = 0;
+  return len;
+}
+
+int numfmt_i32(char *out, int size, int32_t v) {
+  char b[12];
+  char *end = b + sizeof(b);
+  uint32_t u = v < 0 ? 0u - (uint32_t)v : (uint32_t)v;
+  char *p = put_digits(end, u);
+  if (v < 0) *--p = '-';
+  return put(out, size, p, end - p);
+}
+
+int numfmt_fixed(char *out, int size, int64_t scaled, uint8_t decimals) {
+  if (decimals > MAX_DECIMALS) decimals = MAX_DECIMALS;
+  char b[24];
+  char *end = b + sizeof(b);
+  uint64_t u = scaled < 0 ? 0ull - (uint64_t)scaled : (uint64_t)scaled;
+  uint64_t div = 1;
+  for (uint8_t i = 0; i < decimals; i++) div *= 10;
+  uint64_t frac = u % div;
+  // fraction without its trailing zeros
+  uint8_t n = decimals;
+  while (n > 0 && frac % 10 == 0) {
+    frac /= 10;
+    n--;
+  }
+  if (n > 0) {
+    char *f = put_digits(end, frac);
+    while (end - f < n) *--f = '0';
+    end = f;
+    *--end = '.';
+  }
+  char *p = put_digits(end, u / div);
+  if (scaled < 0 && (u / div != 0 || n > 0)) *--p = '-';
+  return put(out, size, p, b + sizeof(b) - p);
+}
+
+int numfmt_float(char *out, int size, float v, uint8_t decimals) {
+  if (decimals > MAX_DECIMALS) decimals = MAX_DECIMALS;
+  if (v != v) return put(out, size, "nan", 3);
+  float s = v * pow10f[decimals];
+  if (s >= 9e18f || s <= -9e18f) {
+    // beyond the scaled integer range, rare enough for printf
+    int n = snprintf(out, size, "%g", v);
+    return n < size ? n : 0;
+  }
+  return numfmt_fixed(out, size, (int64_t)(s < 0 ? s - 0.5f : s + 0.5f),
+                      decimals);
+}
+
+bool numparse_i32(const char *v, uint16_t len, int32_t *out) {
+  uint16_t i = 0;
+  bool neg = false;
+  if (i < len && (v[i] == '-' || v[i] == '+')) neg = v[i++] == '-';
+  uint16_t start = i;
+  uint32_t u = 0;
+  for (; i < len && v[i] >= '0' && v[i] <= '9'; i++) {
+    uint32_t d = v[i] - '0';
+    // saturate
+    u = u > (0xFFFFFFFFu - d) / 10 ? 0xFFFFFFFFu : u * 10 + d;
+  }
+  if (i == start) return false;
+  if (neg)
+    *out = u > 0x80000000u ? INT32_MIN : (int32_t)(0u - u);
+  else
+    *out = u > 0x7FFFFFFFu ? INT32_MAX : (int32_t)u;
+  return true;
+}
+
+// sign, digits as an integer and the power of ten to apply
+static bool parse_decimal(const char *v, uint16_t len, bool *neg,
+                          uint64_t *mantissa, int *exp10) {
+  uint16_t i = 0;
+  *neg = false;
+  *mantissa = 0;
+  *exp10 = 0;
+  if (i < len && (v[i] == '-' || v[i] == '+')) *neg = v[i++] == '-';
+  uint16_t digits = 0;
+  for (; i < len && v[i] >= '0' && v[i] <= '9'; i++, digits++) {
+    if (*mantissa < 100000000000000000ull)
+      *mantissa = *mantissa * 10 + (v[i] - '0');
+    else
+      (*exp10)++;
+  }
+  if (i < len && v[i] == '.') {
+    for (i++; i < len && v[i] >= '0' && v[i] <= '9'; i++, digits++) {
+      if (*mantissa < 100000000000000000ull) {
+        *mantissa = *mantissa * 10 + (v[i] - '0');
+        (*exp10)--;
+      }
+    }
+  }
+  if (digits == 0) return false;
+  if (i + 1 < len && (v[i] == 'e' || v[i] == 'E')) {
+    int32_t e;
+    if (numparse_i32(v + i + 1, len - i - 1, &e)) {
+      if (e > 100) e = 100;
+      if (e < -100) e = -100;
+      *exp10 += e;
+    }
+  }
+  return true;
+}
+
+bool numparse_fixed(const char *v, uint16_t len, uint8_t decimals,
+                    int32_t *out) {
+  bool neg;
+  uint64_t m;
+  int e;
+  if (!parse_decimal(v, len, &neg, &m, &e)) return false;
+  e += decimals;
+  for (; e > 0 && m <= 0x7FFFFFFFull; e--) m *= 10;
+  for (; e < 0 && m > 0; e++) m = e == -1 ? (m + 5) / 10 : m / 10;
+  if (e > 0 || m > 0x7FFFFFFFull) m = 0x7FFFFFFFull;
+  *out = neg ? -(int32_t)m : (int32_t)m;
+  return true;
+}
+
+bool numparse_float(const char *v, uint16_t len, float *out) {
+  bool neg;
+  uint64_t m;
+  int e;
+  if (!parse_decimal(v, len, &neg, &m, &e)) return false;
+  float f = (float)m;
+  for (; e > 18; e -= 18) f *= pow10f[18];
+  for (; e < -18; e += 18) f /= pow10f[18];
+  f = e >= 0 ? f * pow10f[e] : f / pow10f[-e];
+  *out = neg ? -f : f;
+  return true;
+}
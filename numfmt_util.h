@@ -0,0 +1,25 @@
+#ifndef __NUMFMT_UTIL_H_
+#define __NUMFMT_UTIL_H_
+
+#include <stdint.h>
+
+// Number formatting and parsing for the typed values, without the
+// printf/scanf family. The formatters return the length written ('\0'
+// terminated) or 0 when `size` is too small.
+
+int numfmt_i32(char *out, int size, int32_t v);
+// scaled / 10^decimals, trailing zeros of the fraction are dropped:
+// (2350, 2) -> "23.5", (2300, 2) -> "23"
+int numfmt_fixed(char *out, int size, int64_t scaled, uint8_t decimals);
+// v rounded to `decimals` digits, formatted as numfmt_fixed() does
+int numfmt_float(char *out, int size, float v, uint8_t decimals);
+
+// The parsers read the number at the start of the view (like sscanf
+// "%d"/"%f" do) and return false if there is none.
+bool numparse_i32(const char *v, uint16_t len, int32_t *out);
+// "23.54" with decimals 2 -> 2354, extra digits are rounded
+bool numparse_fixed(const char *v, uint16_t len, uint8_t decimals,
+                    int32_t *out);
+bool numparse_float(const char *v, uint16_t len, float *out);
+
+#endif
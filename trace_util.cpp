@@ -0,0 +1,44 @@
+#include "trace_util.h"
+
+#include <string.h>
+
+static const char *const trace_names[TRACE_TYPES] = {
+    "?",     "SEND", "QUEUED", "SEND_QOS0", "RESEND",     "ACK",
+    "ACK?",  "ACK_SENT", "RECV", "DEDUP", "LOST", "CACHE_FULL"};
+
+const char *trace_type_name(uint8_t type) {
+  return type < TRACE_TYPES ? trace_names[type] : "?";
+}
+
+#ifdef MQTT_TRACE
+static_assert((MQTT_TRACE_EVENTS & (MQTT_TRACE_EVENTS - 1)) == 0,
+              "MQTT_TRACE_EVENTS must be a power of two");
+
+trace_event trace_ring[MQTT_TRACE_EVENTS];
+uint32_t trace_head;
+
+static void put32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+uint32_t trace_dump(void (*write)(const uint8_t *data, int len)) {
+  uint32_t head = trace_head;
+  uint32_t count = head < MQTT_TRACE_EVENTS ? head : MQTT_TRACE_EVENTS;
+  uint8_t hdr[16] = {'M', 'Q', 'T', 'R', TRACE_VERSION, sizeof(trace_event)};
+  put32(hdr + 8, count);
+  put32(hdr + 12, head - count);
+  write(hdr, sizeof(hdr));
+  for (uint32_t n = head - count; n != head; n++)
+    write((const uint8_t *)&trace_ring[n & (MQTT_TRACE_EVENTS - 1)],
+          sizeof(trace_event));
+  return count;
+}
+
+void trace_clear(void) {
+  trace_head = 0;
+  memset(trace_ring, 0, sizeof(trace_ring));
+}
+#endif
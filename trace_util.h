@@ -0,0 +1,75 @@
+#ifndef __TRACE_UTIL_H_
+#define __TRACE_UTIL_H_
+
+#include <stdint.h>
+
+// Event trace of the message paths, compiled in with -DMQTT_TRACE: fixed
+// size events go into a ring of MQTT_TRACE_EVENTS (a power of two, oldest
+// overwritten), recording is a few stores. trace_dump() writes the ring
+// in binary; extras/host/trace decodes it into a timeline.
+//
+// dump: "MQTR" version(1) event_size(1) 0 0  count(4) overwritten(4)
+//       then `count` events, oldest first, little endian
+
+#ifndef MQTT_TRACE_EVENTS
+#define MQTT_TRACE_EVENTS 256
+#endif
+#define TRACE_VERSION 1
+
+enum TRACE_TYPE {
+  TRACE_SEND = 1,    // id: reply id, arg: frame size
+  TRACE_QUEUED,      // waits for the window, arg: queue length
+  TRACE_SEND_QOS0,   // arg: frame size
+  TRACE_RESEND,      // id: new reply id, arg: tries left
+  TRACE_ACK,         // ACK for a cached frame, id: reply id, arg: RTT ms
+  TRACE_ACK_UNKNOWN, // ACK for no cached frame (late, duplicate)
+  TRACE_ACK_SENT,    // id: reply id ACKed
+  TRACE_RECV,        // frame parsed, id: reply id, arg: size
+  TRACE_DEDUP,       // duplicate frame, id: reply id
+  TRACE_LOST,        // given up, id: last reply id
+  TRACE_CACHE_FULL,  // no slot or block, arg: frame size
+  TRACE_TYPES
+};
+
+#pragma pack(push, 1)
+struct trace_event {
+  uint32_t ts_us;
+  uint32_t id;
+  uint16_t arg;
+  uint8_t type;
+  uint8_t inst;  // SimpleMQTT instance
+};
+#pragma pack(pop)
+
+// "SEND", "ACK"... or "?"
+const char *trace_type_name(uint8_t type);
+
+#ifdef MQTT_TRACE
+#include <Arduino.h>
+
+extern trace_event trace_ring[MQTT_TRACE_EVENTS];
+extern uint32_t trace_head;
+
+static inline void trace_record(uint8_t type, uint8_t inst, uint32_t id,
+                                uint16_t arg) {
+#ifdef ESP32
+  // the mesh callback and the loop may record on different cores
+  uint32_t n = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+#else
+  uint32_t n = trace_head++;
+#endif
+  trace_event *e = &trace_ring[n & (MQTT_TRACE_EVENTS - 1)];
+  e->ts_us = micros();
+  e->id = id;
+  e->arg = arg;
+  e->type = type;
+  e->inst = inst;
+}
+
+// writes the dump in pieces, e.g. [](const uint8_t *d, int n) {
+// Serial.write(d, n); }; returns the number of events
+uint32_t trace_dump(void (*write)(const uint8_t *data, int len));
+void trace_clear(void);
+#endif
+
+#endif